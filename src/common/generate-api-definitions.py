@@ -15,6 +15,18 @@
 
 
 import oclspec
+import re
+
+# Commands that only return information about existing objects
+QUERY_RE = re.compile(r'^clGet\w*Info$')
+QUERY_EXTRA = (
+    'clGetSupportedImageFormats',
+    'clGetHostTimer',
+    'clGetDeviceAndHostTimer',
+)
+
+def is_query(name):
+    return QUERY_RE.match(name) is not None or name in QUERY_EXTRA
 
 if __name__ == '__main__':
     import argparse
@@ -48,6 +60,12 @@ if __name__ == '__main__':
         code += '\t"{}",\n'.format(cmd[1])
         callnum += 1
     code += '};\n'
+
+    # Generate query classification
+    code += 'static const bool gCommandIsQuery[] = {\n'
+    for cmd in commands:
+        code += '\t{},\n'.format('true' if is_query(cmd[1]) else 'false')
+    code += '};\n'
     with open(args.o, 'w') as f:
         f.write(code)
 
@@ -25,6 +25,12 @@ static const char* command_name(command cmd) {
     return gCommandNames[static_cast<uint32_t>(cmd)];
 }
 
+// True for the side-effect-free commands that only return information
+// about objects (clGet*Info and friends)
+static bool command_is_query(command cmd) {
+    return gCommandIsQuery[static_cast<uint32_t>(cmd)];
+}
+
 static command command_enum(const char* name) {
     for (uint32_t i = 0; i < static_cast<uint32_t>(command::MAX_COMMAND); i++) {
         if (!strcmp(name, gCommandNames[i])) {
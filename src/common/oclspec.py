@@ -94,6 +94,33 @@ def generate_loader(spec):
 
     return code + code_init_fn
 
+def generate_replay(spec):
+    code = ''
+    table = ''
+    for cmd in spec.commands():
+        args = ', '.join('call.arg({})'.format(i) for i in range(len(cmd.params)))
+        code += '\nstatic void replay_{}(ReplayCall& call) {{\n'.format(cmd.name)
+        code += '\tif (PFN_{} == nullptr) {{\n'.format(cmd.name)
+        code += '\t\treturn call.unavailable();\n'
+        code += '\t}\n'
+        if cmd.rettype.replace(' ', '') == 'void':
+            code += '\tPFN_{}({});\n'.format(cmd.name, args)
+            code += '\tcall.complete();\n'
+        else:
+            code += '\tauto ret = PFN_{}({});\n'.format(cmd.name, args)
+            code += '\tcall.complete(ret);\n'
+        code += '}\n'
+        table += '\treplay_{},\n'.format(cmd.name)
+
+    # Jump table indexed by oclapi::command
+    code += '\nusing replay_function = void (*)(ReplayCall&);\n'
+    code += 'static const replay_function gReplayFunctions[] = {\n'
+    code += table
+    code += '};\n'
+    code += 'static_assert(sizeof(gReplayFunctions) / sizeof(replay_function) == static_cast<uint32_t>(oclapi::command::MAX_COMMAND));\n'
+
+    return code
+
 def camel_to_all_caps(name):
     dname = ''
     p = ''
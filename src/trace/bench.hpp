@@ -0,0 +1,645 @@
+// Copyright 2019-2023 The OpenCL-Tools authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "log.hpp"
+#include "trace.hpp"
+#include "visitor-replay.hpp"
+
+// Function name of a replayed kernel, by capture ID
+static std::string replay_kernel_name(uint64_t id) {
+    auto kernel = object_replay_tracker<cl_kernel>().get(id);
+    std::string name;
+    size_t size;
+    auto err = PFN_clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, 0, nullptr,
+                                   &size);
+    if (err == CL_SUCCESS) {
+        name.resize(size);
+        err = PFN_clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, size,
+                                  name.data(), nullptr);
+        name.resize(strlen(name.c_str()));
+    }
+    if ((err != CL_SUCCESS) || name.empty()) {
+        name = "kernel#" + std::to_string(id);
+    }
+    return name;
+}
+
+// Time a command spent executing on the device, in microseconds
+static bool replay_event_device_time(cl_event event, double& time) {
+    cl_ulong start, end;
+    auto err = PFN_clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+                                           sizeof(start), &start, nullptr);
+    err |= PFN_clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,
+                                       sizeof(end), &end, nullptr);
+    if (err != CL_SUCCESS) {
+        return false;
+    }
+    time = (end - start) / 1000.0;
+    return true;
+}
+
+struct BenchmarkStats {
+    BenchmarkStats(std::vector<double> samples) {
+        std::sort(samples.begin(), samples.end());
+        auto n = samples.size();
+        min = samples.front();
+        median = percentile(samples, 50);
+        p95 = percentile(samples, 95);
+        p99 = percentile(samples, 99);
+        double sum = 0;
+        for (auto s : samples) {
+            sum += s;
+        }
+        mean = sum / n;
+        double var = 0;
+        for (auto s : samples) {
+            var += (s - mean) * (s - mean);
+        }
+        cv = (mean != 0) ? std::sqrt(var / n) / mean : 0;
+    }
+
+    double min, median, p95, p99, mean;
+    double cv; // Coefficient of variation
+private:
+    // Nearest-rank percentile of sorted samples
+    static double percentile(const std::vector<double>& sorted, unsigned p) {
+        auto rank = (p * sorted.size() + 99) / 100;
+        return sorted[std::max<size_t>(rank, 1) - 1];
+    }
+};
+
+// Replays the calls in [from, to) repeatedly and measures them. The calls
+// before the range are replayed once to set up the objects it uses. The
+// contents of the buffers that exist at the start of the range are saved
+// after set up and restored before each iteration so that all iterations do
+// the same work.
+//
+// Each iteration is timed from the first call until all the command queues
+// have finished. Kernel executions are profiled and their device time is
+// summed per kernel name for each iteration. Warm-up iterations are run but
+// not measured. Times are reported in microseconds.
+//
+// Optionally, the host data uploaded by the calls in the range is copied to
+// pinned memory (CL_MEM_ALLOC_HOST_PTR buffers, kept mapped) before the first
+// iteration and the uploads are replayed from there.
+struct ReplayBenchmark {
+
+    ReplayBenchmark(const Trace& trace, size_t from, size_t to,
+                    unsigned warmup, unsigned iterations, bool pin_uploads)
+        : m_trace(trace), m_from(from),
+          m_to(std::min(to, trace.calls().size())), m_warmup(warmup),
+          m_iterations(iterations), m_pin_uploads(pin_uploads),
+          m_replay(true) {}
+
+    void use_program_cache(ProgramBinaryCache* cache) {
+        m_replay.use_program_cache(cache);
+    }
+
+    void use_device_map(const ReplayDeviceMap* devices) {
+        m_replay.use_device_map(devices);
+    }
+
+    void use_program_overrides(const ProgramOverrides* overrides) {
+        m_replay.use_program_overrides(overrides);
+    }
+
+    void use_elided_calls(const replay_elided_calls* elided) {
+        m_replay.use_elided_calls(elided);
+    }
+
+    bool run() {
+        auto& calls = m_trace.calls();
+        if (m_from >= m_to) {
+            error("Empty benchmark range [%zu, %zu), the trace has %zu "
+                  "calls\n",
+                  m_from, m_to, calls.size());
+            return false;
+        }
+        if (m_iterations == 0) {
+            error("At least one iteration is required\n");
+            return false;
+        }
+        if (!check_range()) {
+            return false;
+        }
+
+        // Benchmarks run one after the other each have their own objects
+        replay_objects_use(&m_objects);
+        m_replay.preVisit(m_trace);
+        for (size_t i = 0; i < m_from; i++) {
+            release(m_replay.replay(calls[i]));
+        }
+        save_buffers();
+        if (m_pin_uploads) {
+            stage_uploads();
+            m_replay.use_staged_arrays(&m_staged);
+        }
+
+        for (unsigned iter = 0; iter < m_warmup + m_iterations; iter++) {
+            restore_buffers();
+            bool measured = iter >= m_warmup;
+            debug("Benchmark iteration %u%s\n", iter,
+                  measured ? "" : " (warm-up)");
+
+            std::vector<std::pair<size_t, cl_event>> events;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = m_from; i < m_to; i++) {
+                auto event = m_replay.replay(calls[i]);
+                if (event != nullptr) {
+                    // Kernels may be released before the end of the range,
+                    // names are looked up once, warm-up absorbs the cost
+                    kernel_name(i);
+                    events.emplace_back(i, event);
+                }
+            }
+            m_replay.finish();
+            auto end = std::chrono::steady_clock::now();
+            release_objects(m_range_refs);
+
+            std::unordered_map<std::string, double> kernel_times;
+            for (auto& ev : events) {
+                if (measured) {
+                    kernel_times[kernel_name(ev.first)] +=
+                        device_time(ev.second);
+                }
+                release(ev.second);
+            }
+            if (!measured) {
+                continue;
+            }
+            std::chrono::duration<double, std::micro> wall = end - start;
+            m_wall_times.push_back(wall.count());
+            for (auto& kt : kernel_times) {
+                m_kernel_times[kt.first].push_back(kt.second);
+            }
+        }
+
+        release_staging();
+        m_replay.finish();
+        release_objects(m_live);
+        m_replay.postVisit();
+        replay_objects_use(nullptr);
+        return true;
+    }
+
+    void print_table() const {
+        info("Benchmark of calls [%zu, %zu), %u iterations after %u warm-up "
+             "(us)",
+             m_from, m_to, m_iterations, m_warmup);
+        info("%-32s %12s %12s %12s %12s %12s %7s", "", "min", "median",
+             "p95", "p99", "mean", "cv");
+        print_row("wall", m_wall_times);
+        for (auto& kt : m_kernel_times) {
+            print_row(kt.first, kt.second);
+        }
+    }
+
+    const std::vector<double>& wall_times() const { return m_wall_times; }
+
+    // Device time of each iteration, by kernel name
+    const std::map<std::string, std::vector<double>>& kernel_times() const {
+        return m_kernel_times;
+    }
+
+    void write_json(std::ostream& os) const {
+        os << "{\"from\":" << m_from << ",\"to\":" << m_to
+           << ",\"warmup\":" << m_warmup << ",\"iterations\":" << m_iterations
+           << ",\"unit\":\"us\",\"wall\":";
+        write_json(os, m_wall_times);
+        os << ",\"kernels\":{";
+        const char* sep = "";
+        for (auto& kt : m_kernel_times) {
+            os << sep << "\"" << kt.first << "\":";
+            write_json(os, kt.second);
+            sep = ",";
+        }
+        os << "}}\n";
+    }
+
+private:
+    using refcounts = replay_live_objects;
+
+    // Reference counts of the objects alive after the calls in [0, end)
+    refcounts live_objects(size_t end) const {
+        refcounts counts;
+        auto& calls = m_trace.calls();
+        for (size_t i = 0; i < end; i++) {
+            replay_live_objects_update(calls[i], counts);
+        }
+        return counts;
+    }
+
+    // The range must leave the objects that exist before it as it found them
+    // for it to be replayed more than once
+    bool check_range() {
+        m_live = live_objects(m_from);
+        auto& before = m_live;
+        auto after = live_objects(m_to);
+        for (auto& obj : before) {
+            auto it = after.find(obj.first);
+            if ((it == after.end()) || (it->second < obj.second)) {
+                error("Calls [%zu, %zu) release objects created before them "
+                      "and can't be replayed repeatedly\n",
+                      m_from, m_to);
+                return false;
+            }
+            if (obj.first.first == CALL_PARAM_TEMPLATE_TYPE_CL_MEM) {
+                m_mems.push_back(obj.first.second);
+            } else if (obj.first.first ==
+                       CALL_PARAM_TEMPLATE_TYPE_CL_COMMANDQUEUE) {
+                m_setup_queues.push_back(obj.first.second);
+            }
+        }
+        // References the range takes and keeps would pile up with each
+        // iteration, they are dropped at its end
+        for (auto& obj : after) {
+            auto it = before.find(obj.first);
+            int kept = obj.second - ((it != before.end()) ? it->second : 0);
+            if (kept > 0) {
+                m_range_refs[obj.first] = kept;
+            }
+        }
+        if (!m_range_refs.empty()) {
+            debug("Releasing %zu objects at the end of each iteration\n",
+                  m_range_refs.size());
+        }
+        return true;
+    }
+
+    cl_command_queue queue_for(cl_context context) const {
+        for (auto id : m_setup_queues) {
+            auto queue = object_replay_tracker<cl_command_queue>().get(id);
+            cl_context qctx;
+            auto err = PFN_clGetCommandQueueInfo(queue, CL_QUEUE_CONTEXT,
+                                                 sizeof(qctx), &qctx, nullptr);
+            if ((err == CL_SUCCESS) && (qctx == context)) {
+                return queue;
+            }
+        }
+        return nullptr;
+    }
+
+    void save_buffers() {
+        size_t num_images = 0;
+        for (auto id : m_mems) {
+            auto mem = object_replay_tracker<cl_mem>().get(id);
+            cl_mem_object_type type;
+            size_t size;
+            cl_context context;
+            auto err = PFN_clGetMemObjectInfo(mem, CL_MEM_TYPE, sizeof(type),
+                                              &type, nullptr);
+            err |= PFN_clGetMemObjectInfo(mem, CL_MEM_SIZE, sizeof(size),
+                                          &size, nullptr);
+            err |= PFN_clGetMemObjectInfo(mem, CL_MEM_CONTEXT, sizeof(context),
+                                          &context, nullptr);
+            if (err != CL_SUCCESS) {
+                fatal("Can't query memory object #%llu\n",
+                      static_cast<unsigned long long>(id));
+            }
+            if (type != CL_MEM_OBJECT_BUFFER) {
+                num_images++;
+                continue;
+            }
+            auto queue = queue_for(context);
+            if (queue == nullptr) {
+                warn("No command queue to save buffer #%llu, it won't be "
+                     "restored\n",
+                     static_cast<unsigned long long>(id));
+                continue;
+            }
+            SavedBuffer saved{mem, queue, std::vector<char>(size)};
+            err = PFN_clEnqueueReadBuffer(queue, mem, CL_TRUE, 0, size,
+                                          saved.contents.data(), 0, nullptr,
+                                          nullptr);
+            if (err != CL_SUCCESS) {
+                fatal("Can't save buffer #%llu, err = %d\n",
+                      static_cast<unsigned long long>(id), err);
+            }
+            m_saved.push_back(std::move(saved));
+        }
+        if (num_images != 0) {
+            warn("%zu images won't be restored between iterations\n",
+                 num_images);
+        }
+    }
+
+    void stage_uploads() {
+        auto& calls = m_trace.calls();
+        size_t size = 0;
+        size_t num_unstaged = 0;
+        // Context of the command queues created in the range
+        std::unordered_map<uint64_t, uint64_t> queue_contexts;
+        for (size_t i = m_from; i < m_to; i++) {
+            auto& params = calls[i].params();
+            CallParam* data;
+            CallParam* owner; // Command queue or context
+            switch (calls[i].id()) {
+            case oclapi::command::CREATE_COMMAND_QUEUE:
+            case oclapi::command::CREATE_COMMAND_QUEUE_WITH_PROPERTIES: {
+                auto queue =
+                    call_param_object_creation_ids(calls[i].retval().get());
+                queue_contexts[queue.at(0)] =
+                    call_param_object_use_ids(params[0].get())[0];
+                continue;
+            }
+            case oclapi::command::ENQUEUE_WRITE_BUFFER:
+                data = params[5].get();
+                owner = params[0].get();
+                break;
+            case oclapi::command::ENQUEUE_WRITE_IMAGE:
+                data = params[7].get();
+                owner = params[0].get();
+                break;
+            case oclapi::command::CREATE_BUFFER: {
+                auto flags = call_param_value_as<cl_mem_flags>(params[1].get());
+                if (!(flags & CL_MEM_COPY_HOST_PTR)) {
+                    continue;
+                }
+                data = params[3].get();
+                owner = params[0].get();
+                break;
+            }
+            case oclapi::command::CREATE_IMAGE: {
+                auto flags = call_param_value_as<cl_mem_flags>(params[1].get());
+                if (!(flags & CL_MEM_COPY_HOST_PTR)) {
+                    continue;
+                }
+                data = params[4].get();
+                owner = params[0].get();
+                break;
+            }
+            default:
+                continue;
+            }
+            if (call_param_array_null_pointer(data)) {
+                continue;
+            }
+            auto& bytes = static_cast<CallParamArray<char>*>(data)->values();
+            if (bytes.empty()) {
+                continue;
+            }
+
+            // Objects created in the range don't exist yet, uploads to
+            // queues created in the range are staged with another queue of
+            // their context
+            auto owner_type = owner->ttype();
+            auto owner_id = call_param_object_use_ids(owner)[0];
+            if (owner_type == CALL_PARAM_TEMPLATE_TYPE_CL_COMMANDQUEUE) {
+                auto created = queue_contexts.find(owner_id);
+                if (created != queue_contexts.end()) {
+                    owner_type = CALL_PARAM_TEMPLATE_TYPE_CL_CONTEXT;
+                    owner_id = created->second;
+                }
+            }
+            if (m_live.count({owner_type, owner_id}) == 0) {
+                num_unstaged++;
+                continue;
+            }
+            cl_command_queue queue;
+            cl_context context;
+            if (owner_type == CALL_PARAM_TEMPLATE_TYPE_CL_COMMANDQUEUE) {
+                queue = object_replay_tracker<cl_command_queue>().get(owner_id);
+                PFN_clGetCommandQueueInfo(queue, CL_QUEUE_CONTEXT,
+                                          sizeof(context), &context, nullptr);
+            } else {
+                context = object_replay_tracker<cl_context>().get(owner_id);
+                queue = queue_for(context);
+                if (queue == nullptr) {
+                    num_unstaged++;
+                    continue;
+                }
+            }
+
+            cl_int err;
+            auto mem = PFN_clCreateBuffer(context, CL_MEM_ALLOC_HOST_PTR,
+                                          bytes.size(), nullptr, &err);
+            if (err != CL_SUCCESS) {
+                fatal("Can't create staging buffer, err = %d\n", err);
+            }
+            auto ptr = PFN_clEnqueueMapBuffer(queue, mem, CL_TRUE, CL_MAP_WRITE,
+                                              0, bytes.size(), 0, nullptr,
+                                              nullptr, &err);
+            if (err != CL_SUCCESS) {
+                fatal("Can't map staging buffer, err = %d\n", err);
+            }
+            memcpy(ptr, bytes.data(), bytes.size());
+            m_staging.push_back({mem, queue, ptr});
+            m_staged[data] = ptr;
+            size += bytes.size();
+        }
+        info("Staged %zu uploads in pinned memory (%zu bytes)",
+             m_staging.size(), size);
+        if (num_unstaged != 0) {
+            warn("%zu uploads use a context created in the range or without "
+                 "a command queue and are not staged\n",
+                 num_unstaged);
+        }
+    }
+
+    void release_staging() {
+        for (auto& staging : m_staging) {
+            PFN_clEnqueueUnmapMemObject(staging.queue, staging.mem,
+                                        staging.ptr, 0, nullptr, nullptr);
+            PFN_clFinish(staging.queue);
+            PFN_clReleaseMemObject(staging.mem);
+        }
+        m_staging.clear();
+        m_staged.clear();
+    }
+
+    void restore_buffers() {
+        for (auto& saved : m_saved) {
+            auto err = PFN_clEnqueueWriteBuffer(
+                saved.queue, saved.mem, CL_TRUE, 0, saved.contents.size(),
+                saved.contents.data(), 0, nullptr, nullptr);
+            if (err != CL_SUCCESS) {
+                fatal("Can't restore buffer, err = %d\n", err);
+            }
+        }
+    }
+
+    const std::string& kernel_name(size_t index) {
+        auto it = m_kernel_names.find(index);
+        if (it != m_kernel_names.end()) {
+            return it->second;
+        }
+        auto& call = m_trace.calls()[index];
+        auto id = call_param_object_use_ids(call.params()[1].get())[0];
+        return m_kernel_names[index] = replay_kernel_name(id);
+    }
+
+    double device_time(cl_event event) {
+        double time;
+        if (!replay_event_device_time(event, time)) {
+            if (!m_warned_profiling) {
+                warn("Profiling information not available for kernels\n");
+                m_warned_profiling = true;
+            }
+            return 0;
+        }
+        return time;
+    }
+
+    // Drop references the application holds, the calls that would release
+    // them aren't replayed
+    void release_objects(const refcounts& objects) {
+        for (auto& obj : objects) {
+            auto id = obj.first.second;
+            for (int ref = 0; ref < obj.second; ref++) {
+                switch (obj.first.first) {
+                case CALL_PARAM_TEMPLATE_TYPE_CL_CONTEXT:
+                    PFN_clReleaseContext(
+                        object_replay_tracker<cl_context>().get(id));
+                    break;
+                case CALL_PARAM_TEMPLATE_TYPE_CL_COMMANDQUEUE:
+                    PFN_clReleaseCommandQueue(
+                        object_replay_tracker<cl_command_queue>().get(id));
+                    break;
+                case CALL_PARAM_TEMPLATE_TYPE_CL_PROGRAM:
+                    PFN_clReleaseProgram(
+                        object_replay_tracker<cl_program>().get(id));
+                    break;
+                case CALL_PARAM_TEMPLATE_TYPE_CL_KERNEL:
+                    PFN_clReleaseKernel(
+                        object_replay_tracker<cl_kernel>().get(id));
+                    break;
+                case CALL_PARAM_TEMPLATE_TYPE_CL_MEM:
+                    PFN_clReleaseMemObject(
+                        object_replay_tracker<cl_mem>().get(id));
+                    break;
+                case CALL_PARAM_TEMPLATE_TYPE_CL_EVENT:
+                    PFN_clReleaseEvent(
+                        object_replay_tracker<cl_event>().get(id));
+                    break;
+                case CALL_PARAM_TEMPLATE_TYPE_CL_SAMPLER:
+                    PFN_clReleaseSampler(
+                        object_replay_tracker<cl_sampler>().get(id));
+                    break;
+                default:
+                    // Platforms and devices are left to the implementation
+                    break;
+                }
+            }
+        }
+    }
+
+    static void release(cl_event event) {
+        if (event != nullptr) {
+            PFN_clReleaseEvent(event);
+        }
+    }
+
+    static void print_row(const std::string& name,
+                          const std::vector<double>& samples) {
+        BenchmarkStats stats(samples);
+        info("%-32s %12.2f %12.2f %12.2f %12.2f %12.2f %6.2f%%",
+             name.c_str(), stats.min, stats.median, stats.p95, stats.p99,
+             stats.mean, stats.cv * 100);
+    }
+
+    static void write_json(std::ostream& os,
+                           const std::vector<double>& samples) {
+        BenchmarkStats stats(samples);
+        os << "{\"min\":" << stats.min << ",\"median\":" << stats.median
+           << ",\"p95\":" << stats.p95 << ",\"p99\":" << stats.p99
+           << ",\"mean\":" << stats.mean << ",\"cv\":" << stats.cv
+           << ",\"samples\":[";
+        const char* sep = "";
+        for (auto s : samples) {
+            os << sep << s;
+            sep = ",";
+        }
+        os << "]}";
+    }
+
+    struct StagingBuffer {
+        cl_mem mem;
+        cl_command_queue queue;
+        void* ptr;
+    };
+
+    struct SavedBuffer {
+        cl_mem mem;
+        cl_command_queue queue;
+        std::vector<char> contents;
+    };
+
+    const Trace& m_trace;
+    size_t m_from;
+    size_t m_to;
+    unsigned m_warmup;
+    unsigned m_iterations;
+    bool m_pin_uploads;
+    ReplayObjects m_objects;
+    TraceReplayVisitor m_replay;
+    refcounts m_live; // Objects alive at the start of the range
+    // References the range takes and keeps
+    refcounts m_range_refs;
+    std::vector<uint64_t> m_mems;         // Alive at the start of the range
+    std::vector<uint64_t> m_setup_queues; // Alive at the start of the range
+    std::vector<SavedBuffer> m_saved;
+    std::vector<StagingBuffer> m_staging;
+    replay_staged_arrays m_staged;
+    std::unordered_map<size_t, std::string> m_kernel_names;
+    bool m_warned_profiling = false;
+    std::vector<double> m_wall_times;
+    std::map<std::string, std::vector<double>> m_kernel_times;
+};
+
+// Compare the median times of two benchmarks of the same calls, such as
+// before and after overriding programs
+static void print_benchmark_comparison(const ReplayBenchmark& base,
+                                       const ReplayBenchmark& other) {
+    auto row = [](const std::string& name, const std::vector<double>* before,
+                  const std::vector<double>* after) {
+        auto median = [](const std::vector<double>* samples) {
+            return (samples != nullptr) ? BenchmarkStats(*samples).median
+                                        : 0.0;
+        };
+        auto b = median(before), a = median(after);
+        if ((before == nullptr) || (after == nullptr) || (b == 0)) {
+            info("%-32s %12.2f %12.2f %9s", name.c_str(), b, a, "-");
+        } else {
+            info("%-32s %12.2f %12.2f %+8.1f%%", name.c_str(), b, a,
+                 (a - b) / b * 100);
+        }
+    };
+    info("Median times (us)");
+    info("%-32s %12s %12s %9s", "", "original", "override", "delta");
+    row("wall", &base.wall_times(), &other.wall_times());
+    auto& before = base.kernel_times();
+    auto& after = other.kernel_times();
+    for (auto& kt : before) {
+        auto it = after.find(kt.first);
+        row(kt.first, &kt.second, (it != after.end()) ? &it->second : nullptr);
+    }
+    for (auto& kt : after) {
+        if (before.count(kt.first) == 0) {
+            row(kt.first, nullptr, &kt.second);
+        }
+    }
+}
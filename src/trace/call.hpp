@@ -16,6 +16,7 @@
 
 #include "cl_headers.hpp"
 
+#include <cassert>
 #include <cstring>
 #include <iostream>
 
@@ -24,8 +25,14 @@
 #include "log.hpp"
 #include "serialize.hpp"
 
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
 #include <memory>
+#include <string_view>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 using namespace oclapi;
@@ -71,31 +78,84 @@ private:
     std::unordered_map<T, uint64_t> m_objects;
 };
 
+// Objects are given sequential IDs at capture time, which index the replayed
+// objects directly. The references the application holds are counted so that
+// uses after the last release are caught. Released slots are filled again
+// when their object is created anew, as when calls are replayed repeatedly.
 template <typename T> class ReplayObjectTracker {
 
 public:
     ReplayObjectTracker() {}
 
+    // Make room for IDs up to size - 1
+    void reserve(uint64_t size) {
+        if (size > m_objects.size()) {
+            m_objects.resize(size);
+        }
+    }
+
     void add(uint64_t id, T obj) {
         debug("Replay object tracker: ID #%llu now alive as %p\n",
               static_cast<unsigned long long>(id), obj);
-        m_objects[id] = obj;
+        reserve(id + 1);
+        m_objects[id] = {obj, 1};
     }
 
+    // Replace a live object, keeping its references
+    void replace(uint64_t id, T obj) { slot(id).obj = obj; }
+
     T get(uint64_t id) const {
-        if (m_objects.find(id) != m_objects.end()) {
-            auto val = m_objects.at(id);
-            debug("Replay object tracker: getting pointer for #%llu => %p\n",
-                  static_cast<unsigned long long>(id), val);
-            return val;
+        if constexpr (std::is_same_v<T, cl_platform_id>) {
+            if (id == static_cast<uint64_t>(-1)) {
+                return nullptr;
+            }
+        }
+        auto val = slot(id).obj;
+        debug("Replay object tracker: getting pointer for #%llu => %p\n",
+              static_cast<unsigned long long>(id), val);
+        return val;
+    }
+
+    void retain(uint64_t id) { slot(id).refs++; }
+
+    void release(uint64_t id) {
+        if (--slot(id).refs == 0) {
+            debug("Replay object tracker: ID #%llu released\n",
+                  static_cast<unsigned long long>(id));
+        }
+    }
+
+private:
+    struct Slot {
+        T obj = nullptr;
+        uint32_t refs = 0;
+    };
+
+    const Slot& slot(uint64_t id) const {
+        if (id < m_objects.size()) {
+            auto& slot = m_objects[id];
+            if (slot.refs > 0) {
+                return slot;
+            }
+            if (slot.obj != nullptr) {
+                fatal("Instance #%llu used after its last release\n",
+                      static_cast<unsigned long long>(id));
+            }
         }
         fatal("Unknown instance for #%llu\n",
               static_cast<unsigned long long>(id));
-        return 0;
+        abort();
     }
 
-private:
-    std::unordered_map<uint64_t, T> m_objects;
+    Slot& slot(uint64_t id) {
+        return const_cast<Slot&>(std::as_const(*this).slot(id));
+    }
+
+    // Calls replayed from several threads only ever touch the slots of the
+    // objects they use, which the replay orders. Slots are reserved for all
+    // the IDs of a trace before such a replay starts, so they're never moved
+    // while in use and lookups don't need a lock.
+    std::vector<Slot> m_objects;
 };
 
 static ObjectTracker<cl_platform_id> gTracker_platforms;
@@ -106,6 +166,7 @@ static ObjectTracker<cl_program> gTracker_programs;
 static ObjectTracker<cl_kernel> gTracker_kernels;
 static ObjectTracker<cl_mem> gTracker_mems;
 static ObjectTracker<cl_event> gTracker_events;
+static ObjectTracker<cl_sampler> gTracker_samplers;
 
 template <typename T> auto& object_capture_tracker() = delete;
 template <> inline auto& object_capture_tracker<cl_platform_id>() {
@@ -135,12 +196,64 @@ template <> inline auto& object_capture_tracker<cl_mem>() {
 template <> inline auto& object_capture_tracker<cl_event>() {
     return gTracker_events;
 }
+template <> inline auto& object_capture_tracker<cl_sampler>() {
+    return gTracker_samplers;
+}
 
-static ReplayObjectTracker<cl_platform_id> gReplayTracker_platforms;
+// Objects of a replay. Replays running concurrently in the same process each
+// have their own, the set a thread uses is chosen with replay_objects_use().
+struct ReplayObjects {
+    ReplayObjectTracker<cl_platform_id> platforms;
+    ReplayObjectTracker<cl_device_id> devices;
+    ReplayObjectTracker<cl_context> contexts;
+    ReplayObjectTracker<cl_command_queue> queues;
+    ReplayObjectTracker<cl_program> programs;
+    ReplayObjectTracker<cl_kernel> kernels;
+    ReplayObjectTracker<cl_mem> mems;
+    ReplayObjectTracker<cl_event> events;
+    ReplayObjectTracker<cl_sampler> samplers;
+    ReplayObjectTracker<void*> map_pointers;
+};
+
+static ReplayObjects gReplayObjects;
+static thread_local ReplayObjects* tReplayObjects = &gReplayObjects;
+
+// Replay the calls made by this thread with objects, nullptr for the ones
+// shared by all threads
+inline void replay_objects_use(ReplayObjects* objects) {
+    tReplayObjects = (objects != nullptr) ? objects : &gReplayObjects;
+}
 
 template <typename T> auto& object_replay_tracker() = delete;
 template <> inline auto& object_replay_tracker<cl_platform_id>() {
-    return gReplayTracker_platforms;
+    return tReplayObjects->platforms;
+}
+template <> inline auto& object_replay_tracker<cl_device_id>() {
+    return tReplayObjects->devices;
+}
+template <> inline auto& object_replay_tracker<cl_context>() {
+    return tReplayObjects->contexts;
+}
+template <> inline auto& object_replay_tracker<cl_command_queue>() {
+    return tReplayObjects->queues;
+}
+template <> inline auto& object_replay_tracker<cl_program>() {
+    return tReplayObjects->programs;
+}
+template <> inline auto& object_replay_tracker<cl_kernel>() {
+    return tReplayObjects->kernels;
+}
+template <> inline auto& object_replay_tracker<cl_mem>() {
+    return tReplayObjects->mems;
+}
+template <> inline auto& object_replay_tracker<cl_event>() {
+    return tReplayObjects->events;
+}
+template <> inline auto& object_replay_tracker<cl_sampler>() {
+    return tReplayObjects->samplers;
+}
+inline auto& map_pointer_replay_tracker() {
+    return tReplayObjects->map_pointers;
 }
 
 //
@@ -188,6 +301,65 @@ private:
 
 static MemObjectMappingTracker gMemObjectMappingTracker;
 
+//
+// String interning
+//
+
+// Trace-wide table of unique strings (kernel names, build options, program
+// sources). Lookups are done on string views so that interning a string that
+// is already in the table neither copies nor allocates.
+class StringTable {
+
+public:
+    uint32_t intern(std::string_view str) {
+        auto it = m_index.find(str);
+        if (it != m_index.end()) {
+            return it->second;
+        }
+        auto idx = static_cast<uint32_t>(m_strings.size());
+        // Elements of a deque never move, keys can point into them
+        m_strings.emplace_back(str);
+        m_index.emplace(m_strings.back(), idx);
+        debug("String table: interned %zu bytes as #%u\n", str.size(), idx);
+        return idx;
+    }
+
+    const std::string& get(uint32_t idx) const {
+        if (idx >= m_strings.size()) {
+            fatal("String table: unknown string #%u\n", idx);
+        }
+        return m_strings[idx];
+    }
+
+    size_t size() const { return m_strings.size(); }
+
+    size_t num_bytes() const {
+        size_t size = 0;
+        for (auto& str : m_strings) {
+            size += str.size();
+        }
+        return size;
+    }
+
+    void serialize(std::ostream& os) const {
+        ::serialize(os, static_cast<uint32_t>(m_strings.size()));
+        for (auto& str : m_strings) {
+            ::serialize(os, str);
+        }
+    }
+
+    void deserialize(std::istream& is) {
+        uint32_t num_strings = ::deserialize<uint32_t>(is);
+        for (uint32_t i = 0; i < num_strings; i++) {
+            intern(::deserialize<std::string>(is));
+        }
+    }
+
+private:
+    std::deque<std::string> m_strings;
+    std::unordered_map<std::string_view, uint32_t> m_index;
+};
+
 //
 // Call parameters
 //
@@ -229,6 +401,7 @@ enum CallParamTemplateType : uint32_t
     CALL_PARAM_TEMPLATE_TYPE_CL_EVENT,
     CALL_PARAM_TEMPLATE_TYPE_CL_IMAGE_FORMAT,
     CALL_PARAM_TEMPLATE_TYPE_CL_IMAGE_DESC,
+    CALL_PARAM_TEMPLATE_TYPE_CL_SAMPLER,
 };
 
 template <typename T> CallParamTemplateType call_param_template_type() = delete;
@@ -284,6 +457,10 @@ template <> inline CallParamTemplateType call_param_template_type<cl_event>() {
     return CALL_PARAM_TEMPLATE_TYPE_CL_EVENT;
 }
 template <>
+inline CallParamTemplateType call_param_template_type<cl_sampler>() {
+    return CALL_PARAM_TEMPLATE_TYPE_CL_SAMPLER;
+}
+template <>
 inline CallParamTemplateType call_param_template_type<cl_image_format>() {
     return CALL_PARAM_TEMPLATE_TYPE_CL_IMAGE_FORMAT;
 }
@@ -312,6 +489,7 @@ static std::unordered_map<CallParamTemplateType, const char*> gTypeEnumToName =
         {CALL_PARAM_TEMPLATE_TYPE_CL_EVENT, "cl_event"},
         {CALL_PARAM_TEMPLATE_TYPE_CL_IMAGE_FORMAT, "cl_image_format"},
         {CALL_PARAM_TEMPLATE_TYPE_CL_IMAGE_DESC, "cl_image_desc"},
+        {CALL_PARAM_TEMPLATE_TYPE_CL_SAMPLER, "cl_sampler"},
 };
 
 static const char* call_param_template_type_name(CallParamTemplateType type) {
@@ -319,12 +497,14 @@ static const char* call_param_template_type_name(CallParamTemplateType type) {
 }
 
 static CallParamTemplateType tracked_kernel_argument_object_type(void* obj) {
-    // TODO samplers
     if (object_capture_tracker<cl_mem>().is_tracked(static_cast<cl_mem>(obj))) {
         return CALL_PARAM_TEMPLATE_TYPE_CL_MEM;
     } else if (object_capture_tracker<cl_command_queue>().is_tracked(
                    static_cast<cl_command_queue>(obj))) {
         return CALL_PARAM_TEMPLATE_TYPE_CL_COMMANDQUEUE;
+    } else if (object_capture_tracker<cl_sampler>().is_tracked(
+                   static_cast<cl_sampler>(obj))) {
+        return CALL_PARAM_TEMPLATE_TYPE_CL_SAMPLER;
     } else {
         return CALL_PARAM_TEMPLATE_TYPE_NONE;
     }
@@ -345,6 +525,9 @@ struct CallParam {
 
     virtual size_t output_memory_requirements() const { return 0; }
 
+    // Move any string this parameter refers to into another string table
+    virtual void reintern(StringTable& /*strings*/) {}
+
 private:
     CallParamType m_type;
     CallParamTemplateType m_ttype;
@@ -449,6 +632,8 @@ template <typename T> struct CallParamValueOutByRef : public CallParam {
 
     bool null_pointer() const { return m_null_pointer; }
 
+    const std::vector<char>& data() const { return m_memory; }
+
     size_t output_memory_requirements() const { return m_memory.size(); }
 
     void print(std::ostream& out) const override {
@@ -685,29 +870,43 @@ private:
 
 struct CallParamProgramSource : public CallParam {
 
-    CallParamProgramSource(std::istream& is) : CallParamProgramSource() {
+    CallParamProgramSource(std::istream& is, const StringTable& strings)
+        : CallParamProgramSource() {
         uint32_t num_sources = ::deserialize<uint32_t>(is);
         for (uint32_t i = 0; i < num_sources; i++) {
-            m_sources.push_back(::deserialize<std::string>(is));
+            m_sources.push_back(::deserialize<uint32_t>(is));
         }
+        m_strings = &strings;
     }
 
-    CallParamProgramSource(size_t count, const size_t* lengths,
-                           const char** strings)
+    CallParamProgramSource(StringTable& strings, size_t count,
+                           const size_t* lengths, const char** sources)
         : CallParamProgramSource() {
         for (size_t i = 0; i < count; i++) {
             size_t len = (lengths != nullptr) ? lengths[i] : 0;
-            std::string src;
+            std::string_view src;
             if (len != 0) {
-                src.append(strings[i], len);
+                src = std::string_view(sources[i], len);
             } else {
-                src.append(strings[i]);
+                src = std::string_view(sources[i]);
             }
-            m_sources.push_back(src);
+            m_sources.push_back(strings.intern(src));
         }
+        m_strings = &strings;
     }
 
-    const std::vector<std::string>& sources() const { return m_sources; }
+    size_t num_sources() const { return m_sources.size(); }
+
+    const std::string& source(size_t i) const {
+        return m_strings->get(m_sources[i]);
+    }
+
+    void reintern(StringTable& strings) override {
+        for (auto& idx : m_sources) {
+            idx = strings.intern(m_strings->get(idx));
+        }
+        m_strings = &strings;
+    }
 
     void print(std::ostream& out) const override {
         out << "Program source paramam: num sources = " << m_sources.size()
@@ -728,44 +927,66 @@ struct CallParamProgramSource : public CallParam {
 private:
     CallParamProgramSource()
         : CallParam(CALL_PARAM_PROGRAM_SOURCE, CALL_PARAM_TEMPLATE_TYPE_NONE) {}
-    std::vector<std::string> m_sources;
+    // Indices into the trace's string table
+    std::vector<uint32_t> m_sources;
+    const StringTable* m_strings;
 };
 
 struct CallParamString : public CallParam {
 
-    CallParamString(std::istream& is) : CallParamString() {
+    CallParamString(std::istream& is, const StringTable& strings)
+        : CallParamString() {
         m_present = ::deserialize<bool>(is);
-        m_str = ::deserialize<std::string>(is);
+        if (m_present) {
+            m_str = ::deserialize<uint32_t>(is);
+        }
+        m_strings = &strings;
     }
 
-    CallParamString(const char* str) : CallParamString() {
+    CallParamString(StringTable& strings, const char* str) : CallParamString() {
         if (str != nullptr) {
             m_present = true;
-            m_str = str;
+            m_str = strings.intern(str);
         } else {
             m_present = false;
         }
+        m_strings = &strings;
     }
 
     bool present() const { return m_present; }
-    const std::string& str() const { return m_str; }
+    const std::string& str() const { return m_strings->get(m_str); }
+
+    void reintern(StringTable& strings) override {
+        if (m_present) {
+            m_str = strings.intern(str());
+        }
+        m_strings = &strings;
+    }
 
     void print(std::ostream& out) const override {
-        out << "String param: " << m_str << std::endl;
+        out << "String param: ";
+        if (m_present) {
+            out << str();
+        }
+        out << std::endl;
     }
 
     void serialize(std::ostream& os) const {
         ::serialize(os, CALL_PARAM_STRING);
         ::serialize(os, CALL_PARAM_TEMPLATE_TYPE_NONE);
         ::serialize(os, m_present);
-        ::serialize(os, m_str);
+        if (m_present) {
+            ::serialize(os, m_str);
+        }
     }
 
 private:
     CallParamString()
         : CallParam(CALL_PARAM_STRING, CALL_PARAM_TEMPLATE_TYPE_NONE) {}
     bool m_present;
-    std::string m_str;
+    // Index into the trace's string table
+    uint32_t m_str;
+    const StringTable* m_strings;
 };
 
 struct CallParamMapPointerCreation : public CallParam {
@@ -827,7 +1048,8 @@ private:
     uint64_t m_id;
 };
 
-static CallParam* construct_call_param(std::istream& is) {
+static CallParam* construct_call_param(std::istream& is,
+                                       const StringTable& strings) {
     CallParamType ptype = ::deserialize<CallParamType>(is);
     CallParamTemplateType ttype = ::deserialize<CallParamTemplateType>(is);
 
@@ -867,6 +1089,8 @@ static CallParam* construct_call_param(std::istream& is) {
             return new CallParamOptionalObjectCreation<cl_mem>(is);
         case CALL_PARAM_TEMPLATE_TYPE_CL_EVENT:
             return new CallParamOptionalObjectCreation<cl_event>(is);
+        case CALL_PARAM_TEMPLATE_TYPE_CL_SAMPLER:
+            return new CallParamOptionalObjectCreation<cl_sampler>(is);
         case CALL_PARAM_TEMPLATE_TYPE_NONE:
         case CALL_PARAM_TEMPLATE_TYPE_VOID:
             abort();
@@ -904,6 +1128,8 @@ static CallParam* construct_call_param(std::istream& is) {
             return new CallParamObjectUse<cl_event>(is);
         case CALL_PARAM_TEMPLATE_TYPE_CL_COMMANDQUEUE:
             return new CallParamObjectUse<cl_command_queue>(is);
+        case CALL_PARAM_TEMPLATE_TYPE_CL_SAMPLER:
+            return new CallParamObjectUse<cl_sampler>(is);
         case CALL_PARAM_TEMPLATE_TYPE_NONE:
         case CALL_PARAM_TEMPLATE_TYPE_VOID:
             abort();
@@ -931,9 +1157,9 @@ static CallParam* construct_call_param(std::istream& is) {
         }
         break;
     case CALL_PARAM_PROGRAM_SOURCE:
-        return new CallParamProgramSource(is);
+        return new CallParamProgramSource(is, strings);
     case CALL_PARAM_STRING:
-        return new CallParamString(is);
+        return new CallParamString(is, strings);
     case CALL_PARAM_MAP_POINTER_CREATION:
         return new CallParamMapPointerCreation(is);
     case CALL_PARAM_MAP_POINTER_USE:
@@ -945,14 +1171,262 @@ static CallParam* construct_call_param(std::istream& is) {
     return nullptr;
 }
 
+//
+// Object parameter helpers
+//
+
+// Capture ID of the platform given as the CL_CONTEXT_PLATFORM property of a
+// context property list, -1 when there is none
+static uint64_t call_param_properties_platform_id(CallParam* param) {
+    assert(param->type() == CALL_PARAM_PROPERTIES);
+    auto& props = static_cast<CallParamProperties*>(param)->properties();
+    for (size_t i = 0; i + 1 < props.size(); i += 2) {
+        if (props[i] == CL_CONTEXT_PLATFORM) {
+            return static_cast<uint64_t>(props[i + 1]);
+        }
+    }
+    return static_cast<uint64_t>(-1);
+}
+
+static const std::vector<uint64_t>&
+call_param_object_use_ids(CallParam* param) {
+    auto ptype = param->type();
+    auto ttype = param->ttype();
+    assert(ptype == CALL_PARAM_OBJECT_USE);
+    switch (ttype) {
+    case CALL_PARAM_TEMPLATE_TYPE_CL_PLATFORM_ID:
+        return static_cast<CallParamObjectUse<cl_platform_id>*>(param)
+            ->object_ids();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_DEVICE_ID:
+        return static_cast<CallParamObjectUse<cl_device_id>*>(param)
+            ->object_ids();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_CONTEXT:
+        return static_cast<CallParamObjectUse<cl_context>*>(param)
+            ->object_ids();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_PROGRAM:
+        return static_cast<CallParamObjectUse<cl_program>*>(param)
+            ->object_ids();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_KERNEL:
+        return static_cast<CallParamObjectUse<cl_kernel>*>(param)->object_ids();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_MEM:
+        return static_cast<CallParamObjectUse<cl_mem>*>(param)->object_ids();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_EVENT:
+        return static_cast<CallParamObjectUse<cl_event>*>(param)->object_ids();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_COMMANDQUEUE:
+        return static_cast<CallParamObjectUse<cl_command_queue>*>(param)
+            ->object_ids();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_SAMPLER:
+        return static_cast<CallParamObjectUse<cl_sampler>*>(param)
+            ->object_ids();
+    }
+
+    fatal("Unsupported object use, ttype = %u", ttype);
+    abort();
+}
+
+static bool call_param_object_use_multiple(CallParam* param) {
+    auto ptype = param->type();
+    auto ttype = param->ttype();
+    assert(ptype == CALL_PARAM_OBJECT_USE);
+    switch (ttype) {
+    case CALL_PARAM_TEMPLATE_TYPE_CL_PLATFORM_ID:
+        return static_cast<CallParamObjectUse<cl_platform_id>*>(param)
+            ->multiple();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_DEVICE_ID:
+        return static_cast<CallParamObjectUse<cl_device_id>*>(param)
+            ->multiple();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_CONTEXT:
+        return static_cast<CallParamObjectUse<cl_context>*>(param)->multiple();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_PROGRAM:
+        return static_cast<CallParamObjectUse<cl_program>*>(param)->multiple();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_KERNEL:
+        return static_cast<CallParamObjectUse<cl_kernel>*>(param)->multiple();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_MEM:
+        return static_cast<CallParamObjectUse<cl_mem>*>(param)->multiple();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_EVENT:
+        return static_cast<CallParamObjectUse<cl_event>*>(param)->multiple();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_COMMANDQUEUE:
+        return static_cast<CallParamObjectUse<cl_command_queue>*>(param)
+            ->multiple();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_SAMPLER:
+        return static_cast<CallParamObjectUse<cl_sampler>*>(param)->multiple();
+    }
+
+    fatal("Unsupported object use, ttype = %u", ttype);
+    abort();
+}
+
+static const std::vector<uint64_t>&
+call_param_object_creation_ids(CallParam* param) {
+    auto ptype = param->type();
+    auto ttype = param->ttype();
+    assert(ptype == CALL_PARAM_OPTIONAL_OBJECT_CREATION);
+    switch (ttype) {
+    case CALL_PARAM_TEMPLATE_TYPE_CL_PLATFORM_ID:
+        return static_cast<CallParamOptionalObjectCreation<cl_platform_id>*>(
+                   param)
+            ->object_ids();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_DEVICE_ID:
+        return static_cast<CallParamOptionalObjectCreation<cl_device_id>*>(
+                   param)
+            ->object_ids();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_CONTEXT:
+        return static_cast<CallParamOptionalObjectCreation<cl_context>*>(param)
+            ->object_ids();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_COMMANDQUEUE:
+        return static_cast<CallParamOptionalObjectCreation<cl_command_queue>*>(
+                   param)
+            ->object_ids();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_PROGRAM:
+        return static_cast<CallParamOptionalObjectCreation<cl_program>*>(param)
+            ->object_ids();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_KERNEL:
+        return static_cast<CallParamOptionalObjectCreation<cl_kernel>*>(param)
+            ->object_ids();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_MEM:
+        return static_cast<CallParamOptionalObjectCreation<cl_mem>*>(param)
+            ->object_ids();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_EVENT:
+        return static_cast<CallParamOptionalObjectCreation<cl_event>*>(param)
+            ->object_ids();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_SAMPLER:
+        return static_cast<CallParamOptionalObjectCreation<cl_sampler>*>(
+                   param)
+            ->object_ids();
+    }
+
+    fatal("Unsupported object creation, ttype = %u", ttype);
+    abort();
+}
+
+static bool call_param_object_creation_create(CallParam* param) {
+    auto ptype = param->type();
+    auto ttype = param->ttype();
+    assert(ptype == CALL_PARAM_OPTIONAL_OBJECT_CREATION);
+    switch (ttype) {
+    case CALL_PARAM_TEMPLATE_TYPE_CL_PLATFORM_ID:
+        return static_cast<CallParamOptionalObjectCreation<cl_platform_id>*>(
+                   param)
+            ->create();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_DEVICE_ID:
+        return static_cast<CallParamOptionalObjectCreation<cl_device_id>*>(
+                   param)
+            ->create();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_CONTEXT:
+        return static_cast<CallParamOptionalObjectCreation<cl_context>*>(param)
+            ->create();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_COMMANDQUEUE:
+        return static_cast<CallParamOptionalObjectCreation<cl_command_queue>*>(
+                   param)
+            ->create();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_PROGRAM:
+        return static_cast<CallParamOptionalObjectCreation<cl_program>*>(param)
+            ->create();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_KERNEL:
+        return static_cast<CallParamOptionalObjectCreation<cl_kernel>*>(param)
+            ->create();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_MEM:
+        return static_cast<CallParamOptionalObjectCreation<cl_mem>*>(param)
+            ->create();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_EVENT:
+        return static_cast<CallParamOptionalObjectCreation<cl_event>*>(param)
+            ->create();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_SAMPLER:
+        return static_cast<CallParamOptionalObjectCreation<cl_sampler>*>(
+                   param)
+            ->create();
+    }
+
+    fatal("Unsupported object creation, ttype = %u", ttype);
+    abort();
+}
+
+//
+// Output parameter helpers
+//
+
+static bool call_param_value_out_by_ref_null_pointer(CallParam* param) {
+    auto ptype = param->type();
+    auto ttype = param->ttype();
+    assert(ptype == CALL_PARAM_VALUE_OUT_BY_REF);
+    switch (ttype) {
+    case CALL_PARAM_TEMPLATE_TYPE_VOID:
+        return static_cast<CallParamValueOutByRef<void>*>(param)
+            ->null_pointer();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_INT:
+        return static_cast<CallParamValueOutByRef<cl_int>*>(param)
+            ->null_pointer();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_UINT:
+        return static_cast<CallParamValueOutByRef<cl_uint>*>(param)
+            ->null_pointer();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_ULONG:
+        return static_cast<CallParamValueOutByRef<cl_ulong>*>(param)
+            ->null_pointer();
+    }
+
+    fatal("Unsupported value out by reference, ttype = %u", ttype);
+    abort();
+}
+
+static bool call_param_array_null_pointer(CallParam* param) {
+    auto ptype = param->type();
+    auto ttype = param->ttype();
+    assert(ptype == CALL_PARAM_ARRAY);
+    switch (ttype) {
+    case CALL_PARAM_TEMPLATE_TYPE_CL_ULONG:
+        return static_cast<CallParamArray<size_t>*>(param)->null_pointer();
+    case CALL_PARAM_TEMPLATE_TYPE_CHAR:
+        return static_cast<CallParamArray<char>*>(param)->null_pointer();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_IMAGE_FORMAT:
+        return static_cast<CallParamArray<cl_image_format>*>(param)
+            ->null_pointer();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_IMAGE_DESC:
+        return static_cast<CallParamArray<cl_image_desc>*>(param)
+            ->null_pointer();
+    }
+
+    fatal("Unsupported array, ttype = %u", ttype);
+    abort();
+}
+
+//
+// Call timing
+//
+
+// steady_clock is CLOCK_MONOTONIC on Linux, which lets exported timelines be
+// lined up with other profiling data captured on the same machine.
+static uint64_t call_timestamp() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+// Small sequential identifier for the calling host thread
+static uint32_t call_thread_id() {
+    static std::atomic<uint32_t> next_id{0};
+    thread_local uint32_t id = next_id++;
+    return id;
+}
+
 struct Call {
 
-    Call(std::istream& is) { deserialize(is); }
+    Call(std::istream& is, const StringTable& strings) {
+        deserialize(is, strings);
+    }
 
-    Call(oclapi::command command) : m_call_id(command) {}
+    Call(oclapi::command command)
+        : m_call_id(command), m_thread(call_thread_id()),
+          m_start_time(call_timestamp()), m_end_time(m_start_time) {}
 
     oclapi::command id() const { return m_call_id; }
 
+    uint32_t thread() const { return m_thread; }
+    uint64_t start_time() const { return m_start_time; }
+    uint64_t end_time() const { return m_end_time; }
+
+    // To be called as soon as the intercepted function returns so that the
+    // time spent recording parameters is not accounted to the call.
+    void record_end_time() { m_end_time = call_timestamp(); }
+
     size_t output_memory_requirements() const {
         size_t size = 0;
         for (auto& param : m_params) {
@@ -992,6 +1466,33 @@ struct Call {
             std::make_unique<CallParamValueOutByRef<T>>(pointer, size));
     }
 
+    // Context properties refer to their platform by capture ID
+    void record_context_properties(const cl_context_properties* properties) {
+        if (properties == nullptr) {
+            record_null_terminated_property_list(properties);
+            return;
+        }
+        // Platform ID 0 would end the list as recorded from a pointer
+        std::vector<intptr_t> props;
+        for (auto prop = properties; *prop != 0; prop += 2) {
+            auto value = prop[1];
+            if (prop[0] == CL_CONTEXT_PLATFORM) {
+                auto platform = reinterpret_cast<cl_platform_id>(value);
+                auto& tracker = object_capture_tracker<cl_platform_id>();
+                if ((platform != nullptr) && !tracker.is_tracked(platform)) {
+                    warn("Context platform %p unknown, recorded as none\n",
+                         platform);
+                    platform = nullptr;
+                }
+                value = static_cast<intptr_t>(tracker.get(platform));
+            }
+            props.push_back(prop[0]);
+            props.push_back(value);
+        }
+        m_params.push_back(
+            std::make_unique<CallParamProperties>(std::move(props)));
+    }
+
     template <typename T>
     void record_null_terminated_property_list(T* properties) {
         std::vector<intptr_t> props;
@@ -1021,14 +1522,14 @@ struct Call {
         m_params.push_back(std::make_unique<CallParamArray<T>>(pointer, size));
     }
 
-    void record_program_source(size_t count, const size_t* lengths,
-                               const char** strings) {
-        m_params.push_back(
-            std::make_unique<CallParamProgramSource>(count, lengths, strings));
+    void record_program_source(StringTable& strings, size_t count,
+                               const size_t* lengths, const char** sources) {
+        m_params.push_back(std::make_unique<CallParamProgramSource>(
+            strings, count, lengths, sources));
     }
 
-    void record_string(const char* str) {
-        m_params.push_back(std::make_unique<CallParamString>(str));
+    void record_string(StringTable& strings, const char* str) {
+        m_params.push_back(std::make_unique<CallParamString>(strings, str));
     }
 
     void record_map_pointer_use(void* ptr) {
@@ -1066,7 +1567,9 @@ struct Call {
 
         out << std::endl
             << "Call: " << oclapi::command_name(m_call_id) << "("
-            << static_cast<uint32_t>(m_call_id) << ")" << std::endl;
+            << static_cast<uint32_t>(m_call_id) << ")"
+            << " thread " << m_thread << ", " << m_end_time - m_start_time
+            << " ns" << std::endl;
 
         unsigned pnum = 0;
         for (auto& param : m_params) {
@@ -1083,6 +1586,11 @@ struct Call {
         uint32_t call_id = static_cast<uint32_t>(m_call_id);
         ::serialize(os, call_id);
 
+        // Thread and timing
+        ::serialize(os, m_thread);
+        ::serialize(os, m_start_time);
+        ::serialize(os, m_end_time);
+
         // Return value
         m_return->serialize(os);
 
@@ -1094,17 +1602,22 @@ struct Call {
         }
     }
 
-    void deserialize(std::istream& is) {
+    void deserialize(std::istream& is, const StringTable& strings) {
         // Call ID
         m_call_id = static_cast<oclapi::command>(::deserialize<uint32_t>(is));
 
+        // Thread and timing
+        m_thread = ::deserialize<uint32_t>(is);
+        m_start_time = ::deserialize<uint64_t>(is);
+        m_end_time = ::deserialize<uint64_t>(is);
+
         // Return Value
-        m_return.reset(construct_call_param(is));
+        m_return.reset(construct_call_param(is, strings));
 
         // Parameters
         auto num_params = ::deserialize<uint32_t>(is);
         for (unsigned i = 0; i < num_params; i++) {
-            auto p = construct_call_param(is);
+            auto p = construct_call_param(is, strings);
             m_params.push_back(std::unique_ptr<CallParam>(p));
         }
     }
@@ -1115,8 +1628,98 @@ struct Call {
 
     const std::unique_ptr<CallParam>& retval() const { return m_return; }
 
+    void reintern_strings(StringTable& strings) {
+        m_return->reintern(strings);
+        for (auto& param : m_params) {
+            param->reintern(strings);
+        }
+    }
+
 private:
     oclapi::command m_call_id;
+    uint32_t m_thread;
+    uint64_t m_start_time;
+    uint64_t m_end_time;
     std::vector<std::unique_ptr<CallParam>> m_params;
     std::unique_ptr<CallParam> m_return;
 };
+
+// Value of a parameter, converted to T
+template <typename T> static T call_param_value_as(CallParam* param) {
+    auto ttype = param->ttype();
+    assert(param->type() == CALL_PARAM_VALUE);
+    switch (ttype) {
+    case CALL_PARAM_TEMPLATE_TYPE_INTPTR_T:
+        return static_cast<T>(
+            static_cast<CallParamValue<intptr_t>*>(param)->value());
+    case CALL_PARAM_TEMPLATE_TYPE_CL_INT:
+        return static_cast<T>(
+            static_cast<CallParamValue<cl_int>*>(param)->value());
+    case CALL_PARAM_TEMPLATE_TYPE_CL_UINT:
+        return static_cast<T>(
+            static_cast<CallParamValue<cl_uint>*>(param)->value());
+    case CALL_PARAM_TEMPLATE_TYPE_CL_LONG:
+        return static_cast<T>(
+            static_cast<CallParamValue<cl_long>*>(param)->value());
+    case CALL_PARAM_TEMPLATE_TYPE_CL_ULONG:
+        return static_cast<T>(
+            static_cast<CallParamValue<cl_ulong>*>(param)->value());
+    }
+
+    fatal("Unsupported value, ttype = %u", ttype);
+    abort();
+}
+
+// Objects alive at some point of a trace, with the number of references the
+// application holds on them, by (template type, capture ID)
+using replay_live_objects =
+    std::map<std::pair<CallParamTemplateType, uint64_t>, int>;
+
+// Account for the objects a call creates, retains or releases
+static void replay_live_objects_update(const Call& call,
+                                       replay_live_objects& live) {
+    auto created = [&live](CallParam* param) {
+        if ((param->type() != CALL_PARAM_OPTIONAL_OBJECT_CREATION) ||
+            !call_param_object_creation_create(param)) {
+            return;
+        }
+        for (auto id : call_param_object_creation_ids(param)) {
+            live[{param->ttype(), id}] = 1;
+        }
+    };
+    for (auto& param : call.params()) {
+        created(param.get());
+    }
+    created(call.retval().get());
+
+    switch (call.id()) {
+    case oclapi::command::RETAIN_CONTEXT:
+    case oclapi::command::RETAIN_COMMAND_QUEUE:
+    case oclapi::command::RETAIN_PROGRAM:
+    case oclapi::command::RETAIN_KERNEL:
+    case oclapi::command::RETAIN_MEM_OBJECT:
+    case oclapi::command::RETAIN_EVENT:
+    case oclapi::command::RETAIN_SAMPLER: {
+        auto param = call.params()[0].get();
+        live[{param->ttype(), call_param_object_use_ids(param)[0]}]++;
+        break;
+    }
+    case oclapi::command::RELEASE_CONTEXT:
+    case oclapi::command::RELEASE_COMMAND_QUEUE:
+    case oclapi::command::RELEASE_PROGRAM:
+    case oclapi::command::RELEASE_KERNEL:
+    case oclapi::command::RELEASE_MEM_OBJECT:
+    case oclapi::command::RELEASE_EVENT:
+    case oclapi::command::RELEASE_SAMPLER: {
+        auto param = call.params()[0].get();
+        std::pair<CallParamTemplateType, uint64_t> key{
+            param->ttype(), call_param_object_use_ids(param)[0]};
+        if (--live[key] <= 0) {
+            live.erase(key);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
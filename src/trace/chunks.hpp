@@ -0,0 +1,143 @@
+// Copyright 2019-2023 The OpenCL-Tools authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <streambuf>
+#include <vector>
+
+#include "crc32c.hpp"
+#include "serialize.hpp"
+
+// The body of a trace is split in chunks, each one framed as
+//
+//    uint32_t size
+//    uint32_t crc32c of the data
+//    char     data[size]
+//
+// and terminated by an empty chunk. Chunks are verified before any of their
+// data is handed to deserialisation so that corrupted traces are rejected
+// instead of being parsed into garbage.
+
+static const uint32_t kChunkSize = 1 << 20;
+static const uint32_t kMaxChunkSize = 64 << 20;
+
+struct ChunkHeader {
+    uint32_t size;
+    uint32_t crc;
+};
+
+class ChunkWriter : public std::streambuf {
+public:
+    ChunkWriter(std::ostream& os, size_t chunk_size = kChunkSize)
+        : m_os(os), m_buffer(chunk_size) {
+        setp(m_buffer.data(), m_buffer.data() + m_buffer.size());
+    }
+
+    ~ChunkWriter() { finish(); }
+
+    // Write out any buffered data and the terminating chunk
+    void finish() {
+        if (m_finished) {
+            return;
+        }
+        write_chunk();
+        ::serialize(m_os, ChunkHeader{0, 0});
+        m_finished = true;
+    }
+
+protected:
+    int_type overflow(int_type ch) override {
+        write_chunk();
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+private:
+    void write_chunk() {
+        auto size = static_cast<uint32_t>(pptr() - pbase());
+        if (size == 0) {
+            return;
+        }
+        ChunkHeader header{size, crc32c(pbase(), size)};
+        ::serialize(m_os, header);
+        m_os.write(pbase(), size);
+        setp(m_buffer.data(), m_buffer.data() + m_buffer.size());
+    }
+
+    std::ostream& m_os;
+    std::vector<char> m_buffer;
+    bool m_finished = false;
+};
+
+class ChunkReader : public std::streambuf {
+public:
+    ChunkReader(std::istream& is) : m_is(is) {}
+
+    bool corrupted() const { return m_corrupted; }
+    bool truncated() const { return m_truncated; }
+
+    // Number of chunks read and verified so far
+    size_t num_chunks() const { return m_num_chunks; }
+
+protected:
+    int_type underflow() override {
+        if (m_done) {
+            return traits_type::eof();
+        }
+        auto header = ::deserialize<ChunkHeader>(m_is);
+        if (!m_is.good()) {
+            return stop(m_truncated);
+        }
+        if (header.size == 0) {
+            m_done = true;
+            return traits_type::eof();
+        }
+        if (header.size > kMaxChunkSize) {
+            return stop(m_corrupted);
+        }
+        m_buffer.resize(header.size);
+        m_is.read(m_buffer.data(), header.size);
+        if (!m_is.good()) {
+            return stop(m_truncated);
+        }
+        if (crc32c(m_buffer.data(), header.size) != header.crc) {
+            return stop(m_corrupted);
+        }
+        m_num_chunks++;
+        setg(m_buffer.data(), m_buffer.data(),
+             m_buffer.data() + m_buffer.size());
+        return traits_type::to_int_type(m_buffer[0]);
+    }
+
+private:
+    int_type stop(bool& reason) {
+        reason = true;
+        m_done = true;
+        return traits_type::eof();
+    }
+
+    std::istream& m_is;
+    std::vector<char> m_buffer;
+    size_t m_num_chunks = 0;
+    bool m_done = false;
+    bool m_corrupted = false;
+    bool m_truncated = false;
+};
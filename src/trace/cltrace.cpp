@@ -28,9 +28,10 @@ Trace trace;
 
 cl_int clGetPlatformIDs(cl_uint num_entries, cl_platform_id* platforms,
                         cl_uint* num_platforms) {
+    Call call(oclapi::command::GET_PLATFORM_IDS);
     auto ret = PFN_clGetPlatformIDs(num_entries, platforms, num_platforms);
+    call.record_end_time();
 
-    Call call(oclapi::command::GET_PLATFORM_IDS);
     call.record_value(num_entries);
     call.record_optional_object_creation(num_entries, platforms);
     call.record_value_out_by_reference(num_platforms);
@@ -44,10 +45,11 @@ cl_int clGetPlatformIDs(cl_uint num_entries, cl_platform_id* platforms,
 cl_int clGetPlatformInfo(cl_platform_id platform, cl_platform_info param_name,
                          size_t param_value_size, void* param_value,
                          size_t* param_value_size_ret) {
+    Call call(oclapi::command::GET_PLATFORM_INFO);
     auto ret = PFN_clGetPlatformInfo(platform, param_name, param_value_size,
                                      param_value, param_value_size_ret);
+    call.record_end_time();
 
-    Call call(oclapi::command::GET_PLATFORM_INFO);
     call.record_object_use(platform);
     call.record_value(param_name);
     call.record_value(param_value_size);
@@ -63,10 +65,11 @@ cl_int clGetPlatformInfo(cl_platform_id platform, cl_platform_info param_name,
 cl_int clGetDeviceIDs(cl_platform_id platform, cl_device_type device_type,
                       cl_uint num_entries, cl_device_id* devices,
                       cl_uint* num_devices) {
+    Call call(oclapi::command::GET_DEVICE_IDS);
     auto ret = PFN_clGetDeviceIDs(platform, device_type, num_entries, devices,
                                   num_devices);
+    call.record_end_time();
 
-    Call call(oclapi::command::GET_DEVICE_IDS);
     call.record_object_use(platform);
     call.record_value(device_type);
     call.record_value(num_entries);
@@ -82,10 +85,11 @@ cl_int clGetDeviceIDs(cl_platform_id platform, cl_device_type device_type,
 cl_int clGetDeviceInfo(cl_device_id device, cl_device_info param_name,
                        size_t param_value_size, void* param_value,
                        size_t* param_value_size_ret) {
+    Call call(oclapi::command::GET_DEVICE_INFO);
     auto ret = PFN_clGetDeviceInfo(device, param_name, param_value_size,
                                    param_value, param_value_size_ret);
+    call.record_end_time();
 
-    Call call(oclapi::command::GET_DEVICE_INFO);
     call.record_object_use(device);
     call.record_value(param_name);
     call.record_value(param_value_size);
@@ -99,9 +103,10 @@ cl_int clGetDeviceInfo(cl_device_id device, cl_device_info param_name,
 }
 
 cl_int clRetainDevice(cl_device_id device) {
+    Call call(oclapi::command::RETAIN_DEVICE);
     auto ret = PFN_clRetainDevice(device);
+    call.record_end_time();
 
-    Call call(oclapi::command::RETAIN_DEVICE);
     call.record_object_use(device);
     call.record_return_value(ret);
     trace.record(call);
@@ -110,9 +115,10 @@ cl_int clRetainDevice(cl_device_id device) {
 }
 
 cl_int clReleaseDevice(cl_device_id device) {
+    Call call(oclapi::command::RELEASE_DEVICE);
     auto ret = PFN_clReleaseDevice(device);
+    call.record_end_time();
 
-    Call call(oclapi::command::RELEASE_DEVICE);
     call.record_object_use(device);
     call.record_return_value(ret);
     trace.record(call);
@@ -126,11 +132,12 @@ cl_context clCreateContext(const cl_context_properties* properties,
                                                          const void*, size_t,
                                                          void*),
                            void* user_data, cl_int* errcode_ret) {
+    Call call(oclapi::command::CREATE_CONTEXT);
     auto ret = PFN_clCreateContext(properties, num_devices, devices, pfn_notify,
                                    user_data, errcode_ret);
+    call.record_end_time();
 
-    Call call(oclapi::command::CREATE_CONTEXT);
-    call.record_null_terminated_property_list(properties);
+    call.record_context_properties(properties);
     call.record_value(num_devices);
     call.record_object_use(num_devices, devices);
     call.record_callback(OCL_CALLBACK_CONTEXT_NOTIFICATION, pfn_notify);
@@ -147,11 +154,12 @@ cl_context clCreateContextFromType(
     const cl_context_properties* properties, cl_device_type device_type,
     void(CL_CALLBACK* pfn_notify)(const char*, const void*, size_t, void*),
     void* user_data, cl_int* errcode_ret) {
+    Call call(oclapi::command::CREATE_CONTEXT_FROM_TYPE);
     auto ret = PFN_clCreateContextFromType(properties, device_type, pfn_notify,
                                            user_data, errcode_ret);
+    call.record_end_time();
 
-    Call call(oclapi::command::CREATE_CONTEXT_FROM_TYPE);
-    call.record_null_terminated_property_list(properties);
+    call.record_context_properties(properties);
     call.record_value(device_type);
     call.record_callback(OCL_CALLBACK_CONTEXT_NOTIFICATION, pfn_notify);
     call.record_callback_user_data(user_data);
@@ -166,10 +174,11 @@ cl_context clCreateContextFromType(
 cl_int clGetContextInfo(cl_context context, cl_context_info param_name,
                         size_t param_value_size, void* param_value,
                         size_t* param_value_size_ret) {
+    Call call(oclapi::command::GET_CONTEXT_INFO);
     auto ret = PFN_clGetContextInfo(context, param_name, param_value_size,
                                     param_value, param_value_size_ret);
+    call.record_end_time();
 
-    Call call(oclapi::command::GET_CONTEXT_INFO);
     call.record_object_use(context);
     call.record_value(param_name);
     call.record_value(param_value_size);
@@ -183,9 +192,10 @@ cl_int clGetContextInfo(cl_context context, cl_context_info param_name,
 }
 
 cl_int clRetainContext(cl_context context) {
+    Call call(oclapi::command::RETAIN_CONTEXT);
     auto ret = PFN_clRetainContext(context);
+    call.record_end_time();
 
-    Call call(oclapi::command::RETAIN_CONTEXT);
     call.record_object_use(context);
     call.record_return_value(ret);
 
@@ -195,9 +205,10 @@ cl_int clRetainContext(cl_context context) {
 }
 
 cl_int clReleaseContext(cl_context context) {
+    Call call(oclapi::command::RELEASE_CONTEXT);
     auto ret = PFN_clReleaseContext(context);
+    call.record_end_time();
 
-    Call call(oclapi::command::RELEASE_CONTEXT);
     call.record_object_use(context);
     call.record_return_value(ret);
     trace.record(call);
@@ -209,14 +220,14 @@ cl_program clCreateProgramWithSource(cl_context context, cl_uint count,
                                      const char** strings,
                                      const size_t* lengths,
                                      cl_int* errcode_ret) {
+    Call call(oclapi::command::CREATE_PROGRAM_WITH_SOURCE);
     auto ret = PFN_clCreateProgramWithSource(context, count, strings, lengths,
                                              errcode_ret);
-
-    Call call(oclapi::command::CREATE_PROGRAM_WITH_SOURCE);
+    call.record_end_time();
 
     call.record_object_use(context);
     call.record_value(count);
-    call.record_program_source(count, lengths, strings);
+    call.record_program_source(trace.strings(), count, lengths, strings);
     call.record_array(count, lengths);
     call.record_value_out_by_reference(errcode_ret);
     call.record_return_object_creation(ret);
@@ -231,15 +242,15 @@ cl_program clCreateProgramWithBuiltInKernels(cl_context context,
                                              const cl_device_id* device_list,
                                              const char* kernel_names,
                                              cl_int* errcode_ret) {
+    Call call(oclapi::command::CREATE_PROGRAM_WITH_BUILT_IN_KERNELS);
     auto ret = PFN_clCreateProgramWithBuiltInKernels(
         context, num_devices, device_list, kernel_names, errcode_ret);
-
-    Call call(oclapi::command::CREATE_PROGRAM_WITH_BUILT_IN_KERNELS);
+    call.record_end_time();
 
     call.record_object_use(context);
     call.record_value(num_devices);
     call.record_object_use(num_devices, device_list);
-    call.record_string(kernel_names);
+    call.record_string(trace.strings(), kernel_names);
     call.record_value_out_by_reference(errcode_ret);
     call.record_return_object_creation(ret);
 
@@ -250,9 +261,9 @@ cl_program clCreateProgramWithBuiltInKernels(cl_context context,
 
 cl_program clCreateProgramWithIL(cl_context context, const void* il,
                                  size_t length, cl_int* errcode_ret) {
-    auto ret = PFN_clCreateProgramWithIL(context, il, length, errcode_ret);
-
     Call call(oclapi::command::CREATE_PROGRAM_WITH_IL);
+    auto ret = PFN_clCreateProgramWithIL(context, il, length, errcode_ret);
+    call.record_end_time();
 
     call.record_object_use(context);
     call.record_array(length, static_cast<const char*>(il));
@@ -266,9 +277,9 @@ cl_program clCreateProgramWithIL(cl_context context, const void* il,
 }
 
 cl_int clRetainProgram(cl_program program) {
-    auto ret = PFN_clRetainProgram(program);
-
     Call call(oclapi::command::RETAIN_PROGRAM);
+    auto ret = PFN_clRetainProgram(program);
+    call.record_end_time();
 
     call.record_object_use(program);
     call.record_return_value(ret);
@@ -279,9 +290,10 @@ cl_int clRetainProgram(cl_program program) {
 }
 
 cl_int clReleaseProgram(cl_program program) {
+    Call call(oclapi::command::RELEASE_PROGRAM);
     auto ret = PFN_clReleaseProgram(program);
+    call.record_end_time();
 
-    Call call(oclapi::command::RELEASE_PROGRAM);
     call.record_object_use(program);
     call.record_return_value(ret);
     trace.record(call);
@@ -292,10 +304,10 @@ cl_int clReleaseProgram(cl_program program) {
 cl_int clGetProgramInfo(cl_program program, cl_program_info param_name,
                         size_t param_value_size, void* param_value,
                         size_t* param_value_size_ret) {
+    Call call(oclapi::command::GET_PROGRAM_INFO);
     auto ret = PFN_clGetProgramInfo(program, param_name, param_value_size,
                                     param_value, param_value_size_ret);
-
-    Call call(oclapi::command::GET_PROGRAM_INFO);
+    call.record_end_time();
 
     call.record_object_use(program);
     call.record_value(param_name);
@@ -313,15 +325,15 @@ cl_int clBuildProgram(cl_program program, cl_uint num_devices,
                       const cl_device_id* device_list, const char* options,
                       void(CL_CALLBACK* pfn_notify)(cl_program, void*),
                       void* user_data) {
+    Call call(oclapi::command::BUILD_PROGRAM);
     auto ret = PFN_clBuildProgram(program, num_devices, device_list, options,
                                   pfn_notify, user_data);
-
-    Call call(oclapi::command::BUILD_PROGRAM);
+    call.record_end_time();
 
     call.record_object_use(program);
     call.record_value(num_devices);
     call.record_object_use(num_devices, device_list);
-    call.record_string(options);
+    call.record_string(trace.strings(), options);
     call.record_callback(OCL_CALLBACK_PROGRAM_BUILD, pfn_notify);
     call.record_callback_user_data(user_data);
     call.record_return_value(ret);
@@ -337,16 +349,16 @@ cl_program clLinkProgram(cl_context context, cl_uint num_devices,
                          const cl_program* input_programs,
                          void(CL_CALLBACK* pfn_notify)(cl_program, void*),
                          void* user_data, cl_int* errcode_ret) {
+    Call call(oclapi::command::LINK_PROGRAM);
     auto ret = PFN_clLinkProgram(context, num_devices, device_list, options,
                                  num_input_programs, input_programs, pfn_notify,
                                  user_data, errcode_ret);
-
-    Call call(oclapi::command::LINK_PROGRAM);
+    call.record_end_time();
 
     call.record_object_use(context);
     call.record_value(num_devices);
     call.record_object_use(num_devices, device_list);
-    call.record_string(options);
+    call.record_string(trace.strings(), options);
     call.record_value(num_input_programs);
     call.record_object_use(num_input_programs,
                            const_cast<cl_program*>(input_programs));
@@ -364,11 +376,12 @@ cl_int clGetProgramBuildInfo(cl_program program, cl_device_id device,
                              cl_program_build_info param_name,
                              size_t param_value_size, void* param_value,
                              size_t* param_value_size_ret) {
+    Call call(oclapi::command::GET_PROGRAM_BUILD_INFO);
     auto ret =
         PFN_clGetProgramBuildInfo(program, device, param_name, param_value_size,
                                   param_value, param_value_size_ret);
+    call.record_end_time();
 
-    Call call(oclapi::command::GET_PROGRAM_BUILD_INFO);
     call.record_object_use(program);
     call.record_object_use(device);
     call.record_value(param_name);
@@ -384,12 +397,12 @@ cl_int clGetProgramBuildInfo(cl_program program, cl_device_id device,
 
 cl_kernel clCreateKernel(cl_program program, const char* kernel_name,
                          cl_int* errcode_ret) {
-    auto ret = PFN_clCreateKernel(program, kernel_name, errcode_ret);
-
     Call call(oclapi::command::CREATE_KERNEL);
+    auto ret = PFN_clCreateKernel(program, kernel_name, errcode_ret);
+    call.record_end_time();
 
     call.record_object_use(program);
-    call.record_string(kernel_name);
+    call.record_string(trace.strings(), kernel_name);
     call.record_value_out_by_reference(errcode_ret);
     call.record_return_object_creation(ret);
 
@@ -400,10 +413,10 @@ cl_kernel clCreateKernel(cl_program program, const char* kernel_name,
 
 cl_int clCreateKernelsInProgram(cl_program program, cl_uint num_kernels,
                                 cl_kernel* kernels, cl_uint* num_kernels_ret) {
+    Call call(oclapi::command::CREATE_KERNELS_IN_PROGRAM);
     auto ret = PFN_clCreateKernelsInProgram(program, num_kernels, kernels,
                                             num_kernels_ret);
-
-    Call call(oclapi::command::CREATE_KERNELS_IN_PROGRAM);
+    call.record_end_time();
 
     call.record_object_use(program);
     call.record_value(num_kernels);
@@ -417,9 +430,9 @@ cl_int clCreateKernelsInProgram(cl_program program, cl_uint num_kernels,
 }
 
 cl_int clRetainKernel(cl_kernel kernel) {
-    auto ret = PFN_clRetainKernel(kernel);
-
     Call call(oclapi::command::RETAIN_KERNEL);
+    auto ret = PFN_clRetainKernel(kernel);
+    call.record_end_time();
 
     call.record_object_use(kernel);
     call.record_return_value(ret);
@@ -430,9 +443,10 @@ cl_int clRetainKernel(cl_kernel kernel) {
 }
 
 cl_int clReleaseKernel(cl_kernel kernel) {
+    Call call(oclapi::command::RELEASE_KERNEL);
     auto ret = PFN_clReleaseKernel(kernel);
+    call.record_end_time();
 
-    Call call(oclapi::command::RELEASE_KERNEL);
     call.record_object_use(kernel);
     call.record_return_value(ret);
     trace.record(call);
@@ -442,9 +456,9 @@ cl_int clReleaseKernel(cl_kernel kernel) {
 
 cl_int clSetKernelArg(cl_kernel kernel, cl_uint arg_index, size_t arg_size,
                       const void* arg_value) {
-    auto ret = PFN_clSetKernelArg(kernel, arg_index, arg_size, arg_value);
-
     Call call(oclapi::command::SET_KERNEL_ARG);
+    auto ret = PFN_clSetKernelArg(kernel, arg_index, arg_size, arg_value);
+    call.record_end_time();
 
     call.record_object_use(kernel);
     call.record_value(arg_index);
@@ -452,7 +466,6 @@ cl_int clSetKernelArg(cl_kernel kernel, cl_uint arg_index, size_t arg_size,
     if (arg_size == sizeof(void*)) {
         // FIXME broken for pointer-sized values that happen to match the
         // pointer for a tracked object
-        // TODO support samplers
         void* value = const_cast<void*>(arg_value);
         void* obj = *reinterpret_cast<void**>(value);
         auto ttype = tracked_kernel_argument_object_type(obj);
@@ -460,6 +473,8 @@ cl_int clSetKernelArg(cl_kernel kernel, cl_uint arg_index, size_t arg_size,
             call.record_object_use(1, static_cast<cl_mem*>(value));
         } else if (ttype == CALL_PARAM_TEMPLATE_TYPE_CL_COMMANDQUEUE) {
             call.record_object_use(1, static_cast<cl_command_queue*>(value));
+        } else if (ttype == CALL_PARAM_TEMPLATE_TYPE_CL_SAMPLER) {
+            call.record_object_use(1, static_cast<cl_sampler*>(value));
         } else {
             call.record_array(arg_size, static_cast<const char*>(arg_value));
         }
@@ -477,11 +492,11 @@ cl_int clGetKernelArgInfo(cl_kernel kernel, cl_uint arg_index,
                           cl_kernel_arg_info param_name,
                           size_t param_value_size, void* param_value,
                           size_t* param_value_size_ret) {
+    Call call(oclapi::command::GET_KERNEL_ARG_INFO);
     auto ret =
         PFN_clGetKernelArgInfo(kernel, arg_index, param_name, param_value_size,
                                param_value, param_value_size_ret);
-
-    Call call(oclapi::command::GET_KERNEL_ARG_INFO);
+    call.record_end_time();
 
     call.record_object_use(kernel);
     call.record_value(arg_index);
@@ -499,10 +514,10 @@ cl_int clGetKernelArgInfo(cl_kernel kernel, cl_uint arg_index,
 cl_int clGetKernelInfo(cl_kernel kernel, cl_kernel_info param_name,
                        size_t param_value_size, void* param_value,
                        size_t* param_value_size_ret) {
+    Call call(oclapi::command::GET_KERNEL_INFO);
     auto ret = PFN_clGetKernelInfo(kernel, param_name, param_value_size,
                                    param_value, param_value_size_ret);
-
-    Call call(oclapi::command::GET_KERNEL_INFO);
+    call.record_end_time();
 
     call.record_object_use(kernel);
     call.record_value(param_name);
@@ -520,11 +535,11 @@ cl_int clGetKernelWorkGroupInfo(cl_kernel kernel, cl_device_id device,
                                 cl_kernel_work_group_info param_name,
                                 size_t param_value_size, void* param_value,
                                 size_t* param_value_size_ret) {
+    Call call(oclapi::command::GET_KERNEL_WORK_GROUP_INFO);
     auto ret = PFN_clGetKernelWorkGroupInfo(kernel, device, param_name,
                                             param_value_size, param_value,
                                             param_value_size_ret);
-
-    Call call(oclapi::command::GET_KERNEL_WORK_GROUP_INFO);
+    call.record_end_time();
 
     call.record_object_use(kernel);
     call.record_object_use(device);
@@ -544,11 +559,11 @@ cl_int clGetKernelSubGroupInfo(cl_kernel kernel, cl_device_id device,
                                size_t input_value_size, const void* input_value,
                                size_t param_value_size, void* param_value,
                                size_t* param_value_size_ret) {
+    Call call(oclapi::command::GET_KERNEL_SUB_GROUP_INFO);
     auto ret = PFN_clGetKernelSubGroupInfo(
         kernel, device, param_name, input_value_size, input_value,
         param_value_size, param_value, param_value_size_ret);
-
-    Call call(oclapi::command::GET_KERNEL_SUB_GROUP_INFO);
+    call.record_end_time();
 
     call.record_object_use(kernel);
     call.record_object_use(device);
@@ -567,9 +582,9 @@ cl_int clGetKernelSubGroupInfo(cl_kernel kernel, cl_device_id device,
 
 cl_mem clCreateBuffer(cl_context context, cl_mem_flags flags, size_t size,
                       void* host_ptr, cl_int* errcode_ret) {
-    auto ret = PFN_clCreateBuffer(context, flags, size, host_ptr, errcode_ret);
-
     Call call(oclapi::command::CREATE_BUFFER);
+    auto ret = PFN_clCreateBuffer(context, flags, size, host_ptr, errcode_ret);
+    call.record_end_time();
 
     call.record_object_use(context);
     call.record_value(flags);
@@ -588,10 +603,11 @@ cl_mem clCreateBuffer(cl_context context, cl_mem_flags flags, size_t size,
 cl_mem clCreateSubBuffer(cl_mem buffer, cl_mem_flags flags,
                          cl_buffer_create_type buffer_create_type,
                          const void* buffer_create_info, cl_int* errcode_ret) {
+    Call call(oclapi::command::CREATE_SUB_BUFFER);
     auto ret = PFN_clCreateSubBuffer(buffer, flags, buffer_create_type,
                                      buffer_create_info, errcode_ret);
+    call.record_end_time();
 
-    Call call(oclapi::command::CREATE_SUB_BUFFER);
     call.record_object_use(buffer);
     call.record_value(flags);
     call.record_value(buffer_create_type);
@@ -682,8 +698,10 @@ cl_mem clCreateImage(cl_context context, cl_mem_flags flags,
                      const cl_image_format* image_format,
                      const cl_image_desc* image_desc, void* host_ptr,
                      cl_int* errcode_ret) {
+    Call call(oclapi::command::CREATE_IMAGE);
     auto ret = PFN_clCreateImage(context, flags, image_format, image_desc,
                                  host_ptr, errcode_ret);
+    call.record_end_time();
 
     if (image_desc->mem_object != nullptr) {
         fatal("Image created from a buffer unsupported\n");
@@ -717,8 +735,6 @@ cl_mem clCreateImage(cl_context context, cl_mem_flags flags,
         calculate_image_region_size(*image_format, image_desc->image_row_pitch,
                                     image_desc->image_slice_pitch, region);
 
-    Call call(oclapi::command::CREATE_IMAGE);
-
     call.record_object_use(context);
     call.record_value(flags);
     call.record_array(1, image_format); // TODO dedicated param type?
@@ -737,11 +753,11 @@ cl_int clGetSupportedImageFormats(cl_context context, cl_mem_flags flags,
                                   cl_uint num_entries,
                                   cl_image_format* image_formats,
                                   cl_uint* num_image_formats) {
+    Call call(oclapi::command::GET_SUPPORTED_IMAGE_FORMATS);
     auto ret =
         PFN_clGetSupportedImageFormats(context, flags, image_type, num_entries,
                                        image_formats, num_image_formats);
-
-    Call call(oclapi::command::GET_SUPPORTED_IMAGE_FORMATS);
+    call.record_end_time();
 
     call.record_object_use(context);
     call.record_value(flags);
@@ -762,10 +778,10 @@ cl_int clGetSupportedImageFormats(cl_context context, cl_mem_flags flags,
 cl_int clGetImageInfo(cl_mem image, cl_image_info param_name,
                       size_t param_value_size, void* param_value,
                       size_t* param_value_size_ret) {
+    Call call(oclapi::command::GET_IMAGE_INFO);
     auto ret = PFN_clGetImageInfo(image, param_name, param_value_size,
                                   param_value, param_value_size_ret);
-
-    Call call(oclapi::command::GET_IMAGE_INFO);
+    call.record_end_time();
 
     call.record_object_use(image);
     call.record_value(param_name);
@@ -782,10 +798,11 @@ cl_int clGetImageInfo(cl_mem image, cl_image_info param_name,
 cl_int clGetMemObjectInfo(cl_mem memobj, cl_mem_info param_name,
                           size_t param_value_size, void* param_value,
                           size_t* param_value_size_ret) {
+    Call call(oclapi::command::GET_MEM_OBJECT_INFO);
     auto ret = PFN_clGetMemObjectInfo(memobj, param_name, param_value_size,
                                       param_value, param_value_size_ret);
+    call.record_end_time();
 
-    Call call(oclapi::command::GET_MEM_OBJECT_INFO);
     call.record_object_use(memobj);
     call.record_value(param_name);
     call.record_value(param_value_size);
@@ -802,10 +819,10 @@ cl_int clSetMemObjectDestructorCallback(cl_mem memobj,
                                         void(CL_CALLBACK* pfn_notify)(cl_mem,
                                                                       void*),
                                         void* user_data) {
+    Call call(oclapi::command::SET_MEM_OBJECT_DESTRUCTOR_CALLBACK);
     auto ret =
         PFN_clSetMemObjectDestructorCallback(memobj, pfn_notify, user_data);
-
-    Call call(oclapi::command::SET_MEM_OBJECT_DESTRUCTOR_CALLBACK);
+    call.record_end_time();
 
     call.record_object_use(memobj);
     call.record_callback(OCL_CALLBACK_MEM_OBJECT_DESTRUCTOR, pfn_notify);
@@ -818,9 +835,9 @@ cl_int clSetMemObjectDestructorCallback(cl_mem memobj,
 }
 
 cl_int clRetainMemObject(cl_mem memobj) {
-    auto ret = PFN_clRetainMemObject(memobj);
-
     Call call(oclapi::command::RETAIN_MEM_OBJECT);
+    auto ret = PFN_clRetainMemObject(memobj);
+    call.record_end_time();
 
     call.record_object_use(memobj);
     call.record_return_value(ret);
@@ -831,9 +848,10 @@ cl_int clRetainMemObject(cl_mem memobj) {
 }
 
 cl_int clReleaseMemObject(cl_mem mem) {
+    Call call(oclapi::command::RELEASE_MEM_OBJECT);
     auto ret = PFN_clReleaseMemObject(mem);
+    call.record_end_time();
 
-    Call call(oclapi::command::RELEASE_MEM_OBJECT);
     call.record_object_use(mem);
     call.record_return_value(ret);
     trace.record(call);
@@ -841,13 +859,98 @@ cl_int clReleaseMemObject(cl_mem mem) {
     return ret;
 }
 
+cl_sampler clCreateSampler(cl_context context, cl_bool normalized_coords,
+                           cl_addressing_mode addressing_mode,
+                           cl_filter_mode filter_mode, cl_int* errcode_ret) {
+    Call call(oclapi::command::CREATE_SAMPLER);
+    auto ret = PFN_clCreateSampler(context, normalized_coords,
+                                   addressing_mode, filter_mode, errcode_ret);
+    call.record_end_time();
+
+    call.record_object_use(context);
+    call.record_value(normalized_coords);
+    call.record_value(addressing_mode);
+    call.record_value(filter_mode);
+    call.record_value_out_by_reference(errcode_ret);
+    call.record_return_object_creation(ret);
+
+    trace.record(call);
+
+    return ret;
+}
+
+cl_sampler
+clCreateSamplerWithProperties(cl_context context,
+                              const cl_sampler_properties* sampler_properties,
+                              cl_int* errcode_ret) {
+    Call call(oclapi::command::CREATE_SAMPLER_WITH_PROPERTIES);
+    auto ret = PFN_clCreateSamplerWithProperties(context, sampler_properties,
+                                                 errcode_ret);
+    call.record_end_time();
+
+    call.record_object_use(context);
+    call.record_null_terminated_property_list(sampler_properties);
+    call.record_value_out_by_reference(errcode_ret);
+    call.record_return_object_creation(ret);
+
+    trace.record(call);
+
+    return ret;
+}
+
+cl_int clGetSamplerInfo(cl_sampler sampler, cl_sampler_info param_name,
+                        size_t param_value_size, void* param_value,
+                        size_t* param_value_size_ret) {
+    Call call(oclapi::command::GET_SAMPLER_INFO);
+    auto ret = PFN_clGetSamplerInfo(sampler, param_name, param_value_size,
+                                    param_value, param_value_size_ret);
+    call.record_end_time();
+
+    call.record_object_use(sampler);
+    call.record_value(param_name);
+    call.record_value(param_value_size);
+    call.record_value_out_by_reference(param_value, param_value_size);
+    call.record_value_out_by_reference(param_value_size_ret);
+    call.record_return_value(ret);
+
+    trace.record(call);
+
+    return ret;
+}
+
+cl_int clRetainSampler(cl_sampler sampler) {
+    Call call(oclapi::command::RETAIN_SAMPLER);
+    auto ret = PFN_clRetainSampler(sampler);
+    call.record_end_time();
+
+    call.record_object_use(sampler);
+    call.record_return_value(ret);
+
+    trace.record(call);
+
+    return ret;
+}
+
+cl_int clReleaseSampler(cl_sampler sampler) {
+    Call call(oclapi::command::RELEASE_SAMPLER);
+    auto ret = PFN_clReleaseSampler(sampler);
+    call.record_end_time();
+
+    call.record_object_use(sampler);
+    call.record_return_value(ret);
+    trace.record(call);
+
+    return ret;
+}
+
 cl_command_queue clCreateCommandQueue(cl_context context, cl_device_id device,
                                       cl_command_queue_properties properties,
                                       cl_int* errcode_ret) {
+    Call call(oclapi::command::CREATE_COMMAND_QUEUE);
     auto ret =
         PFN_clCreateCommandQueue(context, device, properties, errcode_ret);
+    call.record_end_time();
 
-    Call call(oclapi::command::CREATE_COMMAND_QUEUE);
     call.record_object_use(context);
     call.record_object_use(device);
     call.record_value(properties);
@@ -863,10 +966,10 @@ cl_command_queue
 clCreateCommandQueueWithProperties(cl_context context, cl_device_id device,
                                    const cl_queue_properties* properties,
                                    cl_int* errcode_ret) {
+    Call call(oclapi::command::CREATE_COMMAND_QUEUE_WITH_PROPERTIES);
     auto ret = PFN_clCreateCommandQueueWithProperties(context, device,
                                                       properties, errcode_ret);
-
-    Call call(oclapi::command::CREATE_COMMAND_QUEUE_WITH_PROPERTIES);
+    call.record_end_time();
 
     call.record_object_use(context);
     call.record_object_use(device);
@@ -883,11 +986,11 @@ cl_int clGetCommandQueueInfo(cl_command_queue command_queue,
                              cl_command_queue_info param_name,
                              size_t param_value_size, void* param_value,
                              size_t* param_value_size_ret) {
+    Call call(oclapi::command::GET_COMMAND_QUEUE_INFO);
     auto ret =
         PFN_clGetCommandQueueInfo(command_queue, param_name, param_value_size,
                                   param_value, param_value_size_ret);
-
-    Call call(oclapi::command::GET_COMMAND_QUEUE_INFO);
+    call.record_end_time();
 
     call.record_object_use(command_queue);
     call.record_value(param_name);
@@ -902,9 +1005,9 @@ cl_int clGetCommandQueueInfo(cl_command_queue command_queue,
 }
 
 cl_int clRetainCommandQueue(cl_command_queue command_queue) {
-    auto ret = PFN_clRetainCommandQueue(command_queue);
-
     Call call(oclapi::command::RETAIN_COMMAND_QUEUE);
+    auto ret = PFN_clRetainCommandQueue(command_queue);
+    call.record_end_time();
 
     call.record_object_use(command_queue);
     call.record_return_value(ret);
@@ -915,9 +1018,10 @@ cl_int clRetainCommandQueue(cl_command_queue command_queue) {
 }
 
 cl_int clReleaseCommandQueue(cl_command_queue queue) {
+    Call call(oclapi::command::RELEASE_COMMAND_QUEUE);
     auto ret = PFN_clReleaseCommandQueue(queue);
+    call.record_end_time();
 
-    Call call(oclapi::command::RELEASE_COMMAND_QUEUE);
     call.record_object_use(queue);
     call.record_return_value(ret);
     trace.record(call);
@@ -930,11 +1034,11 @@ cl_int clEnqueueNDRangeKernel(
     const size_t* global_work_offset, const size_t* global_work_size,
     const size_t* local_work_size, cl_uint num_events_in_wait_list,
     const cl_event* event_wait_list, cl_event* event) {
+    Call call(oclapi::command::ENQUEUE_NDRANGE_KERNEL);
     auto ret = PFN_clEnqueueNDRangeKernel(
         command_queue, kernel, work_dim, global_work_offset, global_work_size,
         local_work_size, num_events_in_wait_list, event_wait_list, event);
-
-    Call call(oclapi::command::ENQUEUE_NDRANGE_KERNEL);
+    call.record_end_time();
 
     call.record_object_use(command_queue);
     call.record_object_use(kernel);
@@ -959,16 +1063,15 @@ cl_int clEnqueueWriteImage(cl_command_queue command_queue, cl_mem image,
                            size_t input_slice_pitch, const void* ptr,
                            cl_uint num_events_in_wait_list,
                            const cl_event* event_wait_list, cl_event* event) {
-
-    if (!blocking_write) {
-        warn("Non-blocking image write will be made blocking\n");
-        trace.set_flag(Trace::flags::kImperfect);
-    }
-    // FIXME don't force command to be blocking
+    // The application can't modify ptr until the write has completed, its
+    // contents can be recorded without waiting.
+    Call call(oclapi::command::ENQUEUE_WRITE_IMAGE);
     auto ret = PFN_clEnqueueWriteImage(
-        command_queue, image, CL_BLOCKING, origin, region, input_row_pitch,
+        command_queue, image, blocking_write, origin, region, input_row_pitch,
         input_slice_pitch, ptr, num_events_in_wait_list, event_wait_list,
         event);
+    call.record_end_time();
+
     cl_image_format format;
 
     // TODO record format at image creation time instead
@@ -981,8 +1084,6 @@ cl_int clEnqueueWriteImage(cl_command_queue command_queue, cl_mem image,
     auto data_size = calculate_image_region_size(format, input_row_pitch,
                                                  input_slice_pitch, region);
 
-    Call call(oclapi::command::ENQUEUE_WRITE_IMAGE);
-
     call.record_object_use(command_queue);
     call.record_object_use(image);
     call.record_value(blocking_write);
@@ -1014,9 +1115,12 @@ cl_int clEnqueueReadImage(cl_command_queue command_queue, cl_mem image,
         trace.set_flag(Trace::flags::kImperfect);
     }
     // FIXME don't force command to be blocking
+    Call call(oclapi::command::ENQUEUE_READ_IMAGE);
     auto ret = PFN_clEnqueueReadImage(
         command_queue, image, CL_BLOCKING, origin, region, row_pitch,
         slice_pitch, ptr, num_events_in_wait_list, event_wait_list, event);
+    call.record_end_time();
+
     cl_image_format format;
 
     // TODO record format at image creation time instead
@@ -1029,8 +1133,6 @@ cl_int clEnqueueReadImage(cl_command_queue command_queue, cl_mem image,
     auto data_size =
         calculate_image_region_size(format, row_pitch, slice_pitch, region);
 
-    Call call(oclapi::command::ENQUEUE_READ_IMAGE);
-
     call.record_object_use(command_queue);
     call.record_object_use(image);
     call.record_value(blocking_read);
@@ -1061,11 +1163,11 @@ void* clEnqueueMapBuffer(cl_command_queue command_queue, cl_mem buffer,
         trace.set_flag(Trace::flags::kImperfect);
     }
     // FIXME don't force command to be blocking
+    Call call(oclapi::command::ENQUEUE_MAP_BUFFER);
     auto ret = PFN_clEnqueueMapBuffer(
         command_queue, buffer, CL_BLOCKING, map_flags, offset, size,
         num_events_in_wait_list, event_wait_list, event, errcode_ret);
-
-    Call call(oclapi::command::ENQUEUE_MAP_BUFFER);
+    call.record_end_time();
 
     call.record_object_use(command_queue);
     call.record_object_use(buffer);
@@ -1093,14 +1195,14 @@ cl_int clEnqueueUnmapMemObject(cl_command_queue command_queue, cl_mem memobj,
     trace.set_flag(Trace::flags::kImperfect);
     // TODO insert a barrier
     // TODO capture memory region
+    Call call(oclapi::command::ENQUEUE_UNMAP_MEM_OBJECT);
     auto ret = PFN_clEnqueueUnmapMemObject(command_queue, memobj, mapped_ptr,
                                            num_events_in_wait_list,
                                            event_wait_list, event);
+    call.record_end_time();
     // TODO wait
     // TODO remove mapped pointer
 
-    Call call(oclapi::command::ENQUEUE_UNMAP_MEM_OBJECT);
-
     call.record_object_use(command_queue);
     call.record_object_use(memobj);
     call.record_pointer_unmap(mapped_ptr);
@@ -1119,17 +1221,13 @@ cl_int clEnqueueWriteBuffer(cl_command_queue command_queue, cl_mem buffer,
                             cl_bool blocking_write, size_t offset, size_t size,
                             const void* ptr, cl_uint num_events_in_wait_list,
                             const cl_event* event_wait_list, cl_event* event) {
-    if (!blocking_write) {
-        warn("Non-blocking image write will be made blocking\n");
-        trace.set_flag(Trace::flags::kImperfect);
-    }
-    // FIXME don't force command to be blocking
-
+    // The application can't modify ptr until the write has completed, its
+    // contents can be recorded without waiting.
+    Call call(oclapi::command::ENQUEUE_WRITE_BUFFER);
     auto ret = PFN_clEnqueueWriteBuffer(
-        command_queue, buffer, CL_BLOCKING, offset, size, ptr,
+        command_queue, buffer, blocking_write, offset, size, ptr,
         num_events_in_wait_list, event_wait_list, event);
-
-    Call call(oclapi::command::ENQUEUE_WRITE_BUFFER);
+    call.record_end_time();
 
     call.record_object_use(command_queue);
     call.record_object_use(buffer);
@@ -1157,11 +1255,11 @@ cl_int clEnqueueReadBuffer(cl_command_queue command_queue, cl_mem buffer,
         trace.set_flag(Trace::flags::kImperfect);
     }
     // FIXME don't force command to be blocking
+    Call call(oclapi::command::ENQUEUE_READ_BUFFER);
     auto ret = PFN_clEnqueueReadBuffer(
         command_queue, buffer, CL_BLOCKING, offset, size, ptr,
         num_events_in_wait_list, event_wait_list, event);
-
-    Call call(oclapi::command::ENQUEUE_READ_BUFFER);
+    call.record_end_time();
 
     call.record_object_use(command_queue);
     call.record_object_use(buffer);
@@ -1183,10 +1281,10 @@ cl_int clEnqueueReadBuffer(cl_command_queue command_queue, cl_mem buffer,
 cl_int clEnqueueTask(cl_command_queue command_queue, cl_kernel kernel,
                      cl_uint num_events_in_wait_list,
                      const cl_event* event_wait_list, cl_event* event) {
+    Call call(oclapi::command::ENQUEUE_TASK);
     auto ret = PFN_clEnqueueTask(command_queue, kernel, num_events_in_wait_list,
                                  event_wait_list, event);
-
-    Call call(oclapi::command::ENQUEUE_TASK);
+    call.record_end_time();
 
     call.record_object_use(command_queue);
     call.record_object_use(kernel);
@@ -1204,10 +1302,10 @@ cl_int clEnqueueTask(cl_command_queue command_queue, cl_kernel kernel,
 cl_int clGetEventInfo(cl_event event, cl_event_info param_name,
                       size_t param_value_size, void* param_value,
                       size_t* param_value_size_ret) {
+    Call call(oclapi::command::GET_EVENT_INFO);
     auto ret = PFN_clGetEventInfo(event, param_name, param_value_size,
                                   param_value, param_value_size_ret);
-
-    Call call(oclapi::command::GET_EVENT_INFO);
+    call.record_end_time();
 
     call.record_object_use(event);
     call.record_value(param_name);
@@ -1224,10 +1322,10 @@ cl_int clGetEventInfo(cl_event event, cl_event_info param_name,
 cl_int clGetEventProfilingInfo(cl_event event, cl_profiling_info param_name,
                                size_t param_value_size, void* param_value,
                                size_t* param_value_size_ret) {
+    Call call(oclapi::command::GET_EVENT_PROFILING_INFO);
     auto ret = PFN_clGetEventProfilingInfo(event, param_name, param_value_size,
                                            param_value, param_value_size_ret);
-
-    Call call(oclapi::command::GET_EVENT_PROFILING_INFO);
+    call.record_end_time();
 
     call.record_object_use(event);
     call.record_value(param_name);
@@ -1242,9 +1340,9 @@ cl_int clGetEventProfilingInfo(cl_event event, cl_profiling_info param_name,
 }
 
 cl_event clCreateUserEvent(cl_context context, cl_int* errcode_ret) {
-    auto ret = PFN_clCreateUserEvent(context, errcode_ret);
-
     Call call(oclapi::command::CREATE_USER_EVENT);
+    auto ret = PFN_clCreateUserEvent(context, errcode_ret);
+    call.record_end_time();
 
     call.record_object_use(context);
     call.record_value_out_by_reference(errcode_ret);
@@ -1256,9 +1354,9 @@ cl_event clCreateUserEvent(cl_context context, cl_int* errcode_ret) {
 }
 
 cl_int clSetUserEventStatus(cl_event event, cl_int execution_status) {
-    auto ret = PFN_clSetUserEventStatus(event, execution_status);
-
     Call call(oclapi::command::SET_USER_EVENT_STATUS);
+    auto ret = PFN_clSetUserEventStatus(event, execution_status);
+    call.record_end_time();
 
     call.record_object_use(event);
     call.record_value(execution_status);
@@ -1270,20 +1368,23 @@ cl_int clSetUserEventStatus(cl_event event, cl_int execution_status) {
 }
 
 cl_int clWaitForEvents(cl_uint num_events, const cl_event* event_list) {
-    auto ret = PFN_clWaitForEvents(num_events, event_list);
-
     Call call(oclapi::command::WAIT_FOR_EVENTS);
+    auto ret = PFN_clWaitForEvents(num_events, event_list);
+    call.record_end_time();
 
     call.record_value(num_events);
     call.record_object_use(num_events, const_cast<cl_event*>(event_list));
+    call.record_return_value(ret);
+
+    trace.record(call);
 
     return ret;
 }
 
 cl_int clRetainEvent(cl_event event) {
-    auto ret = PFN_clRetainEvent(event);
-
     Call call(oclapi::command::RETAIN_EVENT);
+    auto ret = PFN_clRetainEvent(event);
+    call.record_end_time();
 
     call.record_object_use(event);
     call.record_return_value(ret);
@@ -1294,9 +1395,9 @@ cl_int clRetainEvent(cl_event event) {
 }
 
 cl_int clReleaseEvent(cl_event event) {
-    auto ret = PFN_clReleaseEvent(event);
-
     Call call(oclapi::command::RELEASE_EVENT);
+    auto ret = PFN_clReleaseEvent(event);
+    call.record_end_time();
 
     call.record_object_use(event);
     call.record_return_value(ret);
@@ -1307,9 +1408,9 @@ cl_int clReleaseEvent(cl_event event) {
 }
 
 cl_int clFlush(cl_command_queue command_queue) {
-    auto ret = PFN_clFlush(command_queue);
-
     Call call(oclapi::command::FLUSH);
+    auto ret = PFN_clFlush(command_queue);
+    call.record_end_time();
 
     call.record_object_use(command_queue);
     call.record_return_value(ret);
@@ -1320,9 +1421,9 @@ cl_int clFlush(cl_command_queue command_queue) {
 }
 
 cl_int clFinish(cl_command_queue queue) {
-    auto ret = PFN_clFinish(queue);
-
     Call call(oclapi::command::FINISH);
+    auto ret = PFN_clFinish(queue);
+    call.record_end_time();
 
     call.record_object_use(queue);
     call.record_return_value(ret);
@@ -1335,9 +1436,10 @@ cl_int clFinish(cl_command_queue queue) {
 #if 0
 void* clSVMAlloc(cl_context context, cl_svm_mem_flags flags, size_t size,
                  unsigned int alignment) {
+    Call call(oclapi::command::SVMALLOC);
     auto ret = PFN_clSVMAlloc(context, flags, size, alignment);
+    call.record_end_time();
 
-    Call call(oclapi::command::SVMALLOC);
     call.record_object_use(context);
     call.record_value(flags);
     call.record_value(size);
@@ -1350,9 +1452,10 @@ void* clSVMAlloc(cl_context context, cl_svm_mem_flags flags, size_t size,
 }
 
 void clSVMFree(cl_context context, void* svm_pointer) {
+    Call call(oclapi::command::SVMFREE);
     PFN_clSVMFree(context, svm_pointer);
+    call.record_end_time();
 
-    Call call(oclapi::command::SVMFREE);
     call.record_object_use(context);
     call.record_pointer_unmap(svm_pointer); // FIXME
 
@@ -1361,9 +1464,9 @@ void clSVMFree(cl_context context, void* svm_pointer) {
 #endif
 
 cl_int clUnloadCompiler(void) {
-    auto ret = PFN_clUnloadCompiler();
-
     Call call(oclapi::command::UNLOAD_COMPILER);
+    auto ret = PFN_clUnloadCompiler();
+    call.record_end_time();
 
     call.record_return_value(ret);
 
@@ -1373,9 +1476,9 @@ cl_int clUnloadCompiler(void) {
 }
 
 cl_int clUnloadPlatformCompiler(cl_platform_id platform) {
-    auto ret = PFN_clUnloadPlatformCompiler(platform);
-
     Call call(oclapi::command::UNLOAD_PLATFORM_COMPILER);
+    auto ret = PFN_clUnloadPlatformCompiler(platform);
+    call.record_end_time();
 
     call.record_object_use(platform);
     call.record_return_value(ret);
@@ -0,0 +1,137 @@
+// Copyright 2019-2023 The OpenCL-Tools authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+// CRC32C (Castagnoli), as computed by the SSE4.2 and ARMv8 CRC32C
+// instructions. The hardware implementation is selected at runtime when
+// available, a table-driven implementation is used otherwise.
+
+static const uint32_t kCrc32cPolynomial = 0x82f63b78; // Reflected
+
+static uint32_t crc32c_update_sw(uint32_t crc, const uint8_t* data,
+                                 size_t size) {
+    // Slicing-by-8 tables
+    static const struct Tables {
+        Tables() {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t crc = i;
+                for (int j = 0; j < 8; j++) {
+                    crc = (crc >> 1) ^ ((crc & 1) ? kCrc32cPolynomial : 0);
+                }
+                t[0][i] = crc;
+            }
+            for (uint32_t i = 0; i < 256; i++) {
+                for (int k = 1; k < 8; k++) {
+                    t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+                }
+            }
+        }
+        uint32_t t[8][256];
+    } tables;
+    auto& t = tables.t;
+
+    while (size >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, data, 4);
+        memcpy(&hi, data + 4, 4);
+        lo ^= crc;
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+              t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^ t[3][hi & 0xff] ^
+              t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_update_hw(uint32_t crc, const uint8_t* data, size_t size) {
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        uint64_t val;
+        memcpy(&val, data, 8);
+        crc64 = _mm_crc32_u64(crc64, val);
+        data += 8;
+        size -= 8;
+    }
+    crc = static_cast<uint32_t>(crc64);
+    while (size-- > 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+
+static bool crc32c_hw_supported() { return __builtin_cpu_supports("sse4.2"); }
+
+#elif defined(__aarch64__)
+
+__attribute__((target("+crc"))) static uint32_t
+crc32c_update_hw(uint32_t crc, const uint8_t* data, size_t size) {
+    while (size >= 8) {
+        uint64_t val;
+        memcpy(&val, data, 8);
+        crc = __crc32cd(crc, val);
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = __crc32cb(crc, *data++);
+    }
+    return crc;
+}
+
+static bool crc32c_hw_supported() {
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+#else
+
+static uint32_t crc32c_update_hw(uint32_t crc, const uint8_t* data,
+                                 size_t size) {
+    return crc32c_update_sw(crc, data, size);
+}
+
+static bool crc32c_hw_supported() { return false; }
+
+#endif
+
+static uint32_t crc32c(const void* data, size_t size, uint32_t crc = 0) {
+    static const bool hw = crc32c_hw_supported();
+    auto bytes = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+    if (hw) {
+        crc = crc32c_update_hw(crc, bytes, size);
+    } else {
+        crc = crc32c_update_sw(crc, bytes, size);
+    }
+    return ~crc;
+}
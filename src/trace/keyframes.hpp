@@ -0,0 +1,420 @@
+// Copyright 2019-2023 The OpenCL-Tools authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "log.hpp"
+#include "serialize.hpp"
+#include "trace.hpp"
+#include "trim.hpp"
+#include "visitor-replay.hpp"
+
+// Keyframe file layout:
+//    magic
+//    format version
+//    number of calls in the trace
+//    keyframes, each
+//        index of the call the keyframe was taken before
+//        number of memory objects
+//        memory objects, each
+//            capture ID
+//            size
+//            contents
+
+static const char kKeyframeMagic[8] = {'C', 'L', 'K', 'E', 'Y', 'F', 'R', 0};
+static const uint32_t kKeyframeVersion = 1;
+
+// Set by SIGUSR1 to take a keyframe before the next call
+static volatile sig_atomic_t gKeyframeRequested = 0;
+
+static void keyframe_request(int) { gKeyframeRequested = 1; }
+
+// Replays a trace taking keyframes, or from a keyframe. A keyframe holds the
+// contents of the memory objects alive before a call. The other objects are
+// recreated by replaying the calls before the keyframe that the rest of the
+// trace depends on (see TraceTrimmer), with kernel launches replaced by
+// markers since their results are overwritten by the keyframe.
+//
+// Sub-buffers and images created from buffers are restored with their
+// parent. Memory objects mapped at the time of a keyframe aren't supported.
+struct KeyframeReplay {
+
+    KeyframeReplay(const Trace& trace, TraceReplayVisitor& replay)
+        : m_trace(trace), m_replay(replay) {}
+
+    // Replay the whole trace, taking a keyframe every interval calls, or on
+    // SIGUSR1 when interval is 0
+    bool record(const std::string& path, size_t interval) {
+        std::ofstream os(path, std::ios::binary);
+        if (!os.good()) {
+            error("Can't create '%s'\n", path.c_str());
+            return false;
+        }
+        auto& calls = m_trace.calls();
+        os.write(kKeyframeMagic, sizeof(kKeyframeMagic));
+        ::serialize(os, kKeyframeVersion);
+        ::serialize(os, static_cast<uint64_t>(calls.size()));
+
+        gKeyframeRequested = 0;
+        auto previous = signal(SIGUSR1, keyframe_request);
+        m_replay.preVisit(m_trace);
+        size_t num_keyframes = 0;
+        bool success = true;
+        for (size_t i = 0; i < calls.size(); i++) {
+            bool due = (interval != 0) && (i % interval == 0);
+            if ((i != 0) && (due || gKeyframeRequested)) {
+                gKeyframeRequested = 0;
+                if (!snapshot(os, i)) {
+                    success = false;
+                    break;
+                }
+                num_keyframes++;
+            }
+            m_replay.visitCall(calls[i]);
+            replay_live_objects_update(calls[i], m_live);
+        }
+        release_queues();
+        m_replay.postVisit();
+        signal(SIGUSR1, previous);
+
+        info("Wrote %zu keyframes to '%s'", num_keyframes, path.c_str());
+        return success;
+    }
+
+    // Replay from the last keyframe at or before call start
+    bool start_at(const std::string& path, size_t start) {
+        std::ifstream is(path, std::ios::binary);
+        if (!open(is, path)) {
+            return false;
+        }
+        size_t index = 0;
+        std::streampos pos;
+        if (!find(is, start, index, pos)) {
+            error("Corrupted keyframes in '%s'\n", path.c_str());
+            return false;
+        }
+        if (index == 0) {
+            warn("No keyframe before call %zu, replaying from the start\n",
+                 start);
+        }
+
+        auto& calls = m_trace.calls();
+        auto keep = TraceTrimmer(m_trace).slice(index, calls.size());
+        auto elided = m_replay.options().elided;
+        replay_elided_calls setup_elided;
+        if (elided != nullptr) {
+            setup_elided = *elided;
+        }
+        size_t num_setup = 0;
+        size_t num_markers = 0;
+        for (size_t i = 0; i < index; i++) {
+            auto kind = replay_command_kind(calls[i].id());
+            if (keep[i] && (kind == ReplayCommandKind::kernel)) {
+                setup_elided.insert(&calls[i]);
+                num_markers++;
+            }
+        }
+        m_replay.use_elided_calls(&setup_elided);
+        m_replay.preVisit(m_trace);
+        for (size_t i = 0; i < index; i++) {
+            if (keep[i]) {
+                m_replay.visitCall(calls[i]);
+                replay_live_objects_update(calls[i], m_live);
+                num_setup++;
+            }
+        }
+        m_replay.use_elided_calls(elided);
+        if (index != 0) {
+            is.clear();
+            is.seekg(pos);
+            size_t num_restored;
+            if (!restore(is, num_restored)) {
+                error("Can't restore the keyframe at call %zu\n", index);
+                release_queues();
+                m_replay.postVisit();
+                return false;
+            }
+            info("Restored the keyframe at call %zu: %zu of the %zu calls "
+                 "before it replayed (%zu kernel launches as markers), %zu "
+                 "memory objects restored",
+                 index, num_setup, index, num_markers, num_restored);
+        }
+        release_queues();
+
+        for (size_t i = index; i < calls.size(); i++) {
+            m_replay.visitCall(calls[i]);
+        }
+        m_replay.postVisit();
+        return true;
+    }
+
+private:
+    // How the contents of a memory object are transferred
+    struct Layout {
+        bool image;
+        size_t size;
+        size_t region[3];
+        cl_context context;
+    };
+
+    // Returns false for the memory objects that aren't saved
+    static bool describe(cl_mem mem, Layout& layout) {
+        cl_mem_object_type type;
+        cl_mem parent;
+        auto err = PFN_clGetMemObjectInfo(mem, CL_MEM_TYPE, sizeof(type),
+                                          &type, nullptr);
+        err |= PFN_clGetMemObjectInfo(mem, CL_MEM_SIZE, sizeof(layout.size),
+                                      &layout.size, nullptr);
+        err |= PFN_clGetMemObjectInfo(mem, CL_MEM_CONTEXT,
+                                      sizeof(layout.context), &layout.context,
+                                      nullptr);
+        err |= PFN_clGetMemObjectInfo(mem, CL_MEM_ASSOCIATED_MEMOBJECT,
+                                      sizeof(parent), &parent, nullptr);
+        if ((err != CL_SUCCESS) || (parent != nullptr)) {
+            return false;
+        }
+        layout.image = type != CL_MEM_OBJECT_BUFFER;
+        if (!layout.image) {
+            return true;
+        }
+
+        size_t element, width, height, depth, array;
+        err = PFN_clGetImageInfo(mem, CL_IMAGE_ELEMENT_SIZE, sizeof(element),
+                                 &element, nullptr);
+        err |= PFN_clGetImageInfo(mem, CL_IMAGE_WIDTH, sizeof(width), &width,
+                                  nullptr);
+        err |= PFN_clGetImageInfo(mem, CL_IMAGE_HEIGHT, sizeof(height),
+                                  &height, nullptr);
+        err |= PFN_clGetImageInfo(mem, CL_IMAGE_DEPTH, sizeof(depth), &depth,
+                                  nullptr);
+        err |= PFN_clGetImageInfo(mem, CL_IMAGE_ARRAY_SIZE, sizeof(array),
+                                  &array, nullptr);
+        if (err != CL_SUCCESS) {
+            return false;
+        }
+        layout.region[0] = width;
+        layout.region[1] = std::max<size_t>(height, 1);
+        layout.region[2] = std::max<size_t>(depth, 1);
+        if (type == CL_MEM_OBJECT_IMAGE1D_ARRAY) {
+            layout.region[1] = array;
+        } else if (type == CL_MEM_OBJECT_IMAGE2D_ARRAY) {
+            layout.region[2] = array;
+        }
+        layout.size =
+            element * layout.region[0] * layout.region[1] * layout.region[2];
+        return true;
+    }
+
+    // A queue on the context, created when the trace has none alive
+    cl_command_queue queue_for(cl_context context) {
+        for (auto& obj : m_live) {
+            if (obj.first.first != CALL_PARAM_TEMPLATE_TYPE_CL_COMMANDQUEUE) {
+                continue;
+            }
+            auto queue =
+                object_replay_tracker<cl_command_queue>().get(obj.first.second);
+            cl_context qctx;
+            auto err = PFN_clGetCommandQueueInfo(queue, CL_QUEUE_CONTEXT,
+                                                 sizeof(qctx), &qctx, nullptr);
+            if ((err == CL_SUCCESS) && (qctx == context)) {
+                return queue;
+            }
+        }
+        auto it = m_queues.find(context);
+        if (it != m_queues.end()) {
+            return it->second;
+        }
+        cl_device_id device;
+        auto err = PFN_clGetContextInfo(context, CL_CONTEXT_DEVICES,
+                                        sizeof(device), &device, nullptr);
+        cl_command_queue queue = nullptr;
+        if (err == CL_SUCCESS) {
+            queue = PFN_clCreateCommandQueue(context, device, 0, &err);
+        }
+        if (err != CL_SUCCESS) {
+            return nullptr;
+        }
+        m_queues[context] = queue;
+        return queue;
+    }
+
+    void release_queues() {
+        for (auto& queue : m_queues) {
+            PFN_clReleaseCommandQueue(queue.second);
+        }
+        m_queues.clear();
+    }
+
+    bool transfer(cl_mem mem, const Layout& layout, bool write, char* data) {
+        auto queue = queue_for(layout.context);
+        if (queue == nullptr) {
+            return false;
+        }
+        static const size_t origin[3] = {0, 0, 0};
+        cl_int err;
+        if (layout.image && write) {
+            err = PFN_clEnqueueWriteImage(queue, mem, CL_TRUE, origin,
+                                          layout.region, 0, 0, data, 0,
+                                          nullptr, nullptr);
+        } else if (layout.image) {
+            err = PFN_clEnqueueReadImage(queue, mem, CL_TRUE, origin,
+                                         layout.region, 0, 0, data, 0, nullptr,
+                                         nullptr);
+        } else if (write) {
+            err = PFN_clEnqueueWriteBuffer(queue, mem, CL_TRUE, 0, layout.size,
+                                           data, 0, nullptr, nullptr);
+        } else {
+            err = PFN_clEnqueueReadBuffer(queue, mem, CL_TRUE, 0, layout.size,
+                                          data, 0, nullptr, nullptr);
+        }
+        return err == CL_SUCCESS;
+    }
+
+    bool snapshot(std::ostream& os, size_t index) {
+        m_replay.finish();
+        std::vector<std::pair<uint64_t, Layout>> mems;
+        for (auto& obj : m_live) {
+            if (obj.first.first != CALL_PARAM_TEMPLATE_TYPE_CL_MEM) {
+                continue;
+            }
+            auto id = obj.first.second;
+            Layout layout;
+            if (describe(object_replay_tracker<cl_mem>().get(id), layout)) {
+                mems.emplace_back(id, layout);
+            }
+        }
+
+        ::serialize(os, static_cast<uint64_t>(index));
+        ::serialize(os, static_cast<uint32_t>(mems.size()));
+        std::vector<char> contents;
+        for (auto& mem : mems) {
+            contents.resize(mem.second.size);
+            auto handle = object_replay_tracker<cl_mem>().get(mem.first);
+            if (!transfer(handle, mem.second, false, contents.data())) {
+                error("Can't save memory object #%llu\n",
+                      static_cast<unsigned long long>(mem.first));
+                return false;
+            }
+            ::serialize(os, mem.first);
+            ::serialize(os, static_cast<uint64_t>(contents.size()));
+            os.write(contents.data(), contents.size());
+        }
+        os.flush();
+        debug("Keyframe at call %zu, %zu memory objects\n", index,
+              mems.size());
+        return os.good();
+    }
+
+    bool open(std::istream& is, const std::string& path) const {
+        if (!is.good()) {
+            error("Can't open '%s'\n", path.c_str());
+            return false;
+        }
+        char magic[sizeof(kKeyframeMagic)];
+        is.read(magic, sizeof(magic));
+        if (!is.good() || memcmp(magic, kKeyframeMagic, sizeof(magic))) {
+            error("'%s' is not a keyframe file\n", path.c_str());
+            return false;
+        }
+        auto version = ::deserialize<uint32_t>(is);
+        if (version != kKeyframeVersion) {
+            error("Unsupported keyframe version %u in '%s' (expected %u)\n",
+                  version, path.c_str(), kKeyframeVersion);
+            return false;
+        }
+        auto num_calls = ::deserialize<uint64_t>(is);
+        if (num_calls != m_trace.calls().size()) {
+            error("'%s' was taken from a trace of %llu calls, not %zu\n",
+                  path.c_str(), static_cast<unsigned long long>(num_calls),
+                  m_trace.calls().size());
+            return false;
+        }
+        return true;
+    }
+
+    // Find the last keyframe at or before call start, its memory objects
+    // start at pos
+    bool find(std::istream& is, size_t start, size_t& index,
+              std::streampos& pos) const {
+        while (true) {
+            auto at = ::deserialize<uint64_t>(is);
+            auto contents = is.tellg();
+            auto count = ::deserialize<uint32_t>(is);
+            if (is.eof()) {
+                return true;
+            }
+            if (!is.good() || (at >= m_trace.calls().size())) {
+                return false;
+            }
+            if (at > start) {
+                return true;
+            }
+            index = at;
+            pos = contents;
+            for (uint32_t i = 0; i < count; i++) {
+                ::deserialize<uint64_t>(is);
+                auto size = ::deserialize<uint64_t>(is);
+                is.seekg(size, std::ios::cur);
+            }
+            if (!is.good()) {
+                return false;
+            }
+        }
+    }
+
+    // Write back the contents of the memory objects that were recreated
+    bool restore(std::istream& is, size_t& num_restored) {
+        num_restored = 0;
+        auto count = ::deserialize<uint32_t>(is);
+        std::vector<char> contents;
+        for (uint32_t i = 0; i < count; i++) {
+            auto id = ::deserialize<uint64_t>(is);
+            auto size = ::deserialize<uint64_t>(is);
+            if (!is.good()) {
+                return false;
+            }
+            if (m_live.count({CALL_PARAM_TEMPLATE_TYPE_CL_MEM, id}) == 0) {
+                // Not used by the rest of the trace
+                is.seekg(size, std::ios::cur);
+                continue;
+            }
+            contents.resize(size);
+            is.read(contents.data(), size);
+            auto mem = object_replay_tracker<cl_mem>().get(id);
+            Layout layout;
+            if (!is.good() || !describe(mem, layout) ||
+                (layout.size != size) ||
+                !transfer(mem, layout, true, contents.data())) {
+                return false;
+            }
+            num_restored++;
+        }
+        return true;
+    }
+
+    const Trace& m_trace;
+    TraceReplayVisitor& m_replay;
+    replay_live_objects m_live;
+    // Queues created to transfer memory contents, by context
+    std::unordered_map<cl_context, cl_command_queue> m_queues;
+};
@@ -15,15 +15,30 @@
 #include "ocltools.hpp"
 
 #include "CLI/CLI.hpp"
+#include <cerrno>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <string>
 
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "bench.hpp"
+#include "keyframes.hpp"
+#include "optimize.hpp"
+#include "replay-instances.hpp"
+#include "replay-modes.hpp"
+#include "replay-queues.hpp"
 #include "trace.hpp"
+#include "trim.hpp"
+#include "tune.hpp"
+#include "verify.hpp"
 
+#include "visitor-export.hpp"
 #include "visitor-replay.hpp"
 #include "visitor-srcgen.hpp"
 
@@ -38,42 +53,405 @@ bool handle_capture(const std::string& tracefile, const std::string& app,
     return run_binary_with_preload(app, args, "libocltools-trace.so", env);
 }
 
-bool handle_replay(const std::string& tracefile) {
+// Load a trace, optionally without the queries whose results are never used
+bool load_trace(const std::string& tracefile, bool drop_queries,
+                Trace& trace) {
+    if (!drop_queries) {
+        return trace.load(tracefile);
+    }
+    Trace full;
+    if (!full.load(tracefile)) {
+        return false;
+    }
+    size_t num_dropped;
+    auto keep = eliminate_dead_queries(full, num_dropped);
+    // Not info(), generated sources may be written to standard output
+    debug("Dropped %zu dead queries out of %zu calls\n", num_dropped,
+          full.calls().size());
+    full.extract(keep, trace);
+    return true;
+}
+
+// Program binary cache in dir or, by default, in the directory named by the
+// environment. Returns nullptr when the cache isn't used.
+std::unique_ptr<ProgramBinaryCache> make_program_cache(std::string dir) {
+    if (dir.empty()) {
+        auto env = getenv(kProgramCacheEnv);
+        if (env != nullptr) {
+            dir = env;
+        }
+    }
+    if (dir.empty()) {
+        return nullptr;
+    }
+    return std::make_unique<ProgramBinaryCache>(dir);
+}
+
+// Map of the devices to replay on, nullptr when the captured ones are used
+bool make_device_map(const ReplayDeviceOptions& options, const Trace& trace,
+                     std::unique_ptr<ReplayDeviceMap>& devices) {
+    if (!options.active()) {
+        return true;
+    }
+    devices = std::make_unique<ReplayDeviceMap>(options);
+    return devices->init(trace);
+}
+
+bool handle_replay(const std::string& tracefile, bool drop_queries,
+                   bool queue_threads, const std::string& program_cache_dir,
+                   bool validate, const std::string& tolerance,
+                   const ReplayDeviceOptions& device_options,
+                   const std::string& pacing_spec, const std::string& keyframes,
+                   size_t keyframe_interval, size_t start_at, ReplayMode mode,
+                   const std::string& overrides_file) {
+    ReplayTolerance tol;
+    if (!ReplayTolerance::parse(tolerance, tol)) {
+        error("Invalid tolerance '%s'\n", tolerance.c_str());
+        return false;
+    }
+    ReplayPacing pacing;
+    if (!pacing_spec.empty() && !ReplayPacing::parse(pacing_spec, pacing)) {
+        error("Invalid pacing '%s'\n", pacing_spec.c_str());
+        return false;
+    }
+    void* handle = dlopen("libOpenCL.so", RTLD_LAZY);
+    init_api(handle);
+    Trace trace;
+    if (!load_trace(tracefile, drop_queries, trace)) {
+        return false;
+    }
+    std::unique_ptr<ReplayDeviceMap> devices;
+    if (!make_device_map(device_options, trace, devices)) {
+        return false;
+    }
+    ProgramOverrides overrides;
+    if (!overrides_file.empty()) {
+        if (!overrides.load(overrides_file)) {
+            return false;
+        }
+        overrides.plan(trace);
+    }
+    auto program_cache = make_program_cache(program_cache_dir);
+    replay_elided_calls elided;
+    replay_plan_mode(trace, mode, elided);
+    ReplayValidator validator(tol);
+    auto validator_ptr = validate ? &validator : nullptr;
+    ReplayPacer pacer(pacing);
+    pacer.start(trace);
+    bool replayed = true;
+    if (queue_threads) {
+        QueueThreadReplay replay(trace);
+        replay.use_program_cache(program_cache.get());
+        replay.use_validator(validator_ptr);
+        replay.use_device_map(devices.get());
+        replay.use_pacer(&pacer);
+        replay.use_elided_calls(&elided);
+        if (!replay.run()) {
+            return false;
+        }
+    } else {
+        TraceReplayVisitor replay;
+        replay.use_program_cache(program_cache.get());
+        replay.use_validator(validator_ptr);
+        replay.use_device_map(devices.get());
+        replay.use_pacer(&pacer);
+        replay.use_elided_calls(&elided);
+        if (!overrides_file.empty()) {
+            replay.use_program_overrides(&overrides);
+        }
+        if (keyframes.empty()) {
+            replay.visit(trace);
+        } else if (start_at == std::numeric_limits<size_t>::max()) {
+            replayed = KeyframeReplay(trace, replay)
+                           .record(keyframes, keyframe_interval);
+        } else {
+            replayed =
+                KeyframeReplay(trace, replay).start_at(keyframes, start_at);
+        }
+    }
+    pacer.stop();
+    if (!replayed) {
+        return false;
+    }
+    if (!pacing_spec.empty() || (mode != ReplayMode::full)) {
+        pacer.print_summary();
+    }
+    if (!validate) {
+        return true;
+    }
+    validator.print_summary();
+    return validator.passed();
+}
+
+bool handle_replay_instances(const std::string& tracefile, bool drop_queries,
+                             unsigned instances,
+                             const std::string& program_cache_dir,
+                             const ReplayDeviceOptions& device_options,
+                             ReplayMode mode) {
+    void* handle = dlopen("libOpenCL.so", RTLD_LAZY);
+    init_api(handle);
+    Trace trace;
+    if (!load_trace(tracefile, drop_queries, trace)) {
+        return false;
+    }
+    std::unique_ptr<ReplayDeviceMap> devices;
+    if (!make_device_map(device_options, trace, devices)) {
+        return false;
+    }
+    auto program_cache = make_program_cache(program_cache_dir);
+    replay_elided_calls elided;
+    replay_plan_mode(trace, mode, elided);
+    ConcurrentReplay replay(trace, instances);
+    replay.use_program_cache(program_cache.get());
+    replay.use_device_map(devices.get());
+    replay.use_elided_calls(&elided);
+    if (!replay.run()) {
+        return false;
+    }
+    replay.print_summary();
+    return true;
+}
+
+bool handle_bench(const std::string& tracefile, bool drop_queries,
+                  size_t from, size_t to, unsigned warmup, unsigned iterations,
+                  bool pin_uploads, const std::string& json,
+                  const std::string& program_cache_dir,
+                  const ReplayDeviceOptions& device_options,
+                  const std::string& overrides_file, ReplayMode mode) {
+    void* handle = dlopen("libOpenCL.so", RTLD_LAZY);
+    init_api(handle);
+    Trace trace;
+    if (!load_trace(tracefile, drop_queries, trace)) {
+        return false;
+    }
+    std::unique_ptr<ReplayDeviceMap> devices;
+    if (!make_device_map(device_options, trace, devices)) {
+        return false;
+    }
+    ProgramOverrides overrides;
+    if (!overrides_file.empty()) {
+        if (!overrides.load(overrides_file)) {
+            return false;
+        }
+        overrides.plan(trace);
+    }
+    auto program_cache = make_program_cache(program_cache_dir);
+    replay_elided_calls elided;
+    replay_plan_mode(trace, mode, elided);
+    auto make_bench = [&]() {
+        auto bench = std::make_unique<ReplayBenchmark>(
+            trace, from, to, warmup, iterations, pin_uploads);
+        bench->use_program_cache(program_cache.get());
+        bench->use_device_map(devices.get());
+        bench->use_elided_calls(&elided);
+        return bench;
+    };
+
+    // The original programs are benchmarked first to compare with
+    std::unique_ptr<ReplayBenchmark> base;
+    if (!overrides_file.empty()) {
+        base = make_bench();
+        if (!base->run()) {
+            return false;
+        }
+    }
+    auto bench = make_bench();
+    if (!overrides_file.empty()) {
+        bench->use_program_overrides(&overrides);
+    }
+    if (!bench->run()) {
+        return false;
+    }
+    bench->print_table();
+    if (base != nullptr) {
+        print_benchmark_comparison(*base, *bench);
+    }
+    if (!json.empty()) {
+        std::ofstream os(json);
+        bench->write_json(os);
+        os.close();
+        if (!os.good()) {
+            error("Can't write '%s'\n", json.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+bool handle_tune(const std::string& tracefile, bool drop_queries,
+                 unsigned repetitions) {
     void* handle = dlopen("libOpenCL.so", RTLD_LAZY);
     init_api(handle);
     Trace trace;
-    trace.load(tracefile);
-    TraceReplayVisitor replay;
-    replay.visit(trace);
+    if (!load_trace(tracefile, drop_queries, trace)) {
+        return false;
+    }
+    LocalSizeTuner tuner(trace, repetitions);
+    if (!tuner.run()) {
+        return false;
+    }
+    tuner.print_table();
     return true;
 }
 
-bool handle_srcgen(const std::string& tracefile) {
-    TraceSourceGenerationVisitor srcgen;
+bool handle_srcgen(const std::string& tracefile, bool drop_queries,
+                   const std::string& payload, const std::string& output,
+                   const std::string& output_dir, size_t split,
+                   const std::vector<std::string>& bench,
+                   unsigned bench_iterations) {
+    // The source is written as it is generated, through a large buffer
+    std::vector<char> buffer(1 << 20);
+    std::ofstream file;
+    std::unique_ptr<TraceSourceGenerationVisitor> srcgen;
+    if (!output_dir.empty()) {
+        if ((mkdir(output_dir.c_str(), 0777) != 0) && (errno != EEXIST)) {
+            error("Can't create '%s'\n", output_dir.c_str());
+            return false;
+        }
+        srcgen =
+            std::make_unique<TraceSourceGenerationVisitor>(output_dir, split);
+    } else if (output.empty()) {
+        setvbuf(stdout, nullptr, _IOFBF, buffer.size());
+    } else {
+        file.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+        file.open(output);
+        if (!file.good()) {
+            error("Can't open '%s'\n", output.c_str());
+            return false;
+        }
+    }
+    std::ostream& os = output.empty() ? std::cout : file;
+    if (!srcgen) {
+        srcgen = std::make_unique<TraceSourceGenerationVisitor>(os);
+    }
+    std::vector<SourceBenchRange> bench_ranges;
+    for (auto& spec : bench) {
+        SourceBenchRange range;
+        if (!SourceBenchRange::parse(spec, range)) {
+            error("Invalid benchmark range '%s'\n", spec.c_str());
+            return false;
+        }
+        bench_ranges.push_back(range);
+    }
+    if (!bench_ranges.empty() &&
+        !srcgen->use_bench(bench_ranges, bench_iterations)) {
+        return false;
+    }
+
+    std::ofstream payload_os;
+    if (!payload.empty()) {
+        payload_os.open(payload, std::ios::binary);
+        if (!payload_os.good()) {
+            error("Can't open '%s'\n", payload.c_str());
+            return false;
+        }
+        srcgen->use_payload(payload_os, payload);
+    }
     Trace trace;
-    trace.load(tracefile);
-    srcgen.visit(trace);
-    info("%s", srcgen.source().c_str());
+    if (drop_queries) {
+        if (!load_trace(tracefile, drop_queries, trace)) {
+            return false;
+        }
+        srcgen->visit(trace);
+    } else if (!srcgen->visit(trace, tracefile)) {
+        return false;
+    }
+    if (!srcgen->good()) {
+        return false;
+    }
+    os.flush();
+    if (!os.good()) {
+        error("Can't write the generated source\n");
+        return false;
+    }
+    if (!payload.empty()) {
+        payload_os.close();
+        if (!payload_os.good()) {
+            error("Can't write '%s'\n", payload.c_str());
+            return false;
+        }
+    }
     return true;
 }
 
+bool handle_export(const std::string& tracefile, const std::string& format,
+                   const std::string& output) {
+    std::vector<char> buffer(1 << 20);
+    std::ofstream os;
+    os.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+    os.open(output, std::ios::binary);
+    if (!os.good()) {
+        error("Can't open '%s'\n", output.c_str());
+        return false;
+    }
+
+    std::unique_ptr<TimelineWriter> writer;
+    if (format == "chrome-json") {
+        writer = std::make_unique<ChromeJsonTimelineWriter>(os);
+    } else {
+        writer = std::make_unique<PerfettoTimelineWriter>(os);
+    }
+
+    Trace trace;
+    TraceExportVisitor exporter(*writer);
+    if (!exporter.visit(trace, tracefile)) {
+        return false;
+    }
+    os.close();
+    return os.good();
+}
+
+bool handle_trim(const std::string& tracefile, size_t from, size_t to,
+                 const std::string& output) {
+    Trace trace;
+    if (!trace.load(tracefile)) {
+        return false;
+    }
+    auto num_calls = trace.calls().size();
+    if (from >= std::min(to, num_calls)) {
+        error("Empty call range [%zu, %zu) in a trace of %zu calls\n", from,
+              to, num_calls);
+        return false;
+    }
+
+    TraceTrimmer trimmer(trace);
+    auto keep = trimmer.slice(from, to);
+
+    Trace trimmed;
+    trace.extract(keep, trimmed);
+    info("Kept %zu of %zu calls", trimmed.calls().size(), num_calls);
+    trimmed.save(output);
+    return true;
+}
+
+bool handle_verify(const std::string& tracefile, unsigned num_threads) {
+    TraceVerifier verifier(num_threads);
+    return verifier.verify(tracefile);
+}
+
 bool handle_info(const std::string& tracefile) {
     Trace trace;
-    trace.load(tracefile);
+    if (!trace.load(tracefile)) {
+        return false;
+    }
     trace.print_info(std::cout);
     return true;
 }
 
 bool handle_print(const std::string& tracefile) {
     Trace trace;
-    trace.load(tracefile);
+    if (!trace.load(tracefile)) {
+        return false;
+    }
     trace.print(std::cout);
     return true;
 }
 
 bool handle_stats(const std::string& tracefile) {
     Trace trace;
-    trace.load(tracefile);
+    if (!trace.load(tracefile)) {
+        return false;
+    }
     trace.print_stats(std::cout);
     return true;
 }
@@ -92,10 +470,201 @@ int main(int argc, char* argv[]) {
     cmd_capture->allow_extras();
     cmd_capture->add_option("application", application)->required();
 
+    bool drop_queries = false;
+    const char* drop_queries_desc = "Drop queries whose results are unused";
+
     CLI::App* cmd_replay = app.add_subcommand("replay", "Replay a trace");
+    cmd_replay->add_flag("--drop-queries", drop_queries, drop_queries_desc);
+    unsigned bench_warmup = 0;
+    auto opt_warmup = cmd_replay->add_option(
+        "--warmup", bench_warmup, "Benchmark: iterations before measuring");
+    unsigned bench_iterations = 1;
+    auto opt_iterations = cmd_replay->add_option(
+        "--iterations", bench_iterations, "Benchmark: iterations to measure");
+    size_t bench_from = 0;
+    cmd_replay->add_option("--from", bench_from,
+                           "Benchmark: first call to measure");
+    size_t bench_to = std::numeric_limits<size_t>::max();
+    cmd_replay->add_option("--to", bench_to,
+                           "Benchmark: call after the last one to measure");
+    bool bench_pin_uploads = false;
+    cmd_replay->add_flag("--pin-uploads", bench_pin_uploads,
+                         "Benchmark: upload host data from pinned memory");
+    std::string bench_json;
+    cmd_replay->add_option("--json", bench_json,
+                           "Benchmark: write the results as JSON");
+    std::string program_cache_dir;
+    cmd_replay->add_option(
+        "--program-cache", program_cache_dir,
+        "Directory where program binaries are cached, $OCLTOOLS_PROGRAM_CACHE "
+        "by default");
+    bool queue_threads = false;
+    auto opt_queue_threads =
+        cmd_replay
+            ->add_flag("--queue-threads", queue_threads,
+                       "Submit to each command queue from its own thread")
+            ->excludes(opt_warmup)
+            ->excludes(opt_iterations);
+    bool validate = false;
+    auto opt_validate =
+        cmd_replay
+            ->add_flag("--validate", validate,
+                       "Compare the data read back with the captured data")
+            ->excludes(opt_warmup)
+            ->excludes(opt_iterations);
+    std::string tolerance = "exact";
+    cmd_replay->add_option(
+        "--tolerance", tolerance,
+        "Validation: exact, ulp:<n> or rel:<x>, comparing 32-bit floats");
+    ReplayDeviceOptions device_options;
+    cmd_replay->add_option("--platform", device_options.platform,
+                           "Index of the platform to replay on");
+    auto opt_device = cmd_replay->add_option(
+        "--device", device_options.device,
+        "Index of the device to replay on, in its platform");
+    cmd_replay->add_option("--device-map", device_options.map_file,
+                           "File mapping captured platforms and devices to "
+                           "platform and device indices");
+    std::string distribute;
+    cmd_replay
+        ->add_option("--distribute", distribute,
+                     "Spread contexts or queues round-robin over the devices "
+                     "of the platform")
+        ->check(CLI::IsMember({"contexts", "queues"}))
+        ->excludes(opt_device);
+    std::string pacing;
+    auto opt_pacing =
+        cmd_replay
+            ->add_option("--pacing", pacing,
+                         "captured, asap or scaled:<x> to multiply the "
+                         "captured time between calls, and report the wall "
+                         "time")
+            ->excludes(opt_warmup)
+            ->excludes(opt_iterations);
+    std::string keyframes;
+    auto opt_keyframes =
+        cmd_replay
+            ->add_option("--keyframes", keyframes,
+                         "File to write keyframes to, or to start from with "
+                         "--start-at")
+            ->excludes(opt_warmup)
+            ->excludes(opt_iterations)
+            ->excludes(opt_queue_threads);
+    size_t keyframe_interval = 100000;
+    cmd_replay->add_option(
+        "--keyframe-interval", keyframe_interval,
+        "Calls between keyframes, 0 to take them on SIGUSR1 only");
+    size_t start_at = std::numeric_limits<size_t>::max();
+    cmd_replay
+        ->add_option("--start-at", start_at,
+                     "Start from the last keyframe at or before this call")
+        ->needs(opt_keyframes)
+        ->excludes(opt_pacing);
+    std::string overrides_file;
+    auto opt_override =
+        cmd_replay
+            ->add_option("--override", overrides_file,
+                         "File of program replacements and extra build "
+                         "options, benchmarks the calls with and without them "
+                         "or validates the replay with them")
+            ->excludes(opt_queue_threads)
+            ->excludes(opt_pacing)
+            ->excludes(opt_keyframes);
+    std::string mode = "full";
+    cmd_replay
+        ->add_option("--mode", mode,
+                     "full, compute to skip readbacks and repeated uploads, "
+                     "or transfers to skip kernel executions")
+        ->check(CLI::IsMember({"full", "compute", "transfers"}))
+        ->excludes(opt_validate)
+        ->excludes(opt_keyframes);
+    unsigned instances = 1;
+    auto opt_instances =
+        cmd_replay
+            ->add_option("--instances", instances,
+                         "Replay the trace this many times concurrently, each "
+                         "with its own objects, and report the throughput "
+                         "and slowdown")
+            ->excludes(opt_warmup)
+            ->excludes(opt_iterations)
+            ->excludes(opt_override)
+            ->excludes(opt_queue_threads)
+            ->excludes(opt_validate)
+            ->excludes(opt_pacing)
+            ->excludes(opt_keyframes);
+
+    CLI::App* cmd_tune = app.add_subcommand(
+        "tune", "Sweep the local work size of kernel launches");
+    cmd_tune->add_flag("--drop-queries", drop_queries, drop_queries_desc);
+    unsigned tune_repetitions = 5;
+    cmd_tune->add_option("-r,--repetitions", tune_repetitions,
+                         "Launches timed for each local work size");
 
     CLI::App* cmd_srcgen =
         app.add_subcommand("generate-source", "Generate a C++ source file");
+    cmd_srcgen->add_flag("--drop-queries", drop_queries, drop_queries_desc);
+    std::string srcgen_payload;
+    cmd_srcgen->add_option("--payload", srcgen_payload,
+                           "Write the data of the calls to this file, which "
+                           "the generated program maps at run time");
+    std::string srcgen_output;
+    auto srcgen_output_opt =
+        cmd_srcgen->add_option("-o,--output", srcgen_output,
+                               "Output file, standard output by default");
+    size_t srcgen_split = 0;
+    auto srcgen_split_opt =
+        cmd_srcgen
+            ->add_option("--split", srcgen_split,
+                         "Generate a CMake project with this many calls in "
+                         "each source file")
+            ->check(CLI::PositiveNumber);
+    std::string srcgen_output_dir;
+    auto srcgen_output_dir_opt =
+        cmd_srcgen
+            ->add_option("--output-dir", srcgen_output_dir,
+                         "Directory of the project generated with --split")
+            ->needs(srcgen_split_opt)
+            ->excludes(srcgen_output_opt);
+    srcgen_split_opt->needs(srcgen_output_dir_opt);
+    std::vector<std::string> srcgen_bench;
+    auto srcgen_bench_opt =
+        cmd_srcgen
+            ->add_option("--bench", srcgen_bench,
+                         "Time the calls of a range, as <from>[:<to>] or "
+                         "frame:<from>[:<to>] with frames ending in "
+                         "clFinish, <to> excluded")
+            ->excludes(srcgen_split_opt);
+    unsigned srcgen_bench_iterations = 10;
+    cmd_srcgen
+        ->add_option("--bench-iterations", srcgen_bench_iterations,
+                     "Iterations of each benchmarked range")
+        ->needs(srcgen_bench_opt)
+        ->check(CLI::PositiveNumber);
+
+    CLI::App* cmd_export =
+        app.add_subcommand("export", "Export a trace to a timeline format");
+    std::string export_format = "perfetto";
+    cmd_export->add_option("--format", export_format, "Output format")
+        ->check(CLI::IsMember({"perfetto", "chrome-json"}));
+    std::string export_output;
+    cmd_export->add_option("-o,--output", export_output, "Output file")
+        ->required();
+
+    CLI::App* cmd_trim = app.add_subcommand(
+        "trim", "Extract a range of calls and their dependencies");
+    size_t trim_from = 0;
+    cmd_trim->add_option("--from", trim_from, "First call to keep");
+    size_t trim_to = std::numeric_limits<size_t>::max();
+    cmd_trim->add_option("--to", trim_to, "Call after the last one to keep");
+    std::string trim_output;
+    cmd_trim->add_option("-o,--output", trim_output, "Output file")
+        ->required();
+
+    CLI::App* cmd_verify =
+        app.add_subcommand("verify", "Check the integrity of a trace");
+    unsigned verify_threads = 0;
+    cmd_verify->add_option("-j,--jobs", verify_threads,
+                           "Number of threads, all cores by default");
 
     CLI::App* cmd_info = app.add_subcommand("info", "Infos on a trace");
 
@@ -112,9 +681,48 @@ int main(int argc, char* argv[]) {
         std::vector<std::string> application_args = cmd_capture->remaining();
         success = handle_capture(tracefile, application, application_args);
     } else if (app.got_subcommand(cmd_replay)) {
-        success = handle_replay(tracefile);
+        if (distribute == "contexts") {
+            device_options.distribution = ReplayDistribution::contexts;
+        } else if (distribute == "queues") {
+            device_options.distribution = ReplayDistribution::queues;
+        }
+        auto replay_mode = ReplayMode::full;
+        if (mode == "compute") {
+            replay_mode = ReplayMode::compute;
+        } else if (mode == "transfers") {
+            replay_mode = ReplayMode::transfers;
+        }
+        if (opt_warmup->count() || opt_iterations->count() ||
+            (opt_override->count() && !validate)) {
+            success = handle_bench(tracefile, drop_queries, bench_from,
+                                   bench_to, bench_warmup, bench_iterations,
+                                   bench_pin_uploads, bench_json,
+                                   program_cache_dir, device_options,
+                                   overrides_file, replay_mode);
+        } else if (opt_instances->count()) {
+            success = handle_replay_instances(tracefile, drop_queries,
+                                              instances, program_cache_dir,
+                                              device_options, replay_mode);
+        } else {
+            success = handle_replay(tracefile, drop_queries, queue_threads,
+                                    program_cache_dir, validate, tolerance,
+                                    device_options, pacing, keyframes,
+                                    keyframe_interval, start_at, replay_mode,
+                                    overrides_file);
+        }
+    } else if (app.got_subcommand(cmd_tune)) {
+        success = handle_tune(tracefile, drop_queries, tune_repetitions);
     } else if (app.got_subcommand(cmd_srcgen)) {
-        success = handle_srcgen(tracefile);
+        success = handle_srcgen(tracefile, drop_queries, srcgen_payload,
+                                srcgen_output, srcgen_output_dir,
+                                srcgen_split, srcgen_bench,
+                                srcgen_bench_iterations);
+    } else if (app.got_subcommand(cmd_export)) {
+        success = handle_export(tracefile, export_format, export_output);
+    } else if (app.got_subcommand(cmd_trim)) {
+        success = handle_trim(tracefile, trim_from, trim_to, trim_output);
+    } else if (app.got_subcommand(cmd_verify)) {
+        success = handle_verify(tracefile, verify_threads);
     } else if (app.got_subcommand(cmd_info)) {
         success = handle_info(tracefile);
     } else if (app.got_subcommand(cmd_print)) {
@@ -0,0 +1,110 @@
+// Copyright 2019-2023 The OpenCL-Tools authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include "trace.hpp"
+
+#include <set>
+#include <utility>
+#include <vector>
+
+// Object identity is (template type, capture ID). Map pointers use
+// CALL_PARAM_TEMPLATE_TYPE_NONE.
+using optimize_object_key = std::pair<CallParamTemplateType, uint64_t>;
+
+// Objects and map pointers referred to by the calls of a trace. Capture IDs
+// are never reused, all the uses of an object follow its creation.
+static std::set<optimize_object_key> trace_used_objects(const Trace& trace) {
+    std::set<optimize_object_key> used;
+    for (auto& call : trace.calls()) {
+        for (auto& param : call.params()) {
+            if (param->type() == CALL_PARAM_OBJECT_USE) {
+                for (auto id : call_param_object_use_ids(param.get())) {
+                    used.insert({param->ttype(), id});
+                }
+            } else if (param->type() == CALL_PARAM_MAP_POINTER_USE) {
+                auto p = static_cast<CallParamMapPointerUse*>(param.get());
+                used.insert({CALL_PARAM_TEMPLATE_TYPE_NONE, p->id()});
+            }
+        }
+        if ((call.id() == oclapi::command::CREATE_CONTEXT) ||
+            (call.id() == oclapi::command::CREATE_CONTEXT_FROM_TYPE)) {
+            used.insert({CALL_PARAM_TEMPLATE_TYPE_CL_PLATFORM_ID,
+                         call_param_properties_platform_id(
+                             call.params()[0].get())});
+        }
+    }
+    return used;
+}
+
+// Returns true when a call hands out objects or map pointers that later
+// calls refer to by ID
+static bool
+call_creates_used_objects(const Call& call,
+                          const std::set<optimize_object_key>& used) {
+    auto creates = [&used](const std::unique_ptr<CallParam>& param) {
+        auto ptype = param->type();
+        if (ptype == CALL_PARAM_OPTIONAL_OBJECT_CREATION) {
+            for (auto id : call_param_object_creation_ids(param.get())) {
+                if (used.count({param->ttype(), id}) != 0) {
+                    return true;
+                }
+            }
+        } else if (ptype == CALL_PARAM_MAP_POINTER_CREATION) {
+            auto p = static_cast<CallParamMapPointerCreation*>(param.get());
+            return used.count({CALL_PARAM_TEMPLATE_TYPE_NONE, p->id()}) != 0;
+        }
+        return false;
+    };
+    for (auto& param : call.params()) {
+        if (creates(param)) {
+            return true;
+        }
+    }
+    return creates(call.retval());
+}
+
+// Event status queries synchronize the host with the device, as in polling
+// loops, and order the calls that follow them
+static bool call_is_event_status_query(const Call& call) {
+    if (call.id() != oclapi::command::GET_EVENT_INFO) {
+        return false;
+    }
+    auto name = static_cast<CallParamValue<cl_event_info>*>(
+        call.params()[1].get());
+    return name->value() == CL_EVENT_COMMAND_EXECUTION_STATUS;
+}
+
+// Dead query elimination. Every value a call consumes is replayed from the
+// trace rather than from the outputs of earlier calls, so the results of
+// side-effect-free queries are never used. Only the queries that create
+// objects referenced later, and event status queries, are kept.
+static std::vector<bool> eliminate_dead_queries(const Trace& trace,
+                                                size_t& num_dropped) {
+    auto& calls = trace.calls();
+    auto used = trace_used_objects(trace);
+    std::vector<bool> keep(calls.size(), true);
+    num_dropped = 0;
+    for (size_t i = 0; i < calls.size(); i++) {
+        auto& call = calls[i];
+        if (oclapi::command_is_query(call.id()) &&
+            !call_creates_used_objects(call, used) &&
+            !call_is_event_status_query(call)) {
+            keep[i] = false;
+            num_dropped++;
+        }
+    }
+    return keep;
+}
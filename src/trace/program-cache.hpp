@@ -0,0 +1,279 @@
+// Copyright 2019-2023 The OpenCL-Tools authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.hpp"
+#include "ocltools-loader-gen.hpp"
+
+// Environment variable naming the program binary cache directory, used by
+// replay and by the generated sources
+static const char* kProgramCacheEnv = "OCLTOOLS_PROGRAM_CACHE";
+
+// 64-bit FNV-1a
+static uint64_t program_cache_hash(uint64_t hash, const void* data,
+                                   size_t size) {
+    auto bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// On-disk cache of program binaries. The binary for each device is stored in
+// a file named after a hash of the program source or IL, the build options,
+// the device name and the driver version. Programs are built from cached
+// binaries when there is one for all the devices they are built for, and
+// from their source otherwise, after which their binaries are cached.
+class ProgramBinaryCache {
+public:
+    ProgramBinaryCache(const std::string& dir) : m_dir(dir) {
+        if ((mkdir(m_dir.c_str(), 0755) != 0) && (errno != EEXIST)) {
+            warn("Can't create program cache directory '%s'\n",
+                 m_dir.c_str());
+        }
+    }
+
+    ~ProgramBinaryCache() {
+        debug("Program cache: %u hits, %u misses\n", m_hits, m_misses);
+    }
+
+    // Build a program, possibly replacing it with one created from cached
+    // binaries. The original program is released when it is replaced.
+    // Concurrent builds are serialized so that the builds of the same
+    // program after the first hit the cache.
+    cl_int build(cl_program& program, cl_uint num_devices,
+                 const cl_device_id* device_list, const char* options) {
+        std::lock_guard<std::mutex> lock(m_lock);
+        std::vector<cl_device_id> devices;
+        std::string input;
+        if (!cacheable(program, num_devices, device_list, devices, input)) {
+            return PFN_clBuildProgram(program, num_devices, device_list,
+                                      options, nullptr, nullptr);
+        }
+
+        std::vector<std::string> files;
+        for (auto device : devices) {
+            files.push_back(file(input, options, device));
+        }
+
+        auto cached = load(program, devices, files, options);
+        if (cached != nullptr) {
+            PFN_clReleaseProgram(program);
+            program = cached;
+            m_hits++;
+            return CL_SUCCESS;
+        }
+
+        m_misses++;
+        auto err = PFN_clBuildProgram(program, num_devices, device_list,
+                                      options, nullptr, nullptr);
+        if (err == CL_SUCCESS) {
+            store(program, devices, files);
+        }
+        return err;
+    }
+
+private:
+    // Programs can only be replaced when nothing else holds a reference to
+    // them and are identified by their source or IL
+    static bool cacheable(cl_program program, cl_uint num_devices,
+                          const cl_device_id* device_list,
+                          std::vector<cl_device_id>& devices,
+                          std::string& input) {
+        cl_uint refs;
+        auto err = PFN_clGetProgramInfo(program, CL_PROGRAM_REFERENCE_COUNT,
+                                        sizeof(refs), &refs, nullptr);
+        if ((err != CL_SUCCESS) || (refs != 1)) {
+            return false;
+        }
+
+        if (device_list != nullptr) {
+            devices.assign(device_list, device_list + num_devices);
+        } else {
+            devices = program_devices(program);
+        }
+        if (devices.empty()) {
+            return false;
+        }
+
+        input = program_info(program, CL_PROGRAM_SOURCE);
+        if (input.size() <= 1) {
+            input = program_info(program, CL_PROGRAM_IL);
+        }
+        return !input.empty();
+    }
+
+    static std::string program_info(cl_program program, cl_program_info info) {
+        size_t size;
+        auto err = PFN_clGetProgramInfo(program, info, 0, nullptr, &size);
+        if ((err != CL_SUCCESS) || (size == 0)) {
+            return {};
+        }
+        std::string val(size, '\0');
+        err = PFN_clGetProgramInfo(program, info, size, val.data(), nullptr);
+        if (err != CL_SUCCESS) {
+            return {};
+        }
+        return val;
+    }
+
+    static std::vector<cl_device_id> program_devices(cl_program program) {
+        size_t size;
+        auto err = PFN_clGetProgramInfo(program, CL_PROGRAM_DEVICES, 0,
+                                        nullptr, &size);
+        if (err != CL_SUCCESS) {
+            return {};
+        }
+        std::vector<cl_device_id> devices(size / sizeof(cl_device_id));
+        err = PFN_clGetProgramInfo(program, CL_PROGRAM_DEVICES, size,
+                                   devices.data(), nullptr);
+        if (err != CL_SUCCESS) {
+            return {};
+        }
+        return devices;
+    }
+
+    static std::string device_info(cl_device_id device, cl_device_info info) {
+        size_t size;
+        auto err = PFN_clGetDeviceInfo(device, info, 0, nullptr, &size);
+        if (err != CL_SUCCESS) {
+            return {};
+        }
+        std::string val(size, '\0');
+        PFN_clGetDeviceInfo(device, info, size, val.data(), nullptr);
+        return val;
+    }
+
+    std::string file(const std::string& input, const char* options,
+                     cl_device_id device) const {
+        std::string opts = (options != nullptr) ? options : "";
+        std::string parts[] = {input, opts, device_info(device, CL_DEVICE_NAME),
+                               device_info(device, CL_DRIVER_VERSION)};
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (auto& part : parts) {
+            // Include the terminator to separate parts
+            hash = program_cache_hash(hash, part.c_str(), part.size() + 1);
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "%016" PRIx64 ".bin", hash);
+        return m_dir + "/" + name;
+    }
+
+    static cl_program load(cl_program program,
+                           const std::vector<cl_device_id>& devices,
+                           const std::vector<std::string>& files,
+                           const char* options) {
+        std::vector<std::vector<unsigned char>> binaries;
+        for (auto& file : files) {
+            std::ifstream is(file, std::ios::binary);
+            if (!is.good()) {
+                return nullptr;
+            }
+            binaries.emplace_back(std::istreambuf_iterator<char>(is),
+                                  std::istreambuf_iterator<char>());
+        }
+
+        cl_context context;
+        auto err = PFN_clGetProgramInfo(program, CL_PROGRAM_CONTEXT,
+                                        sizeof(context), &context, nullptr);
+        if (err != CL_SUCCESS) {
+            return nullptr;
+        }
+        std::vector<size_t> sizes;
+        std::vector<const unsigned char*> data;
+        for (auto& binary : binaries) {
+            sizes.push_back(binary.size());
+            data.push_back(binary.data());
+        }
+        auto cached = PFN_clCreateProgramWithBinary(
+            context, devices.size(), devices.data(), sizes.data(), data.data(),
+            nullptr, &err);
+        if (err == CL_SUCCESS) {
+            err = PFN_clBuildProgram(cached, devices.size(), devices.data(),
+                                     options, nullptr, nullptr);
+            if (err != CL_SUCCESS) {
+                PFN_clReleaseProgram(cached);
+            }
+        }
+        if (err != CL_SUCCESS) {
+            warn("Cached program binary rejected (%d), building from "
+                 "source\n",
+                 err);
+            return nullptr;
+        }
+        return cached;
+    }
+
+    static void store(cl_program program,
+                      const std::vector<cl_device_id>& devices,
+                      const std::vector<std::string>& files) {
+        // Binaries are returned in the order of CL_PROGRAM_DEVICES
+        auto program_devs = program_devices(program);
+        std::vector<size_t> sizes(program_devs.size());
+        auto err = PFN_clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES,
+                                        sizes.size() * sizeof(size_t),
+                                        sizes.data(), nullptr);
+        if (err != CL_SUCCESS) {
+            return;
+        }
+        std::vector<std::vector<unsigned char>> binaries;
+        std::vector<unsigned char*> data;
+        for (auto size : sizes) {
+            binaries.emplace_back(size);
+            data.push_back(binaries.back().data());
+        }
+        err = PFN_clGetProgramInfo(program, CL_PROGRAM_BINARIES,
+                                   data.size() * sizeof(unsigned char*),
+                                   data.data(), nullptr);
+        if (err != CL_SUCCESS) {
+            return;
+        }
+
+        for (size_t i = 0; i < devices.size(); i++) {
+            for (size_t j = 0; j < program_devs.size(); j++) {
+                if ((program_devs[j] != devices[i]) || binaries[j].empty()) {
+                    continue;
+                }
+                // Write then rename so that readers never see partial files
+                auto tmp = files[i] + "." + std::to_string(getpid());
+                std::ofstream os(tmp, std::ios::binary);
+                os.write(reinterpret_cast<const char*>(binaries[j].data()),
+                         binaries[j].size());
+                os.close();
+                if (!os.good() || (rename(tmp.c_str(), files[i].c_str()))) {
+                    warn("Can't write '%s'\n", files[i].c_str());
+                    unlink(tmp.c_str());
+                }
+            }
+        }
+    }
+
+    std::mutex m_lock;
+    std::string m_dir;
+    unsigned m_hits = 0;
+    unsigned m_misses = 0;
+};
@@ -0,0 +1,223 @@
+// Copyright 2019-2023 The OpenCL-Tools authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "log.hpp"
+#include "program-cache.hpp"
+#include "trace.hpp"
+
+// Hash identifying a program by its source or IL as captured, printed as 16
+// hex digits
+static uint64_t program_override_hash(const Call& call) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    auto& params = call.params();
+    if (call.id() == oclapi::command::CREATE_PROGRAM_WITH_SOURCE) {
+        auto sources = static_cast<CallParamProgramSource*>(params[2].get());
+        for (size_t i = 0; i < sources->num_sources(); i++) {
+            auto& src = sources->source(i);
+            hash = program_cache_hash(hash, src.data(), src.size());
+        }
+    } else {
+        auto il = static_cast<CallParamArray<char>*>(params[1].get());
+        auto& bytes = il->values();
+        hash = program_cache_hash(hash, bytes.data(), bytes.size());
+    }
+    return hash;
+}
+
+// Replacement source or IL and extra build options for the programs of a
+// trace. Rules are read from a file, one per line:
+//
+//    <selector> source <file>     replace the program with OpenCL C
+//    <selector> il <file>         replace the program with SPIR-V
+//    <selector> options <options> append to the build options
+//
+// where the selector is kernel:<name> for the programs that kernels of that
+// name are created from, or program:<hash> for the programs whose source or
+// IL has that hash (see program_override_hash, printed by replay when
+// debugging). # starts a comment.
+class ProgramOverrides {
+public:
+    struct Override {
+        std::string source;
+        std::vector<char> il;
+        std::string options;
+    };
+
+    bool load(const std::string& path) {
+        std::ifstream is(path);
+        if (!is.good()) {
+            error("Can't open program overrides '%s'\n", path.c_str());
+            return false;
+        }
+        std::string line;
+        size_t lineno = 0;
+        while (std::getline(is, line)) {
+            lineno++;
+            line = line.substr(0, line.find('#'));
+            std::istringstream fields(line);
+            Rule rule;
+            std::string action;
+            if (!(fields >> rule.selector)) {
+                continue;
+            }
+            fields >> action;
+            std::getline(fields >> std::ws, rule.value);
+            rule.value.erase(rule.value.find_last_not_of(" \t\r") + 1);
+            bool valid = (rule.selector.rfind("kernel:", 0) == 0) ||
+                         (rule.selector.rfind("program:", 0) == 0);
+            if (action == "source") {
+                rule.kind = Rule::source;
+            } else if (action == "il") {
+                rule.kind = Rule::il;
+            } else if (action == "options") {
+                rule.kind = Rule::options;
+            } else {
+                valid = false;
+            }
+            if (!valid || rule.value.empty()) {
+                error("%s:%zu: invalid override\n", path.c_str(), lineno);
+                return false;
+            }
+            if (rule.kind != Rule::options) {
+                std::ifstream file(rule.value, std::ios::binary);
+                if (!file.good()) {
+                    error("%s:%zu: can't open '%s'\n", path.c_str(), lineno,
+                          rule.value.c_str());
+                    return false;
+                }
+                rule.value.assign(std::istreambuf_iterator<char>(file),
+                                  std::istreambuf_iterator<char>());
+            }
+            m_rules.push_back(std::move(rule));
+        }
+        return true;
+    }
+
+    // Match the rules against the programs of the trace
+    void plan(const Trace& trace) {
+        std::unordered_map<uint64_t, std::string> hashes;
+        std::unordered_multimap<std::string, uint64_t> kernels;
+        std::unordered_set<uint64_t> built;
+        for (auto& call : trace.calls()) {
+            switch (call.id()) {
+            case oclapi::command::CREATE_PROGRAM_WITH_SOURCE:
+            case oclapi::command::CREATE_PROGRAM_WITH_IL: {
+                auto id =
+                    call_param_object_creation_ids(call.retval().get()).at(0);
+                char hash[17];
+                snprintf(hash, sizeof(hash), "%016" PRIx64,
+                         program_override_hash(call));
+                hashes[id] = hash;
+                debug("Program #%llu: hash %s\n",
+                      static_cast<unsigned long long>(id), hash);
+                break;
+            }
+            case oclapi::command::BUILD_PROGRAM:
+                built.insert(
+                    call_param_object_use_ids(call.params()[0].get())[0]);
+                break;
+            case oclapi::command::CREATE_KERNEL: {
+                auto& params = call.params();
+                auto program = call_param_object_use_ids(params[0].get())[0];
+                auto name = static_cast<CallParamString*>(params[1].get());
+                if (name->present()) {
+                    kernels.emplace(name->str(), program);
+                }
+                break;
+            }
+            default:
+                break;
+            }
+        }
+
+        for (auto& rule : m_rules) {
+            std::vector<uint64_t> programs;
+            if (rule.selector.rfind("kernel:", 0) == 0) {
+                auto range = kernels.equal_range(rule.selector.substr(7));
+                for (auto it = range.first; it != range.second; ++it) {
+                    programs.push_back(it->second);
+                }
+            } else {
+                auto hash = rule.selector.substr(8);
+                for (auto& program : hashes) {
+                    if (program.second == hash) {
+                        programs.push_back(program.first);
+                    }
+                }
+            }
+            if (programs.empty()) {
+                warn("No program matches %s\n", rule.selector.c_str());
+            }
+            for (auto id : programs) {
+                if (hashes.count(id) == 0) {
+                    // Created from binaries
+                    warn("Program #%llu can't be overridden\n",
+                         static_cast<unsigned long long>(id));
+                    continue;
+                }
+                if ((rule.kind == Rule::options) && (built.count(id) == 0)) {
+                    // Options only apply to clBuildProgram, not to programs
+                    // compiled and linked separately
+                    warn("Program #%llu isn't built with clBuildProgram and "
+                         "can't take extra options\n",
+                         static_cast<unsigned long long>(id));
+                    continue;
+                }
+                auto& ov = m_programs[id];
+                switch (rule.kind) {
+                case Rule::source:
+                    ov.source = rule.value;
+                    ov.il.clear();
+                    break;
+                case Rule::il:
+                    ov.il.assign(rule.value.begin(), rule.value.end());
+                    ov.source.clear();
+                    break;
+                case Rule::options:
+                    ov.options += " " + rule.value;
+                    break;
+                }
+            }
+        }
+        info("Overriding %zu programs", m_programs.size());
+    }
+
+    // Override for a program, by capture ID, or nullptr
+    const Override* find(uint64_t id) const {
+        auto it = m_programs.find(id);
+        return (it != m_programs.end()) ? &it->second : nullptr;
+    }
+
+private:
+    struct Rule {
+        std::string selector;
+        enum { source, il, options } kind;
+        std::string value; // File contents or build options
+    };
+
+    std::vector<Rule> m_rules;
+    std::unordered_map<uint64_t, Override> m_programs;
+};
@@ -0,0 +1,365 @@
+// Copyright 2019-2023 The OpenCL-Tools authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "log.hpp"
+#include "ocltools-loader-gen.hpp"
+#include "trace.hpp"
+
+enum class ReplayDistribution {
+    none,
+    // Each context gets the next device, with all its objects
+    contexts,
+    // Contexts get all the devices, each queue gets the next one
+    queues,
+};
+
+// Which devices of the replay machine a trace is replayed on. Platforms and
+// devices are designated by their index in the order clGetPlatformIDs and
+// clGetDeviceIDs (CL_DEVICE_TYPE_ALL) return them, -1 keeps the ones the
+// trace finds by itself.
+struct ReplayDeviceOptions {
+    int platform = -1;
+    int device = -1;
+    // Lines of "device <captured ID> <platform> <device>" or
+    // "platform <captured ID> <platform>", # starts a comment
+    std::string map_file;
+    ReplayDistribution distribution = ReplayDistribution::none;
+
+    bool active() const {
+        return (platform >= 0) || (device >= 0) || !map_file.empty() ||
+               (distribution != ReplayDistribution::none);
+    }
+};
+
+// Substitutes the platforms and devices the trace got from clGetPlatformIDs
+// and clGetDeviceIDs at capture time with devices of the replay machine.
+// Devices created at replay time, such as sub-devices, are left alone.
+class ReplayDeviceMap {
+public:
+    ReplayDeviceMap(const ReplayDeviceOptions& options) : m_options(options) {}
+
+    // Find the devices of the replay machine and assign them to the calls of
+    // the trace
+    bool init(const Trace& trace) {
+        if (!discover()) {
+            return false;
+        }
+        if (!m_options.map_file.empty() && !load_map(m_options.map_file)) {
+            return false;
+        }
+        if ((m_options.platform >= 0) || (m_options.device >= 0) ||
+            (m_options.distribution != ReplayDistribution::none)) {
+            if (!select()) {
+                return false;
+            }
+        }
+        plan(trace);
+        return true;
+    }
+
+    cl_platform_id platform(uint64_t id) const {
+        auto it = m_platform_map.find(id);
+        if (it != m_platform_map.end()) {
+            return it->second;
+        }
+        if (m_pool.empty() || (id == static_cast<uint64_t>(-1))) {
+            return object_replay_tracker<cl_platform_id>().get(id);
+        }
+        return m_platform;
+    }
+
+    cl_device_id device(const Call& call, uint64_t id) const {
+        auto it = m_device_map.find(id);
+        if (it != m_device_map.end()) {
+            return it->second;
+        }
+        if (m_pool.empty() || (m_roots.count(id) == 0)) {
+            return object_replay_tracker<cl_device_id>().get(id);
+        }
+        auto target = m_call_device.find(&call);
+        if (target == m_call_device.end()) {
+            return m_pool[0];
+        }
+        return m_pool[target->second];
+    }
+
+    // Devices for a device list, without duplicates unless each device has
+    // a binary of its own
+    std::vector<cl_device_id> devices(const Call& call,
+                                      const std::vector<uint64_t>& ids) const {
+        bool binaries =
+            call.id() == oclapi::command::CREATE_PROGRAM_WITH_BINARY;
+        std::vector<cl_device_id> ret;
+        for (auto id : ids) {
+            if ((m_options.distribution == ReplayDistribution::queues) &&
+                !binaries && (m_device_map.count(id) == 0) &&
+                (m_roots.count(id) != 0)) {
+                // Contexts and programs span all the devices queues may use
+                ret.insert(ret.end(), m_pool.begin(), m_pool.end());
+            } else {
+                ret.push_back(device(call, id));
+            }
+        }
+        if (!binaries) {
+            std::vector<cl_device_id> unique;
+            for (auto dev : ret) {
+                if (std::find(unique.begin(), unique.end(), dev) ==
+                    unique.end()) {
+                    unique.push_back(dev);
+                }
+            }
+            ret = std::move(unique);
+        }
+        return ret;
+    }
+
+    // Replacement for the CL_CONTEXT_PLATFORM property of a context creation:
+    // the platform of its first device or its captured platform remapped
+    cl_platform_id context_platform(const Call& call) const {
+        if (call.id() == oclapi::command::CREATE_CONTEXT) {
+            auto& ids = call_param_object_use_ids(call.params()[2].get());
+            if (!ids.empty()) {
+                cl_platform_id platform;
+                auto err = PFN_clGetDeviceInfo(
+                    devices(call, ids)[0], CL_DEVICE_PLATFORM,
+                    sizeof(platform), &platform, nullptr);
+                if (err == CL_SUCCESS) {
+                    return platform;
+                }
+            }
+        }
+        return platform(call_param_properties_platform_id(
+            call.params()[0].get()));
+    }
+
+private:
+    bool discover() {
+        cl_uint num_platforms;
+        auto err = PFN_clGetPlatformIDs(0, nullptr, &num_platforms);
+        if ((err != CL_SUCCESS) || (num_platforms == 0)) {
+            error("No OpenCL platform to replay on\n");
+            return false;
+        }
+        m_platforms.resize(num_platforms);
+        PFN_clGetPlatformIDs(num_platforms, m_platforms.data(), nullptr);
+        for (auto platform : m_platforms) {
+            cl_uint num_devices = 0;
+            std::vector<cl_device_id> devices;
+            err = PFN_clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 0, nullptr,
+                                     &num_devices);
+            if ((err == CL_SUCCESS) && (num_devices > 0)) {
+                devices.resize(num_devices);
+                PFN_clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, num_devices,
+                                   devices.data(), nullptr);
+            }
+            m_devices.push_back(std::move(devices));
+        }
+        return true;
+    }
+
+    bool lookup(int platform, int device, cl_device_id& ret) const {
+        if ((platform < 0) ||
+            (static_cast<size_t>(platform) >= m_platforms.size())) {
+            error("No platform %d, there are %zu\n", platform,
+                  m_platforms.size());
+            return false;
+        }
+        auto& devices = m_devices[platform];
+        if ((device < 0) || (static_cast<size_t>(device) >= devices.size())) {
+            error("No device %d on platform %d, there are %zu\n", device,
+                  platform, devices.size());
+            return false;
+        }
+        ret = devices[device];
+        return true;
+    }
+
+    bool load_map(const std::string& path) {
+        std::ifstream is(path);
+        if (!is.good()) {
+            error("Can't open device map '%s'\n", path.c_str());
+            return false;
+        }
+        std::string line;
+        size_t lineno = 0;
+        while (std::getline(is, line)) {
+            lineno++;
+            line = line.substr(0, line.find('#'));
+            std::istringstream fields(line);
+            std::string kind;
+            if (!(fields >> kind)) {
+                continue;
+            }
+            uint64_t id;
+            int platform, device = 0;
+            bool ok = static_cast<bool>(fields >> id >> platform);
+            if (kind == "device") {
+                ok = ok && (fields >> device);
+            } else if (kind != "platform") {
+                ok = false;
+            }
+            std::string extra;
+            if (!ok || (fields >> extra)) {
+                error("%s:%zu: invalid mapping\n", path.c_str(), lineno);
+                return false;
+            }
+            cl_device_id handle;
+            if (!lookup(platform, device, handle)) {
+                return false;
+            }
+            if (kind == "device") {
+                m_device_map[id] = handle;
+            } else {
+                m_platform_map[id] = m_platforms[platform];
+            }
+        }
+        return true;
+    }
+
+    // Devices the captured ones are replaced with
+    bool select() {
+        auto platform = std::max(m_options.platform, 0);
+        cl_device_id device;
+        if (!lookup(platform, std::max(m_options.device, 0), device)) {
+            return false;
+        }
+        if (m_options.distribution == ReplayDistribution::none) {
+            m_pool.push_back(device);
+        } else {
+            m_pool = m_devices[platform];
+        }
+        m_platform = m_platforms[platform];
+        return true;
+    }
+
+    // Find the context of each call and give each context or queue created
+    // a device from the pool
+    void plan(const Trace& trace) {
+        using object_key = std::pair<CallParamTemplateType, uint64_t>;
+        std::map<object_key, uint64_t> contexts;
+        std::unordered_map<uint64_t, size_t> context_devices;
+        size_t num_contexts = 0, num_queues = 0;
+        auto distribution = m_options.distribution;
+
+        for (auto& call : trace.calls()) {
+            if (call.id() == oclapi::command::GET_DEVICE_IDS) {
+                auto param = call.params()[3].get();
+                if (call_param_object_creation_create(param)) {
+                    for (auto id : call_param_object_creation_ids(param)) {
+                        m_roots.insert(id);
+                    }
+                }
+            }
+            if (m_pool.size() < 2) {
+                continue;
+            }
+
+            bool found = false;
+            uint64_t context = 0;
+            switch (call.id()) {
+            case oclapi::command::CREATE_CONTEXT:
+            case oclapi::command::CREATE_CONTEXT_FROM_TYPE:
+                context = call_param_object_creation_ids(call.retval().get())
+                              .at(0);
+                context_devices[context] = num_contexts++ % m_pool.size();
+                found = true;
+                break;
+            default:
+                for (auto& param : call.params()) {
+                    if ((param->type() != CALL_PARAM_OBJECT_USE) ||
+                        call_param_object_use_ids(param.get()).empty()) {
+                        continue;
+                    }
+                    auto ttype = param->ttype();
+                    auto id = call_param_object_use_ids(param.get())[0];
+                    if (ttype == CALL_PARAM_TEMPLATE_TYPE_CL_CONTEXT) {
+                        context = id;
+                        found = true;
+                    } else {
+                        auto it = contexts.find({ttype, id});
+                        if (it != contexts.end()) {
+                            context = it->second;
+                            found = true;
+                        }
+                    }
+                    break;
+                }
+                break;
+            }
+            if (!found) {
+                continue;
+            }
+
+            // Objects belong to the context of the call creating them
+            auto own = [&](CallParam* param) {
+                if ((param->type() != CALL_PARAM_OPTIONAL_OBJECT_CREATION) ||
+                    !call_param_object_creation_create(param)) {
+                    return;
+                }
+                for (auto id : call_param_object_creation_ids(param)) {
+                    contexts[{param->ttype(), id}] = context;
+                }
+            };
+            for (auto& param : call.params()) {
+                own(param.get());
+            }
+            own(call.retval().get());
+
+            bool queue_creation =
+                (call.id() == oclapi::command::CREATE_COMMAND_QUEUE) ||
+                (call.id() ==
+                 oclapi::command::CREATE_COMMAND_QUEUE_WITH_PROPERTIES);
+            if (distribution == ReplayDistribution::contexts) {
+                m_call_device[&call] = context_devices[context];
+            } else if ((distribution == ReplayDistribution::queues) &&
+                       queue_creation) {
+                m_call_device[&call] = num_queues % m_pool.size();
+            }
+            num_queues += queue_creation;
+        }
+
+        if (distribution == ReplayDistribution::contexts) {
+            info("Distributing %zu contexts over %zu devices", num_contexts,
+                 m_pool.size());
+        } else if (distribution == ReplayDistribution::queues) {
+            info("Distributing %zu command queues over %zu devices",
+                 num_queues, m_pool.size());
+        }
+    }
+
+    ReplayDeviceOptions m_options;
+    std::vector<cl_platform_id> m_platforms;
+    std::vector<std::vector<cl_device_id>> m_devices; // By platform
+    std::unordered_map<uint64_t, cl_platform_id> m_platform_map;
+    std::unordered_map<uint64_t, cl_device_id> m_device_map;
+    // Devices replacing the ones found by the trace and their platform
+    std::vector<cl_device_id> m_pool;
+    cl_platform_id m_platform = nullptr;
+    // Devices returned by clGetDeviceIDs at capture time
+    std::unordered_set<uint64_t> m_roots;
+    // Index in the pool of the device of each call, the first by default
+    std::unordered_map<const Call*, size_t> m_call_device;
+};
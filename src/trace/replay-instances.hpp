@@ -0,0 +1,230 @@
+// Copyright 2019-2023 The OpenCL-Tools authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <chrono>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "log.hpp"
+#include "trace.hpp"
+#include "visitor-replay.hpp"
+
+// Time from the enqueue of a command to its completion, in microseconds
+static bool replay_event_latency(cl_event event, double& time) {
+    cl_ulong queued, end;
+    auto err = PFN_clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED,
+                                           sizeof(queued), &queued, nullptr);
+    err |= PFN_clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,
+                                       sizeof(end), &end, nullptr);
+    if (err != CL_SUCCESS) {
+        return false;
+    }
+    time = (end - queued) / 1000.0;
+    return true;
+}
+
+// Replays a trace several times concurrently, as independent tenants of the
+// same devices would run it. Each instance replays from its own thread with
+// its own objects, contexts included. The trace is first replayed alone,
+// twice, and the instances are compared with the second replay. The calls
+// before the first command of the trace set the replay up (contexts, queues,
+// program builds, ...), they are replayed by all the instances before any
+// starts its timed part and reported separately. Each replay is timed from
+// its first command until all its command queues have finished, and the
+// latency of its kernel executions is measured from their enqueue to their
+// completion.
+class ConcurrentReplay {
+public:
+    ConcurrentReplay(const Trace& trace, unsigned instances)
+        : m_trace(trace), m_instances(instances) {}
+
+    void use_program_cache(ProgramBinaryCache* cache) {
+        m_program_cache = cache;
+    }
+
+    void use_device_map(const ReplayDeviceMap* devices) {
+        m_devices = devices;
+    }
+
+    void use_elided_calls(const replay_elided_calls* elided) {
+        m_elided = elided;
+    }
+
+    bool run() {
+        if (m_instances == 0) {
+            error("At least one instance is required\n");
+            return false;
+        }
+        auto& calls = m_trace.calls();
+        while ((m_setup_end < calls.size()) &&
+               (replay_command_kind(calls[m_setup_end].id()) ==
+                ReplayCommandKind::other)) {
+            m_setup_end++;
+        }
+
+        // The first replay builds the programs and pays for the first uses
+        // of the devices
+        ReplayObjects warmup_objects, solo_objects;
+        replay(warmup_objects);
+        m_solo = replay(solo_objects);
+
+        std::vector<std::unique_ptr<ReplayObjects>> objects;
+        std::vector<std::future<Result>> results;
+        std::vector<std::promise<void>> ready(m_instances);
+        std::promise<void> start;
+        auto go = start.get_future().share();
+        for (unsigned i = 0; i < m_instances; i++) {
+            objects.push_back(std::make_unique<ReplayObjects>());
+            auto objs = objects.back().get();
+            auto set_up = &ready[i];
+            results.push_back(
+                std::async(std::launch::async, [this, objs, set_up, go] {
+                    return replay(*objs, set_up, go);
+                }));
+        }
+        for (auto& instance : ready) {
+            instance.get_future().wait();
+        }
+        auto begin = std::chrono::steady_clock::now();
+        start.set_value();
+        for (auto& res : results) {
+            m_results.push_back(res.get());
+        }
+        std::chrono::duration<double, std::milli> makespan =
+            std::chrono::steady_clock::now() - begin;
+        m_makespan = makespan.count();
+        return true;
+    }
+
+    void print_summary() const {
+        info("%u concurrent instances, the trace replays alone in %.3f ms "
+             "after %.3f ms of setup (calls [0, %zu))",
+             m_instances, m_solo.wall, m_solo.setup, m_setup_end);
+        info("%-10s %12s %12s %10s %12s %12s", "instance", "setup (ms)",
+             "wall (ms)", "slowdown", "p50 (us)", "p99 (us)");
+        std::vector<double> latencies;
+        for (size_t i = 0; i < m_results.size(); i++) {
+            auto& res = m_results[i];
+            latencies.insert(latencies.end(), res.latencies.begin(),
+                             res.latencies.end());
+            double p50 = 0, p99 = 0;
+            if (!res.latencies.empty()) {
+                BenchmarkStats stats(res.latencies);
+                p50 = stats.median;
+                p99 = stats.p99;
+            }
+            info("%-10zu %12.3f %12.3f %9.2fx %12.2f %12.2f", i, res.setup,
+                 res.wall, slowdown(res.wall), p50, p99);
+        }
+        auto throughput = m_instances / (m_makespan / 1000.0);
+        info("Aggregate throughput: %.2f replays/s in %.3f ms, %.2fx a "
+             "single replay",
+             throughput, m_makespan, m_instances * m_solo.wall / m_makespan);
+
+        info("%-32s %12s %12s %12s %12s %12s", "kernel latency (us)", "min",
+             "median", "p95", "p99", "mean");
+        print_latencies("alone", m_solo.latencies);
+        print_latencies("concurrent", latencies);
+    }
+
+private:
+    struct Result {
+        double setup = 0.0; // Milliseconds
+        double wall = 0.0;  // Milliseconds
+        std::vector<double> latencies;
+    };
+
+    // Replay the trace, signalling set_up once the setup calls are replayed
+    // and waiting for go to time the rest
+    Result replay(ReplayObjects& objects, std::promise<void>* set_up = nullptr,
+                  std::shared_future<void> go = {}) const {
+        replay_objects_use(&objects);
+        TraceReplayVisitor replay(true);
+        replay.use_program_cache(m_program_cache);
+        replay.use_device_map(m_devices);
+        replay.use_elided_calls(m_elided);
+        replay.preVisit(m_trace);
+
+        auto& calls = m_trace.calls();
+        std::vector<cl_event> events;
+        auto record = [&events](cl_event event) {
+            if (event != nullptr) {
+                events.push_back(event);
+            }
+        };
+        auto setup_start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < m_setup_end; i++) {
+            record(replay.replay(calls[i]));
+        }
+        replay.finish();
+        std::chrono::duration<double, std::milli> setup =
+            std::chrono::steady_clock::now() - setup_start;
+        if (set_up != nullptr) {
+            set_up->set_value();
+            go.wait();
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = m_setup_end; i < calls.size(); i++) {
+            record(replay.replay(calls[i]));
+        }
+        replay.finish();
+        std::chrono::duration<double, std::milli> wall =
+            std::chrono::steady_clock::now() - start;
+
+        Result res;
+        res.setup = setup.count();
+        res.wall = wall.count();
+        for (auto event : events) {
+            double latency;
+            if (replay_event_latency(event, latency)) {
+                res.latencies.push_back(latency);
+            }
+            PFN_clReleaseEvent(event);
+        }
+        replay.postVisit();
+        replay_objects_use(nullptr);
+        return res;
+    }
+
+    double slowdown(double wall) const {
+        return (m_solo.wall > 0) ? wall / m_solo.wall : 0.0;
+    }
+
+    static void print_latencies(const char* name,
+                                const std::vector<double>& latencies) {
+        if (latencies.empty()) {
+            info("%-32s %12s", name, "-");
+            return;
+        }
+        BenchmarkStats stats(latencies);
+        info("%-32s %12.2f %12.2f %12.2f %12.2f %12.2f", name, stats.min,
+             stats.median, stats.p95, stats.p99, stats.mean);
+    }
+
+    const Trace& m_trace;
+    unsigned m_instances;
+    ProgramBinaryCache* m_program_cache = nullptr;
+    const ReplayDeviceMap* m_devices = nullptr;
+    const replay_elided_calls* m_elided = nullptr;
+    size_t m_setup_end = 0; // Calls before the first command
+    Result m_solo;
+    std::vector<Result> m_results;
+    double m_makespan = 0.0; // Milliseconds, for all the instances
+};
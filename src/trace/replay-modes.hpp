@@ -0,0 +1,97 @@
+// Copyright 2019-2023 The OpenCL-Tools authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <set>
+#include <tuple>
+
+#include "log.hpp"
+#include "trace.hpp"
+#include "visitor-replay.hpp"
+
+// What a replay spends time on
+enum class ReplayMode {
+    full,
+    // Skip uploads to memory objects that were already uploaded to, and
+    // readbacks, to time the kernels
+    compute,
+    // Skip kernel executions, to time the transfers
+    transfers,
+};
+
+// Find the enqueues a mode skips. Readbacks are never consumed by the calls
+// that follow them in a replay, they are all skipped when timing compute.
+// Uploads are skipped when the same region of the memory object (the whole
+// object but for clEnqueueWriteBuffer) was already uploaded to, by a write
+// or at creation.
+static void replay_plan_mode(const Trace& trace, ReplayMode mode,
+                             replay_elided_calls& elided) {
+    if (mode == ReplayMode::full) {
+        return;
+    }
+    std::set<std::tuple<uint64_t, size_t, size_t>> uploaded;
+    size_t num_uploads = 0, num_readbacks = 0, num_kernels = 0;
+    for (auto& call : trace.calls()) {
+        auto& params = call.params();
+        switch (replay_command_kind(call.id())) {
+        case ReplayCommandKind::upload: {
+            if (mode != ReplayMode::compute) {
+                break;
+            }
+            auto mem = call_param_object_use_ids(params[1].get())[0];
+            size_t offset = 0, size = 0;
+            if (call.id() == oclapi::command::ENQUEUE_WRITE_BUFFER) {
+                offset = call_param_value_as<size_t>(params[3].get());
+                size = call_param_value_as<size_t>(params[4].get());
+            }
+            if (!uploaded.insert({mem, offset, size}).second) {
+                elided.insert(&call);
+                num_uploads++;
+            }
+            break;
+        }
+        case ReplayCommandKind::readback:
+            if (mode == ReplayMode::compute) {
+                elided.insert(&call);
+                num_readbacks++;
+            }
+            break;
+        case ReplayCommandKind::kernel:
+            if (mode == ReplayMode::transfers) {
+                elided.insert(&call);
+                num_kernels++;
+            }
+            break;
+        case ReplayCommandKind::other:
+            if (call.id() == oclapi::command::CREATE_BUFFER) {
+                auto flags = call_param_value_as<cl_mem_flags>(params[1].get());
+                if (flags & CL_MEM_COPY_HOST_PTR) {
+                    auto mem =
+                        call_param_object_creation_ids(call.retval().get())
+                            .at(0);
+                    auto size = call_param_value_as<size_t>(params[2].get());
+                    uploaded.insert({mem, 0, size});
+                }
+            }
+            break;
+        }
+    }
+    if (mode == ReplayMode::compute) {
+        info("Compute only, skipping %zu uploads and %zu readbacks",
+             num_uploads, num_readbacks);
+    } else {
+        info("Transfers only, skipping %zu kernel executions", num_kernels);
+    }
+}
@@ -0,0 +1,121 @@
+// Copyright 2019-2023 The OpenCL-Tools authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include "log.hpp"
+#include "trace.hpp"
+
+// How replayed calls are spaced in time
+struct ReplayPacing {
+    // Time offsets of the calls from the first are the captured ones
+    // multiplied by scale, as fast as possible when 0
+    double scale = 0.0;
+
+    // Parse "captured", "asap" or "scaled:<x>"
+    static bool parse(const std::string& spec, ReplayPacing& pacing) {
+        pacing = {};
+        if (spec == "asap") {
+            return true;
+        }
+        if (spec == "captured") {
+            pacing.scale = 1.0;
+            return true;
+        }
+        static const std::string prefix = "scaled:";
+        if (spec.compare(0, prefix.size(), prefix) != 0) {
+            return false;
+        }
+        auto value = spec.c_str() + prefix.size();
+        char* end;
+        pacing.scale = strtod(value, &end);
+        return (end != value) && (*end == '\0') && (pacing.scale >= 0.0);
+    }
+};
+
+// Holds calls back until the host time they were made at, relative to the
+// first call of the trace, and measures the wall time of the replay
+class ReplayPacer {
+public:
+    ReplayPacer(const ReplayPacing& pacing) : m_pacing(pacing) {}
+
+    void start(const Trace& trace) {
+        auto& calls = trace.calls();
+        m_first = calls.empty() ? 0 : calls.front().start_time();
+        m_captured = 0;
+        for (auto& call : calls) {
+            m_first = std::min(m_first, call.start_time());
+            m_captured = std::max(m_captured, call.end_time());
+        }
+        m_captured -= m_first;
+        m_max_lag = 0;
+        m_start = std::chrono::steady_clock::now();
+    }
+
+    // Wait for the time the call is due, calls can be paced from several
+    // threads
+    void wait(const Call& call) {
+        if (m_pacing.scale == 0.0) {
+            return;
+        }
+        std::chrono::duration<double, std::nano> offset(
+            (call.start_time() - m_first) * m_pacing.scale);
+        auto due =
+            m_start +
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                offset);
+        auto now = std::chrono::steady_clock::now();
+        if (now < due) {
+            std::this_thread::sleep_until(due);
+            return;
+        }
+        auto lag = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       now - due)
+                       .count();
+        auto max_lag = m_max_lag.load();
+        while ((lag > max_lag) &&
+               !m_max_lag.compare_exchange_weak(max_lag, lag)) {
+        }
+    }
+
+    void stop() { m_end = std::chrono::steady_clock::now(); }
+
+    void print_summary() const {
+        std::chrono::duration<double, std::milli> achieved = m_end - m_start;
+        auto captured = m_captured / 1e6;
+        info("Replayed in %.3f ms, captured in %.3f ms (%.2fx)",
+             achieved.count(), captured,
+             captured > 0 ? achieved.count() / captured : 0.0);
+        if (m_pacing.scale != 0.0) {
+            info("Paced to %.3f ms, calls were up to %.3f ms late",
+                 captured * m_pacing.scale, m_max_lag.load() / 1e6);
+        }
+    }
+
+private:
+    ReplayPacing m_pacing;
+    uint64_t m_first = 0;    // Captured start of the first call
+    uint64_t m_captured = 0; // Captured wall time, in nanoseconds
+    std::chrono::steady_clock::time_point m_start;
+    std::chrono::steady_clock::time_point m_end;
+    // Longest time a call was replayed after it was due, in nanoseconds
+    std::atomic<int64_t> m_max_lag{0};
+};
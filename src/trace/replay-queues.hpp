@@ -0,0 +1,267 @@
+// Copyright 2019-2023 The OpenCL-Tools authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "log.hpp"
+#include "trace.hpp"
+#include "visitor-replay.hpp"
+
+// Replays the calls submitted to each command queue from a thread of its own,
+// in the order they were captured. All other calls are replayed from the
+// calling thread.
+//
+// A call waits for an earlier call replayed from another thread when
+//
+// - both use the same object, including the events in wait lists and the
+//   objects the earlier call created,
+// - the earlier call is a host-side sync point (clFinish, clWaitForEvents or
+//   a blocking transfer or map) made by the same application thread.
+//
+// Waiting only means that the earlier call has been replayed. Ordering on the
+// device is left to the events and blocking flags of the calls themselves.
+struct QueueThreadReplay {
+
+    QueueThreadReplay(const Trace& trace) : m_trace(trace) {}
+
+    void use_program_cache(ProgramBinaryCache* cache) {
+        m_replay.use_program_cache(cache);
+    }
+
+    void use_validator(ReplayValidator* validator) {
+        m_replay.use_validator(validator);
+    }
+
+    void use_device_map(const ReplayDeviceMap* devices) {
+        m_replay.use_device_map(devices);
+    }
+
+    void use_pacer(ReplayPacer* pacer) { m_replay.use_pacer(pacer); }
+
+    void use_elided_calls(const replay_elided_calls* elided) {
+        m_replay.use_elided_calls(elided);
+    }
+
+    bool run() {
+        plan();
+
+        m_replay.preVisit(m_trace);
+        m_done.assign(m_trace.calls().size(), false);
+        m_memory.resize(m_lanes.size());
+
+        std::vector<std::thread> threads;
+        for (size_t lane = 1; lane < m_lanes.size(); lane++) {
+            threads.emplace_back([this, lane]() { replay_lane(lane); });
+        }
+        replay_lane(0);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        // Non-blocking reads of all lanes complete there
+        m_replay.postVisit();
+        m_memory.clear();
+        info("Replayed %zu calls, %zu command queues on their own thread",
+             m_trace.calls().size(), m_lanes.size() - 1);
+        return true;
+    }
+
+private:
+    // Object identity is (template type, capture ID). Map pointers use
+    // CALL_PARAM_TEMPLATE_TYPE_NONE.
+    using object_key = std::pair<CallParamTemplateType, uint64_t>;
+
+    // Lane 0 is the calling thread, queues get the following lanes
+    size_t lane_for(const Call& call,
+                    std::unordered_map<uint64_t, size_t>& queue_lanes) {
+        switch (call.id()) {
+        case oclapi::command::RETAIN_COMMAND_QUEUE:
+        case oclapi::command::RELEASE_COMMAND_QUEUE:
+            return 0;
+        default:
+            break;
+        }
+        auto& params = call.params();
+        if (params.empty()) {
+            return 0;
+        }
+        auto param = params[0].get();
+        if ((param->type() != CALL_PARAM_OBJECT_USE) ||
+            (param->ttype() != CALL_PARAM_TEMPLATE_TYPE_CL_COMMANDQUEUE) ||
+            call_param_object_use_multiple(param)) {
+            return 0;
+        }
+        auto queue = call_param_object_use_ids(param)[0];
+        auto it = queue_lanes.find(queue);
+        if (it != queue_lanes.end()) {
+            return it->second;
+        }
+        auto lane = m_lanes.size();
+        m_lanes.emplace_back();
+        queue_lanes[queue] = lane;
+        return lane;
+    }
+
+    static bool is_sync_point(const Call& call) {
+        switch (call.id()) {
+        case oclapi::command::FINISH:
+        case oclapi::command::WAIT_FOR_EVENTS:
+            return true;
+        case oclapi::command::ENQUEUE_READ_BUFFER:
+        case oclapi::command::ENQUEUE_READ_IMAGE:
+        case oclapi::command::ENQUEUE_WRITE_BUFFER:
+        case oclapi::command::ENQUEUE_WRITE_IMAGE:
+        case oclapi::command::ENQUEUE_MAP_BUFFER:
+            return call_param_value_as<cl_bool>(call.params()[2].get());
+        default:
+            return false;
+        }
+    }
+
+    static std::vector<object_key> objects(const Call& call) {
+        std::vector<object_key> keys;
+        auto add = [&keys](CallParam* param) {
+            switch (param->type()) {
+            case CALL_PARAM_OBJECT_USE:
+                for (auto id : call_param_object_use_ids(param)) {
+                    keys.emplace_back(param->ttype(), id);
+                }
+                break;
+            case CALL_PARAM_OPTIONAL_OBJECT_CREATION:
+                if (call_param_object_creation_create(param)) {
+                    for (auto id : call_param_object_creation_ids(param)) {
+                        keys.emplace_back(param->ttype(), id);
+                    }
+                }
+                break;
+            case CALL_PARAM_MAP_POINTER_CREATION:
+                keys.emplace_back(
+                    CALL_PARAM_TEMPLATE_TYPE_NONE,
+                    static_cast<CallParamMapPointerCreation*>(param)->id());
+                break;
+            case CALL_PARAM_MAP_POINTER_USE:
+                keys.emplace_back(
+                    CALL_PARAM_TEMPLATE_TYPE_NONE,
+                    static_cast<CallParamMapPointerUse*>(param)->id());
+                break;
+            default:
+                break;
+            }
+        };
+        for (auto& param : call.params()) {
+            add(param.get());
+        }
+        add(call.retval().get());
+        return keys;
+    }
+
+    // Assign calls to lanes and find the calls from other lanes they must
+    // wait for
+    void plan() {
+        auto& calls = m_trace.calls();
+        std::unordered_map<uint64_t, size_t> queue_lanes;
+        std::map<object_key, size_t> last_use;
+        std::unordered_map<uint32_t, size_t> last_sync; // By app thread
+
+        m_lanes.assign(1, {});
+        m_lane.resize(calls.size());
+        m_deps.resize(calls.size());
+        for (size_t i = 0; i < calls.size(); i++) {
+            auto& call = calls[i];
+            auto lane = lane_for(call, queue_lanes);
+            m_lane[i] = lane;
+            m_lanes[lane].push_back(i);
+
+            // Only the latest call from each lane needs to be waited for
+            std::unordered_map<size_t, size_t> deps;
+            auto depend = [&](size_t dep) {
+                auto dep_lane = m_lane[dep];
+                if (dep_lane == lane) {
+                    return;
+                }
+                auto it = deps.find(dep_lane);
+                if ((it == deps.end()) || (it->second < dep)) {
+                    deps[dep_lane] = dep;
+                }
+            };
+            for (auto& key : objects(call)) {
+                auto it = last_use.find(key);
+                if (it != last_use.end()) {
+                    depend(it->second);
+                }
+                last_use[key] = i;
+            }
+            auto sync = last_sync.find(call.thread());
+            if (sync != last_sync.end()) {
+                depend(sync->second);
+            }
+            if (is_sync_point(call)) {
+                last_sync[call.thread()] = i;
+            }
+
+            for (auto& dep : deps) {
+                m_deps[i].push_back(dep.second);
+            }
+        }
+    }
+
+    void replay_lane(size_t lane) {
+        auto& memory = m_memory[lane];
+        for (auto i : m_lanes[lane]) {
+            {
+                std::unique_lock<std::mutex> lock(m_lock);
+                m_cond.wait(lock, [this, i]() {
+                    for (auto dep : m_deps[i]) {
+                        if (!m_done[dep]) {
+                            return false;
+                        }
+                    }
+                    return true;
+                });
+            }
+
+            auto& call = m_trace.calls()[i];
+            if (lane == 0) {
+                // Keeps track of the queues to finish at the end
+                m_replay.replay(call);
+            } else {
+                replay_call(call, memory, m_replay.options());
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                m_done[i] = true;
+            }
+            m_cond.notify_all();
+        }
+    }
+
+    const Trace& m_trace;
+    TraceReplayVisitor m_replay;
+    std::vector<std::vector<size_t>> m_lanes; // Calls of each lane
+    std::vector<size_t> m_lane;               // Lane of each call
+    std::vector<std::vector<size_t>> m_deps;  // Calls each call waits for
+    std::vector<ReplayMemory> m_memory;       // Outputs of each lane
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+    std::vector<char> m_done;
+};
@@ -0,0 +1,330 @@
+// Copyright 2019-2023 The OpenCL-Tools authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <string>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "log.hpp"
+
+// How much replayed data may differ from the captured data. Payloads are
+// compared as arrays of 32-bit elements, which the ULP and relative
+// tolerances interpret as floats. NaNs match any other NaN.
+struct ReplayTolerance {
+    enum class kind { exact, ulp, relative };
+    kind type = kind::exact;
+    uint32_t ulps = 0;
+    float relative = 0.0f;
+
+    // Parse "exact", "ulp:<n>" or "rel:<x>"
+    static bool parse(const std::string& spec, ReplayTolerance& tol) {
+        tol = {};
+        if (spec == "exact") {
+            return true;
+        }
+        auto sep = spec.find(':');
+        if (sep == std::string::npos) {
+            return false;
+        }
+        auto name = spec.substr(0, sep);
+        auto value = spec.c_str() + sep + 1;
+        char* end;
+        if (name == "ulp") {
+            auto ulps = strtoull(value, &end, 10);
+            // One less than the maximum keeps ulps + 1 representable
+            tol.type = kind::ulp;
+            tol.ulps = static_cast<uint32_t>(
+                std::min<unsigned long long>(ulps, UINT32_MAX - 1));
+        } else if (name == "rel") {
+            tol.type = kind::relative;
+            tol.relative = strtof(value, &end);
+            if (!(tol.relative >= 0.0f)) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+        return (end != value) && (*end == '\0');
+    }
+};
+
+//
+// Element comparison, scalar
+//
+
+static bool replay_element_nan(uint32_t bits) {
+    return (bits & 0x7fffffff) > 0x7f800000;
+}
+
+// Floats mapped to integers in the same order, +0.0 and -0.0 both map to 0
+static int32_t replay_element_ordered(uint32_t bits) {
+    auto sbits = static_cast<int32_t>(bits);
+    if (sbits >= 0) {
+        return sbits;
+    }
+    return static_cast<int32_t>(0x80000000u - bits);
+}
+
+static bool replay_element_mismatch(uint32_t a, uint32_t b,
+                                    const ReplayTolerance& tol) {
+    if (a == b) {
+        return false;
+    }
+    switch (tol.type) {
+    case ReplayTolerance::kind::exact:
+        return true;
+    case ReplayTolerance::kind::ulp: {
+        auto nan_a = replay_element_nan(a);
+        auto nan_b = replay_element_nan(b);
+        if (nan_a || nan_b) {
+            return nan_a != nan_b;
+        }
+        auto oa = static_cast<int64_t>(replay_element_ordered(a));
+        auto ob = static_cast<int64_t>(replay_element_ordered(b));
+        return static_cast<uint64_t>(std::llabs(oa - ob)) > tol.ulps;
+    }
+    case ReplayTolerance::kind::relative: {
+        if (replay_element_nan(a) && replay_element_nan(b)) {
+            return false;
+        }
+        float fa, fb;
+        memcpy(&fa, &a, sizeof(fa));
+        memcpy(&fb, &b, sizeof(fb));
+        if (!std::isfinite(fa) || !std::isfinite(fb)) {
+            return true;
+        }
+        auto scale = std::max(std::fabs(fa), std::fabs(fb));
+        return !(std::fabs(fa - fb) <= tol.relative * scale);
+    }
+    }
+    return true;
+}
+
+static size_t replay_count_mismatches_sw(const char* captured,
+                                         const char* replayed, size_t count,
+                                         const ReplayTolerance& tol) {
+    size_t mismatches = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t a, b;
+        memcpy(&a, captured + i * 4, 4);
+        memcpy(&b, replayed + i * 4, 4);
+        mismatches += replay_element_mismatch(a, b, tol);
+    }
+    return mismatches;
+}
+
+//
+// Element comparison, vectorised
+//
+
+#if defined(__x86_64__)
+
+// Eight elements at a time with AVX2
+__attribute__((target("avx2,popcnt"))) static size_t
+replay_count_mismatches_hw(const char* captured, const char* replayed,
+                           size_t count, const ReplayTolerance& tol) {
+    const __m256i abs_mask = _mm256_set1_epi32(0x7fffffff);
+    const __m256i inf = _mm256_set1_epi32(0x7f800000);
+    const __m256i sign = _mm256_set1_epi32(INT32_MIN);
+    const __m256i limit = _mm256_set1_epi32(static_cast<int>(tol.ulps + 1));
+    const __m256 rel = _mm256_set1_ps(tol.relative);
+    const __m256 abs_mask_ps = _mm256_castsi256_ps(abs_mask);
+    const __m256 inf_ps = _mm256_castsi256_ps(inf);
+
+    size_t mismatches = 0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        auto a = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(captured + i * 4));
+        auto b = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(replayed + i * 4));
+        auto equal = _mm256_cmpeq_epi32(a, b);
+        auto match = equal;
+        switch (tol.type) {
+        case ReplayTolerance::kind::exact:
+            break;
+        case ReplayTolerance::kind::ulp: {
+            auto abs_a = _mm256_and_si256(a, abs_mask);
+            auto abs_b = _mm256_and_si256(b, abs_mask);
+            auto nan_a = _mm256_cmpgt_epi32(abs_a, inf);
+            auto nan_b = _mm256_cmpgt_epi32(abs_b, inf);
+            // Map negative floats to INT32_MIN - bits, selecting on the sign
+            auto fa = _mm256_castsi256_ps(a);
+            auto fb = _mm256_castsi256_ps(b);
+            auto oa = _mm256_castps_si256(_mm256_blendv_ps(
+                fa, _mm256_castsi256_ps(_mm256_sub_epi32(sign, a)), fa));
+            auto ob = _mm256_castps_si256(_mm256_blendv_ps(
+                fb, _mm256_castsi256_ps(_mm256_sub_epi32(sign, b)), fb));
+            // The distance fits in 32 unsigned bits
+            auto dist = _mm256_blendv_epi8(_mm256_sub_epi32(ob, oa),
+                                           _mm256_sub_epi32(oa, ob),
+                                           _mm256_cmpgt_epi32(oa, ob));
+            auto far =
+                _mm256_cmpeq_epi32(_mm256_max_epu32(dist, limit), dist);
+            auto nans = _mm256_or_si256(nan_a, nan_b);
+            auto both_nan = _mm256_and_si256(nan_a, nan_b);
+            auto close = _mm256_andnot_si256(_mm256_or_si256(far, nans),
+                                             _mm256_set1_epi32(-1));
+            match = _mm256_or_si256(_mm256_or_si256(equal, both_nan), close);
+            break;
+        }
+        case ReplayTolerance::kind::relative: {
+            auto fa = _mm256_castsi256_ps(a);
+            auto fb = _mm256_castsi256_ps(b);
+            auto abs_a = _mm256_and_ps(fa, abs_mask_ps);
+            auto abs_b = _mm256_and_ps(fb, abs_mask_ps);
+            auto finite =
+                _mm256_and_ps(_mm256_cmp_ps(abs_a, inf_ps, _CMP_LT_OQ),
+                              _mm256_cmp_ps(abs_b, inf_ps, _CMP_LT_OQ));
+            auto diff = _mm256_and_ps(_mm256_sub_ps(fa, fb), abs_mask_ps);
+            auto scale = _mm256_mul_ps(rel, _mm256_max_ps(abs_a, abs_b));
+            auto close =
+                _mm256_and_ps(finite, _mm256_cmp_ps(diff, scale, _CMP_LE_OQ));
+            auto both_nan = _mm256_and_ps(_mm256_cmp_ps(fa, fa, _CMP_UNORD_Q),
+                                          _mm256_cmp_ps(fb, fb, _CMP_UNORD_Q));
+            match = _mm256_or_si256(
+                equal, _mm256_castps_si256(_mm256_or_ps(close, both_nan)));
+            break;
+        }
+        }
+        auto bits = _mm256_movemask_ps(_mm256_castsi256_ps(match));
+        mismatches += 8 - _mm_popcnt_u32(bits);
+    }
+    return mismatches + replay_count_mismatches_sw(captured + i * 4,
+                                                   replayed + i * 4, count - i,
+                                                   tol);
+}
+
+static bool replay_compare_hw_supported() {
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+}
+
+#else
+
+static size_t replay_count_mismatches_hw(const char* captured,
+                                         const char* replayed, size_t count,
+                                         const ReplayTolerance& tol) {
+    return replay_count_mismatches_sw(captured, replayed, count, tol);
+}
+
+static bool replay_compare_hw_supported() { return false; }
+
+#endif
+
+static size_t replay_count_mismatches(const char* captured,
+                                      const char* replayed, size_t count,
+                                      const ReplayTolerance& tol) {
+    static const bool hw = replay_compare_hw_supported();
+    if (hw) {
+        return replay_count_mismatches_hw(captured, replayed, count, tol);
+    }
+    return replay_count_mismatches_sw(captured, replayed, count, tol);
+}
+
+// Compares the data read back by replayed calls with the data read at
+// capture time
+class ReplayValidator {
+public:
+    ReplayValidator(const ReplayTolerance& tol) : m_tol(tol) {}
+
+    // Compare a payload, reporting the first mismatching element
+    void check(const char* name, const char* captured, const char* replayed,
+               size_t size) {
+        // Identical blocks are skipped at memcmp speed, elements are only
+        // looked at in blocks that differ
+        static const size_t kBlockSize = 64 * 1024;
+        size_t mismatches = 0;
+        size_t first = size;
+        size_t elements = size / 4;
+        for (size_t off = 0; off < elements * 4; off += kBlockSize) {
+            auto len = std::min(kBlockSize, elements * 4 - off);
+            if (memcmp(captured + off, replayed + off, len) == 0) {
+                continue;
+            }
+            auto count = replay_count_mismatches(
+                captured + off, replayed + off, len / 4, m_tol);
+            if ((count > 0) && (first == size)) {
+                first = off + find_first(captured + off, replayed + off,
+                                         len / 4);
+            }
+            mismatches += count;
+        }
+        // Trailing bytes make up one last element, compared exactly
+        auto tail = elements * 4;
+        if ((tail < size) &&
+            (memcmp(captured + tail, replayed + tail, size - tail) != 0)) {
+            mismatches++;
+            if (first == size) {
+                first = tail;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_reads++;
+        m_bytes += size;
+        if (mismatches == 0) {
+            return;
+        }
+        m_failed_reads++;
+        m_mismatches += mismatches;
+        uint32_t a = 0, b = 0;
+        auto len = std::min<size_t>(4, size - first);
+        memcpy(&a, captured + first, len);
+        memcpy(&b, replayed + first, len);
+        warn("%s #%zu: %zu of %zu elements differ, first at byte %zu "
+             "(captured 0x%08x, replayed 0x%08x)\n",
+             name, m_reads, mismatches, (size + 3) / 4, first, a, b);
+    }
+
+    bool passed() const { return m_failed_reads == 0; }
+
+    void print_summary() const {
+        info("Validated %zu reads (%zu bytes): %zu mismatching, %zu elements "
+             "differ",
+             m_reads, m_bytes, m_failed_reads, m_mismatches);
+    }
+
+private:
+    size_t find_first(const char* captured, const char* replayed,
+                      size_t count) const {
+        for (size_t i = 0; i < count; i++) {
+            uint32_t a, b;
+            memcpy(&a, captured + i * 4, 4);
+            memcpy(&b, replayed + i * 4, 4);
+            if (replay_element_mismatch(a, b, m_tol)) {
+                return i * 4;
+            }
+        }
+        return count * 4;
+    }
+
+    ReplayTolerance m_tol;
+    std::mutex m_lock;
+    size_t m_reads = 0;
+    size_t m_bytes = 0;
+    size_t m_failed_reads = 0;
+    size_t m_mismatches = 0;
+};
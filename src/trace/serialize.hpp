@@ -14,7 +14,9 @@
 
 #pragma once
 
+#include <istream>
 #include <ostream>
+#include <string>
 
 template <typename T> void serialize(std::ostream& os, const T& val) {
     os.write(reinterpret_cast<char*>(const_cast<T*>(&val)), sizeof(val));
@@ -23,22 +25,20 @@ template <typename T> void serialize(std::ostream& os, const T& val) {
 template <> inline void serialize(std::ostream& os, const std::string& str) {
     uint32_t len = static_cast<uint32_t>(str.length());
     serialize(os, len);
-    for (auto c : str) {
-        serialize(os, c);
-    }
+    os.write(str.data(), len);
 }
 
+// Failed reads return a value-initialised T so that truncated input can't
+// produce garbage lengths
 template <typename T> T deserialize(std::istream& is) {
-    T val;
+    T val{};
     is.read(reinterpret_cast<char*>(&val), sizeof(val));
     return val;
 }
 
 template <> inline std::string deserialize(std::istream& is) {
     uint32_t len = deserialize<uint32_t>(is);
-    std::string ret;
-    for (uint32_t i = 0; i < len; i++) {
-        ret += deserialize<char>(is);
-    }
+    std::string ret(len, '\0');
+    is.read(ret.data(), len);
     return ret;
 }
@@ -16,14 +16,26 @@
 
 #include "call.hpp"
 
+#include <cstring>
 #include <fstream>
+#include <functional>
 #include <iostream>
 
+#include "chunks.hpp"
 #include "serialize.hpp"
 
-// TODO Trace header
+// Trace file layout:
 //    magic
 //    format version
+//    chunked body (see chunks.hpp)
+//        flags
+//        string table
+//        calls
+
+static const char kTraceMagic[8] = {'C', 'L', 'T', 'R', 'A', 'C', 'E', 0};
+static const uint32_t kTraceVersion = 2;
+
+// TODO Trace header
 //    pointer size // TODO check on deserialisation, has to match
 //    endianness?
 //    capture time (UTC)
@@ -56,18 +68,29 @@ struct Trace {
     }
 
     void serialize(std::ostream& os) {
-        ::serialize(os, m_flags);
-        ::serialize(os, static_cast<uint32_t>(m_calls.size()));
+        os.write(kTraceMagic, sizeof(kTraceMagic));
+        ::serialize(os, kTraceVersion);
+        ChunkWriter chunks(os);
+        std::ostream cos(&chunks);
+        ::serialize(cos, m_flags);
+        m_strings.serialize(cos);
+        ::serialize(cos, static_cast<uint32_t>(m_calls.size()));
         for (auto& call : m_calls) {
-            call.serialize(os);
+            call.serialize(cos);
         }
+        chunks.finish();
     }
 
-    void deserialize(std::istream& is) {
+    void deserialize_header(std::istream& is) {
         m_flags = ::deserialize<uint32_t>(is);
+        m_strings.deserialize(is);
+    }
+
+    void deserialize(std::istream& is) {
+        deserialize_header(is);
         uint32_t num_calls = ::deserialize<uint32_t>(is);
-        for (unsigned i = 0; i < num_calls; i++) {
-            Call call(is);
+        for (unsigned i = 0; i < num_calls && is.good(); i++) {
+            Call call(is, m_strings);
             m_calls.push_back(std::move(call));
         }
     }
@@ -82,12 +105,40 @@ struct Trace {
 
     bool load(const std::string& filename) {
         std::ifstream is(filename, std::ios::binary);
-        if (!is.good()) {
-            error("Can't open '%s'\n", filename.c_str());
+        if (!open(is, filename)) {
             return false;
         }
-        deserialize(is);
-        is.close();
+        ChunkReader chunks(is);
+        std::istream cis(&chunks);
+        deserialize(cis);
+        return check(cis, chunks, filename);
+    }
+
+    // Load the header then deserialise calls one at a time and hand them to
+    // on_call without keeping them, so that traces of any size can be
+    // processed in a single pass and bounded memory.
+    bool stream(const std::string& filename,
+                const std::function<void()>& on_header,
+                const std::function<void(const Call&)>& on_call) {
+        std::ifstream is(filename, std::ios::binary);
+        if (!open(is, filename)) {
+            return false;
+        }
+        ChunkReader chunks(is);
+        std::istream cis(&chunks);
+        deserialize_header(cis);
+        if (!check(cis, chunks, filename)) {
+            return false;
+        }
+        on_header();
+        uint32_t num_calls = ::deserialize<uint32_t>(cis);
+        for (unsigned i = 0; i < num_calls; i++) {
+            Call call(cis, m_strings);
+            if (!check(cis, chunks, filename)) {
+                return false;
+            }
+            on_call(call);
+        }
         return true;
     }
 
@@ -101,13 +152,68 @@ struct Trace {
         os << "Number of calls: " << m_calls.size() << std::endl;
         os << "Output memory requirements: " << output_memory_requirements()
            << " bytes" << std::endl;
+        os << "Interned strings: " << m_strings.size() << " ("
+           << m_strings.num_bytes() << " bytes)" << std::endl;
     }
 
     void print_stats(std::ostream& os) const;
 
+    // Move the calls selected by keep into an empty trace, along with the
+    // strings they refer to. This trace must not be used afterwards.
+    void extract(const std::vector<bool>& keep, Trace& into) {
+        into.m_flags = m_flags;
+        for (size_t i = 0; i < m_calls.size(); i++) {
+            if (keep[i]) {
+                m_calls[i].reintern_strings(into.m_strings);
+                into.m_calls.push_back(std::move(m_calls[i]));
+            }
+        }
+    }
+
     const std::vector<Call>& calls() const { return m_calls; }
 
+    // Calls hold references into the string table, a trace must not be
+    // copied or moved once it has calls.
+    StringTable& strings() { return m_strings; }
+    const StringTable& strings() const { return m_strings; }
+
 private:
+    // Check the magic and version that precede the chunked trace body
+    static bool open(std::istream& is, const std::string& filename) {
+        if (!is.good()) {
+            error("Can't open '%s'\n", filename.c_str());
+            return false;
+        }
+        char magic[sizeof(kTraceMagic)];
+        is.read(magic, sizeof(magic));
+        if (!is.good() || memcmp(magic, kTraceMagic, sizeof(magic))) {
+            error("'%s' is not a trace\n", filename.c_str());
+            return false;
+        }
+        auto version = ::deserialize<uint32_t>(is);
+        if (version != kTraceVersion) {
+            error("Unsupported trace version %u in '%s' (expected %u)\n",
+                  version, filename.c_str(), kTraceVersion);
+            return false;
+        }
+        return true;
+    }
+
+    static bool check(const std::istream& is, const ChunkReader& chunks,
+                      const std::string& filename) {
+        if (chunks.corrupted()) {
+            error("Corrupted chunk %zu in '%s'\n", chunks.num_chunks(),
+                  filename.c_str());
+            return false;
+        }
+        if (chunks.truncated() || !is.good()) {
+            error("Truncated trace '%s'\n", filename.c_str());
+            return false;
+        }
+        return true;
+    }
+
     uint32_t m_flags;
+    StringTable m_strings;
     std::vector<Call> m_calls;
 };
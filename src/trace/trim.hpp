@@ -0,0 +1,258 @@
+// Copyright 2019-2023 The OpenCL-Tools authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include "trace.hpp"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Computes the backward dependency slice of the calls in [from, to): the
+// calls themselves plus every earlier call they transitively depend on
+// through the objects they use. Earlier calls are kept when they create an
+// object that is needed or change the state of one:
+//
+// - kernel argument bindings, only the last one for each argument,
+// - program builds,
+// - host to device transfers into needed memory objects,
+// - user event status updates,
+// - reference counting, so that needed objects have the same reference count
+//   at the start of the range as during capture.
+//
+// Kernel executions before the range are kept when they produce an event that
+// is needed, or when a needed memory object is bound to one of the arguments
+// of their kernel at the time, as they may write to it. Memory objects then
+// hold the same contents at the start of the range as during capture, and
+// the arguments bound for each kept execution are kept. Object IDs are
+// preserved.
+struct TraceTrimmer {
+
+    TraceTrimmer(const Trace& trace) : m_trace(trace) {}
+
+    std::vector<bool> slice(size_t from, size_t to) {
+        auto& calls = m_trace.calls();
+        to = std::min(to, calls.size());
+        std::vector<bool> keep(calls.size(), false);
+        findLaunchMems(std::min(from, to));
+
+        for (size_t i = to; i-- > 0;) {
+            auto& call = calls[i];
+            if (i >= from) {
+                keep[i] = true;
+            } else if (createsNeededObject(call) ||
+                       changesNeededState(call, i)) {
+                keep[i] = true;
+            }
+            if (keep[i]) {
+                addUsedObjects(call);
+            }
+        }
+
+        return keep;
+    }
+
+private:
+    // Object identity is (template type, capture ID). Map pointers use
+    // CALL_PARAM_TEMPLATE_TYPE_NONE.
+    using object_key = std::pair<CallParamTemplateType, uint64_t>;
+
+    struct object_key_hash {
+        size_t operator()(const object_key& key) const {
+            return std::hash<uint64_t>()(key.second) ^
+                   (static_cast<size_t>(key.first) << 48);
+        }
+    };
+
+    bool needed(CallParamTemplateType ttype, uint64_t id) const {
+        return m_needed.count({ttype, id}) != 0;
+    }
+
+    bool usesNeededObject(const Call& call, CallParamTemplateType ttype) {
+        for (auto& param : call.params()) {
+            if ((param->type() != CALL_PARAM_OBJECT_USE) ||
+                (param->ttype() != ttype)) {
+                continue;
+            }
+            for (auto id : call_param_object_use_ids(param.get())) {
+                if (needed(ttype, id)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool createsNeededObject(const Call& call) const {
+        auto creates = [this](CallParam* param) {
+            if (param->type() == CALL_PARAM_OPTIONAL_OBJECT_CREATION) {
+                for (auto id : call_param_object_creation_ids(param)) {
+                    if (needed(param->ttype(), id)) {
+                        return true;
+                    }
+                }
+            } else if (param->type() == CALL_PARAM_MAP_POINTER_CREATION) {
+                auto p = static_cast<CallParamMapPointerCreation*>(param);
+                return needed(CALL_PARAM_TEMPLATE_TYPE_NONE, p->id());
+            }
+            return false;
+        };
+
+        for (auto& param : call.params()) {
+            if (creates(param.get())) {
+                return true;
+            }
+        }
+        return creates(call.retval().get());
+    }
+
+    static bool isKernelLaunch(const Call& call) {
+        return (call.id() == oclapi::command::ENQUEUE_NDRANGE_KERNEL) ||
+               (call.id() == oclapi::command::ENQUEUE_TASK);
+    }
+
+    // Find the memory objects bound to the arguments of the kernels launched
+    // before a call
+    void findLaunchMems(size_t end) {
+        auto& calls = m_trace.calls();
+        std::unordered_map<uint64_t, std::map<cl_uint, uint64_t>> bindings;
+        for (size_t i = 0; i < end; i++) {
+            auto& call = calls[i];
+            auto& params = call.params();
+            if (call.id() == oclapi::command::SET_KERNEL_ARG) {
+                auto kernel = call_param_object_use_ids(params[0].get())[0];
+                auto index =
+                    static_cast<CallParamValue<cl_uint>*>(params[1].get())
+                        ->value();
+                auto value = params[3].get();
+                if ((value->type() == CALL_PARAM_OBJECT_USE) &&
+                    (value->ttype() == CALL_PARAM_TEMPLATE_TYPE_CL_MEM)) {
+                    bindings[kernel][index] =
+                        call_param_object_use_ids(value)[0];
+                } else {
+                    bindings[kernel].erase(index);
+                }
+            } else if (isKernelLaunch(call)) {
+                auto kernel = call_param_object_use_ids(params[1].get())[0];
+                auto& mems = m_launch_mems[i];
+                for (auto& binding : bindings[kernel]) {
+                    mems.push_back(binding.second);
+                }
+            }
+        }
+    }
+
+    bool changesNeededState(const Call& call, size_t index) {
+        auto& params = call.params();
+        switch (call.id()) {
+        case oclapi::command::SET_KERNEL_ARG: {
+            auto kernel = call_param_object_use_ids(params[0].get())[0];
+            if (!needed(CALL_PARAM_TEMPLATE_TYPE_CL_KERNEL, kernel)) {
+                return false;
+            }
+            auto index =
+                static_cast<CallParamValue<cl_uint>*>(params[1].get())->value();
+            // Later bindings of the same argument override this one
+            return m_bound_args.insert({kernel, index}).second;
+        }
+        case oclapi::command::BUILD_PROGRAM:
+        case oclapi::command::COMPILE_PROGRAM:
+            return usesNeededObject(call, CALL_PARAM_TEMPLATE_TYPE_CL_PROGRAM);
+        case oclapi::command::ENQUEUE_WRITE_BUFFER:
+        case oclapi::command::ENQUEUE_WRITE_BUFFER_RECT:
+        case oclapi::command::ENQUEUE_WRITE_IMAGE:
+        case oclapi::command::ENQUEUE_FILL_BUFFER:
+        case oclapi::command::ENQUEUE_FILL_IMAGE:
+        case oclapi::command::ENQUEUE_COPY_BUFFER:
+        case oclapi::command::ENQUEUE_COPY_BUFFER_RECT:
+        case oclapi::command::ENQUEUE_COPY_IMAGE:
+        case oclapi::command::ENQUEUE_COPY_IMAGE_TO_BUFFER:
+        case oclapi::command::ENQUEUE_COPY_BUFFER_TO_IMAGE:
+            return usesNeededObject(call, CALL_PARAM_TEMPLATE_TYPE_CL_MEM);
+        case oclapi::command::ENQUEUE_NDRANGE_KERNEL:
+        case oclapi::command::ENQUEUE_TASK: {
+            auto it = m_launch_mems.find(index);
+            if (it == m_launch_mems.end()) {
+                return false;
+            }
+            for (auto mem : it->second) {
+                if (needed(CALL_PARAM_TEMPLATE_TYPE_CL_MEM, mem)) {
+                    // The arguments bound at the time of the launch are
+                    // needed, even when bound again later
+                    auto kernel = call_param_object_use_ids(params[1].get())[0];
+                    auto first = m_bound_args.lower_bound({kernel, 0});
+                    auto last = m_bound_args.lower_bound({kernel + 1, 0});
+                    m_bound_args.erase(first, last);
+                    return true;
+                }
+            }
+            return false;
+        }
+        case oclapi::command::SET_USER_EVENT_STATUS:
+            return usesNeededObject(call, CALL_PARAM_TEMPLATE_TYPE_CL_EVENT);
+        case oclapi::command::RETAIN_DEVICE:
+        case oclapi::command::RELEASE_DEVICE:
+        case oclapi::command::RETAIN_CONTEXT:
+        case oclapi::command::RELEASE_CONTEXT:
+        case oclapi::command::RETAIN_COMMAND_QUEUE:
+        case oclapi::command::RELEASE_COMMAND_QUEUE:
+        case oclapi::command::RETAIN_PROGRAM:
+        case oclapi::command::RELEASE_PROGRAM:
+        case oclapi::command::RETAIN_KERNEL:
+        case oclapi::command::RELEASE_KERNEL:
+        case oclapi::command::RETAIN_MEM_OBJECT:
+        case oclapi::command::RELEASE_MEM_OBJECT:
+        case oclapi::command::RETAIN_EVENT:
+        case oclapi::command::RELEASE_EVENT:
+        case oclapi::command::RETAIN_SAMPLER:
+        case oclapi::command::RELEASE_SAMPLER: {
+            auto& param = params[0];
+            auto id = call_param_object_use_ids(param.get())[0];
+            return needed(param->ttype(), id);
+        }
+        default:
+            return false;
+        }
+    }
+
+    void addUsedObjects(const Call& call) {
+        for (auto& param : call.params()) {
+            if (param->type() == CALL_PARAM_OBJECT_USE) {
+                for (auto id : call_param_object_use_ids(param.get())) {
+                    m_needed.insert({param->ttype(), id});
+                }
+            } else if (param->type() == CALL_PARAM_MAP_POINTER_USE) {
+                auto p = static_cast<CallParamMapPointerUse*>(param.get());
+                m_needed.insert({CALL_PARAM_TEMPLATE_TYPE_NONE, p->id()});
+            }
+        }
+        if ((call.id() == oclapi::command::CREATE_CONTEXT) ||
+            (call.id() == oclapi::command::CREATE_CONTEXT_FROM_TYPE)) {
+            m_needed.insert({CALL_PARAM_TEMPLATE_TYPE_CL_PLATFORM_ID,
+                             call_param_properties_platform_id(
+                                 call.params()[0].get())});
+        }
+    }
+
+    const Trace& m_trace;
+    std::unordered_set<object_key, object_key_hash> m_needed;
+    std::set<std::pair<uint64_t, cl_uint>> m_bound_args;
+    // Memory objects bound to the arguments of kernel launches, by call
+    std::unordered_map<size_t, std::vector<uint64_t>> m_launch_mems;
+};
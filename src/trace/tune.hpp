@@ -0,0 +1,263 @@
+// Copyright 2019-2023 The OpenCL-Tools authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bench.hpp"
+#include "log.hpp"
+#include "trace.hpp"
+#include "visitor-replay.hpp"
+
+// Sweeps the local work size of the kernel launches in a trace. The trace is
+// replayed with profiling enabled and, before the first launch of each
+// distinct (kernel, global size), the launch is repeated with every
+// candidate local size and timed on the device. Candidates divide the global
+// size in each dimension, are powers of two or multiples of the preferred
+// work-group size multiple, and fit the kernel and device limits.
+//
+// The sweep runs with the kernel arguments and memory contents of the
+// captured launch. The extra launches may change memory contents seen by
+// later calls, the replay only serves to reach the following launches.
+struct LocalSizeTuner {
+
+    LocalSizeTuner(const Trace& trace, unsigned repetitions)
+        : m_trace(trace), m_replay(true),
+          m_repetitions(std::max(repetitions, 1u)) {}
+
+    bool run() {
+        std::set<std::pair<uint64_t, std::vector<size_t>>> tuned;
+        m_replay.preVisit(m_trace);
+        for (auto& call : m_trace.calls()) {
+            if (call.id() == oclapi::command::ENQUEUE_NDRANGE_KERNEL) {
+                auto launch = Launch(call);
+                if (tuned.insert({launch.kernel_id, launch.global}).second) {
+                    tune(launch);
+                }
+            }
+            auto event = m_replay.replay(call);
+            if (event != nullptr) {
+                PFN_clReleaseEvent(event);
+            }
+        }
+        m_replay.postVisit();
+        return true;
+    }
+
+    void print_table() const {
+        info("%-24s %-16s %-16s %10s %-16s %10s %8s", "kernel", "global",
+             "captured", "time (us)", "best", "time (us)", "speedup");
+        for (auto& res : m_results) {
+            if (res.best_time < 0) {
+                info("%-24s %-16s %-16s %10s", res.name.c_str(),
+                     sizes(res.global).c_str(), sizes(res.captured).c_str(),
+                     "n/a");
+                continue;
+            }
+            info("%-24s %-16s %-16s %10.2f %-16s %10.2f %7.2fx",
+                 res.name.c_str(), sizes(res.global).c_str(),
+                 sizes(res.captured).c_str(), res.captured_time,
+                 sizes(res.best).c_str(), res.best_time,
+                 res.best_time > 0 ? res.captured_time / res.best_time : 1.0);
+        }
+    }
+
+private:
+    // An empty local size lets the implementation choose
+    struct Launch {
+        Launch(const Call& call) {
+            auto& params = call.params();
+            auto queue_id = call_param_object_use_ids(params[0].get())[0];
+            kernel_id = call_param_object_use_ids(params[1].get())[0];
+            queue = object_replay_tracker<cl_command_queue>().get(queue_id);
+            kernel = object_replay_tracker<cl_kernel>().get(kernel_id);
+            global = array(params[4].get());
+            offset = array(params[3].get());
+            local = array(params[5].get());
+        }
+
+        static std::vector<size_t> array(CallParam* param) {
+            if (call_param_array_null_pointer(param)) {
+                return {};
+            }
+            return static_cast<CallParamArray<size_t>*>(param)->values();
+        }
+
+        cl_command_queue queue;
+        cl_kernel kernel;
+        uint64_t kernel_id;
+        std::vector<size_t> global;
+        std::vector<size_t> offset;
+        std::vector<size_t> local;
+    };
+
+    struct Result {
+        std::string name;
+        std::vector<size_t> global;
+        std::vector<size_t> captured;
+        double captured_time;
+        std::vector<size_t> best;
+        double best_time;
+    };
+
+    static std::string sizes(const std::vector<size_t>& vals) {
+        if (vals.empty()) {
+            return "auto";
+        }
+        std::string ret;
+        for (auto val : vals) {
+            if (!ret.empty()) {
+                ret += "x";
+            }
+            ret += std::to_string(val);
+        }
+        return ret;
+    }
+
+    std::vector<std::vector<size_t>> candidates(const Launch& launch) const {
+        cl_device_id device;
+        auto err = PFN_clGetCommandQueueInfo(launch.queue, CL_QUEUE_DEVICE,
+                                             sizeof(device), &device, nullptr);
+        size_t max_wg, multiple;
+        err |= PFN_clGetKernelWorkGroupInfo(launch.kernel, device,
+                                            CL_KERNEL_WORK_GROUP_SIZE,
+                                            sizeof(max_wg), &max_wg, nullptr);
+        err |= PFN_clGetKernelWorkGroupInfo(
+            launch.kernel, device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+            sizeof(multiple), &multiple, nullptr);
+        cl_uint max_dims = 0;
+        err |= PFN_clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS,
+                                   sizeof(max_dims), &max_dims, nullptr);
+        std::vector<size_t> max_items(max_dims);
+        err |= PFN_clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES,
+                                   max_items.size() * sizeof(size_t),
+                                   max_items.data(), nullptr);
+        if (err != CL_SUCCESS) {
+            warn("Can't query work-group limits for %s\n",
+                 replay_kernel_name(launch.kernel_id).c_str());
+            return {};
+        }
+        multiple = std::max<size_t>(multiple, 1);
+
+        // Sizes worth trying in each dimension
+        auto dims = launch.global.size();
+        std::vector<std::vector<size_t>> per_dim(dims);
+        for (size_t d = 0; d < dims; d++) {
+            auto limit = std::min(launch.global[d], max_wg);
+            if (d < max_items.size()) {
+                limit = std::min(limit, max_items[d]);
+            }
+            std::set<size_t> vals;
+            for (size_t val = 1; val <= limit; val *= 2) {
+                vals.insert(val);
+            }
+            for (size_t val = multiple; val <= limit; val += multiple) {
+                vals.insert(val);
+            }
+            for (auto val : vals) {
+                if (launch.global[d] % val == 0) {
+                    per_dim[d].push_back(val);
+                }
+            }
+        }
+
+        // All the combinations that fit in a work-group
+        std::vector<std::vector<size_t>> ret{{}};
+        for (size_t d = 0; d < dims; d++) {
+            std::vector<std::vector<size_t>> next;
+            for (auto& partial : ret) {
+                size_t product = 1;
+                for (auto val : partial) {
+                    product *= val;
+                }
+                for (auto val : per_dim[d]) {
+                    if (product * val <= max_wg) {
+                        next.push_back(partial);
+                        next.back().push_back(val);
+                    }
+                }
+            }
+            ret = std::move(next);
+        }
+        return ret;
+    }
+
+    // Best device time of the launch with a local size over the repetitions,
+    // negative when the launch fails
+    double measure(const Launch& launch, const std::vector<size_t>& local) {
+        double best = std::numeric_limits<double>::max();
+        for (unsigned rep = 0; rep < m_repetitions; rep++) {
+            cl_event event;
+            auto err = PFN_clEnqueueNDRangeKernel(
+                launch.queue, launch.kernel, launch.global.size(),
+                launch.offset.empty() ? nullptr : launch.offset.data(),
+                launch.global.data(), local.empty() ? nullptr : local.data(),
+                0, nullptr, &event);
+            if (err != CL_SUCCESS) {
+                return -1;
+            }
+            err = PFN_clWaitForEvents(1, &event);
+            double time;
+            bool timed = (err == CL_SUCCESS) &&
+                         replay_event_device_time(event, time);
+            PFN_clReleaseEvent(event);
+            if (!timed) {
+                return -1;
+            }
+            best = std::min(best, time);
+        }
+        return best;
+    }
+
+    void tune(const Launch& launch) {
+        Result res;
+        res.name = replay_kernel_name(launch.kernel_id);
+        res.global = launch.global;
+        res.captured = launch.local;
+        res.captured_time = measure(launch, launch.local);
+        res.best = launch.local;
+        res.best_time = res.captured_time;
+        if (res.captured_time < 0) {
+            warn("Can't time the captured launch of %s\n", res.name.c_str());
+        }
+
+        auto cands = candidates(launch);
+        debug("Tuning %s over %zu local sizes\n", res.name.c_str(),
+              cands.size());
+        for (auto& local : cands) {
+            auto time = measure(launch, local);
+            if ((time >= 0) &&
+                ((res.best_time < 0) || (time < res.best_time))) {
+                res.best = local;
+                res.best_time = time;
+            }
+        }
+        if (res.captured_time < 0) {
+            // No baseline to compare with
+            res.captured_time = res.best_time;
+        }
+        m_results.push_back(std::move(res));
+    }
+
+    const Trace& m_trace;
+    TraceReplayVisitor m_replay;
+    unsigned m_repetitions;
+    std::vector<Result> m_results;
+};
@@ -0,0 +1,174 @@
+// Copyright 2019-2023 The OpenCL-Tools authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chunks.hpp"
+#include "log.hpp"
+#include "trace.hpp"
+
+// Checks the integrity of a trace file without deserialising it. The file is
+// mapped, the chunk headers are walked to find the chunk boundaries and the
+// chunks are then checksummed in parallel.
+struct TraceVerifier {
+
+    TraceVerifier(unsigned num_threads) : m_num_threads(num_threads) {
+        if (m_num_threads == 0) {
+            m_num_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+    }
+
+    bool verify(const std::string& filename) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            error("Can't open '%s'\n", filename.c_str());
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            error("Can't stat '%s'\n", filename.c_str());
+            close(fd);
+            return false;
+        }
+        size_t size = st.st_size;
+        void* map = nullptr;
+        if (size > 0) {
+            map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (map == MAP_FAILED) {
+            error("Can't map '%s'\n", filename.c_str());
+            return false;
+        }
+        if (map != nullptr) {
+            madvise(map, size, MADV_WILLNEED);
+        }
+
+        bool ok = verify(static_cast<const char*>(map), size, filename);
+
+        if (map != nullptr) {
+            munmap(map, size);
+        }
+        return ok;
+    }
+
+private:
+    struct ChunkInfo {
+        size_t offset; // Of the data
+        ChunkHeader header;
+    };
+
+    bool verify(const char* data, size_t size, const std::string& filename) {
+        size_t offset = sizeof(kTraceMagic) + sizeof(kTraceVersion);
+        if ((size < offset) ||
+            memcmp(data, kTraceMagic, sizeof(kTraceMagic))) {
+            error("'%s' is not a trace\n", filename.c_str());
+            return false;
+        }
+        uint32_t version;
+        memcpy(&version, data + sizeof(kTraceMagic), sizeof(version));
+        if (version != kTraceVersion) {
+            error("Unsupported trace version %u in '%s' (expected %u)\n",
+                  version, filename.c_str(), kTraceVersion);
+            return false;
+        }
+
+        // Find chunk boundaries
+        std::vector<ChunkInfo> chunks;
+        while (true) {
+            ChunkHeader header;
+            if (size - offset < sizeof(header)) {
+                error("Truncated trace '%s' after %zu chunks\n",
+                      filename.c_str(), chunks.size());
+                return false;
+            }
+            memcpy(&header, data + offset, sizeof(header));
+            offset += sizeof(header);
+            if (header.size == 0) {
+                break;
+            }
+            if (header.size > kMaxChunkSize) {
+                error("Invalid size for chunk %zu in '%s'\n", chunks.size(),
+                      filename.c_str());
+                return false;
+            }
+            if (size - offset < header.size) {
+                error("Truncated trace '%s' in chunk %zu\n", filename.c_str(),
+                      chunks.size());
+                return false;
+            }
+            chunks.push_back({offset, header});
+            offset += header.size;
+        }
+        if (offset != size) {
+            warn("%zu trailing bytes after the end of '%s'\n", size - offset,
+                 filename.c_str());
+        }
+
+        // Checksum chunks in parallel, each thread taking the next chunk
+        std::atomic<size_t> next{0};
+        // Not a vector<bool>, threads write to neighbouring elements
+        std::vector<char> bad(chunks.size(), false);
+        auto worker = [&]() {
+            size_t i;
+            while ((i = next++) < chunks.size()) {
+                auto& chunk = chunks[i];
+                auto crc = crc32c(data + chunk.offset, chunk.header.size);
+                if (crc != chunk.header.crc) {
+                    bad[i] = true;
+                }
+            }
+        };
+        std::vector<std::thread> threads;
+        auto num_threads = std::min<size_t>(m_num_threads, chunks.size());
+        for (size_t t = 1; t < num_threads; t++) {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        size_t num_bad = 0;
+        for (size_t i = 0; i < chunks.size(); i++) {
+            if (bad[i]) {
+                error("Corrupted chunk %zu at offset %zu in '%s'\n", i,
+                      chunks[i].offset - sizeof(ChunkHeader),
+                      filename.c_str());
+                num_bad++;
+            }
+        }
+        if (num_bad != 0) {
+            return false;
+        }
+
+        info("Trace '%s' OK: %zu chunks, %zu bytes\n", filename.c_str(),
+             chunks.size(), size);
+        return true;
+    }
+
+    unsigned m_num_threads;
+};
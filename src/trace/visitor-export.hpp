@@ -0,0 +1,622 @@
+// Copyright 2019-2023 The OpenCL-Tools authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "visitor.hpp"
+
+#include <cinttypes>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <ostream>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//
+// Timeline writers
+//
+
+enum TimelineTrackGroup : uint32_t
+{
+    TIMELINE_TRACK_GROUP_HOST_THREADS = 1,
+    TIMELINE_TRACK_GROUP_COMMAND_QUEUES = 2,
+};
+
+struct TimelineSlice {
+    uint64_t track;
+    const char* name;
+    uint64_t start;
+    uint64_t end;
+    std::vector<uint64_t> flows_out;
+    std::vector<uint64_t> flows_in;
+};
+
+struct TimelineWriter {
+    virtual ~TimelineWriter() {}
+    virtual void begin() = 0;
+    virtual void track(uint64_t uuid, TimelineTrackGroup group,
+                       const std::string& name) = 0;
+    virtual void slice(const TimelineSlice& slice) = 0;
+    virtual void end() = 0;
+};
+
+// Chrome trace-event JSON, one process per track group and one thread per
+// track.
+struct ChromeJsonTimelineWriter : public TimelineWriter {
+
+    ChromeJsonTimelineWriter(std::ostream& os) : m_os(os), m_sep("") {}
+
+    void begin() override {
+        m_os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+        process(TIMELINE_TRACK_GROUP_HOST_THREADS, "Host threads");
+        process(TIMELINE_TRACK_GROUP_COMMAND_QUEUES, "Command queues");
+    }
+
+    void track(uint64_t uuid, TimelineTrackGroup group,
+               const std::string& name) override {
+        auto tid = static_cast<uint32_t>(m_tracks.size() + 1);
+        m_tracks[uuid] = {group, tid};
+        event() << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << group
+                << ",\"tid\":" << tid << ",\"args\":{\"name\":\""
+                << escape(name) << "\"}}";
+    }
+
+    void slice(const TimelineSlice& slice) override {
+        auto group = m_tracks.at(slice.track).group;
+        event() << "{\"name\":\"" << escape(slice.name)
+                << "\",\"ph\":\"X\",\"pid\":" << group
+                << ",\"tid\":" << tid(slice.track)
+                << ",\"ts\":" << microseconds(slice.start)
+                << ",\"dur\":" << microseconds(slice.end - slice.start) << "}";
+        for (auto id : slice.flows_out) {
+            flow(id, "s", group, slice.track, slice.start);
+        }
+        for (auto id : slice.flows_in) {
+            flow(id, "f", group, slice.track, slice.start);
+        }
+    }
+
+    void end() override { m_os << "\n]}\n"; }
+
+private:
+    std::ostream& event() {
+        m_os << m_sep;
+        m_sep = ",\n";
+        return m_os;
+    }
+
+    void process(TimelineTrackGroup group, const char* name) {
+        event() << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << group
+                << ",\"args\":{\"name\":\"" << escape(name) << "\"}}";
+    }
+
+    void flow(uint64_t id, const char* phase, uint32_t group, uint64_t track,
+              uint64_t ts) {
+        event() << "{\"name\":\"event\",\"cat\":\"event\",\"ph\":\"" << phase
+                << "\",\"bp\":\"e\",\"id\":" << id << ",\"pid\":" << group
+                << ",\"tid\":" << tid(track) << ",\"ts\":" << microseconds(ts)
+                << "}";
+    }
+
+    // Tracks are numbered in the order they are declared
+    uint32_t tid(uint64_t uuid) const { return m_tracks.at(uuid).tid; }
+
+    static std::string escape(const std::string& str) {
+        std::string ret;
+        for (unsigned char c : str) {
+            if ((c == '"') || (c == '\\')) {
+                ret += '\\';
+                ret += c;
+            } else if (c < 0x20) {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                ret += buf;
+            } else {
+                ret += c;
+            }
+        }
+        return ret;
+    }
+
+    // Trace-event timestamps are in microseconds, keep nanosecond precision
+    static std::string microseconds(uint64_t ns) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%" PRIu64 ".%03" PRIu64, ns / 1000,
+                 ns % 1000);
+        return buf;
+    }
+
+    struct Track {
+        TimelineTrackGroup group;
+        uint32_t tid;
+    };
+
+    std::ostream& m_os;
+    const char* m_sep;
+    std::unordered_map<uint64_t, Track> m_tracks;
+};
+
+// Perfetto protobuf trace (TracePacket stream), encoded by hand to avoid a
+// dependency on the Perfetto SDK.
+struct PerfettoTimelineWriter : public TimelineWriter {
+
+    PerfettoTimelineWriter(std::ostream& os) : m_os(os), m_first(true) {}
+
+    void begin() override {
+        group(TIMELINE_TRACK_GROUP_HOST_THREADS, "Host threads");
+        group(TIMELINE_TRACK_GROUP_COMMAND_QUEUES, "Command queues");
+    }
+
+    void track(uint64_t uuid, TimelineTrackGroup parent,
+               const std::string& name) override {
+        Message desc;
+        desc.varint(kTrackDescriptorUuid, uuid);
+        desc.bytes(kTrackDescriptorName, name);
+        desc.varint(kTrackDescriptorParentUuid, parent);
+        Message packet;
+        packet.message(kTracePacketTrackDescriptor, desc);
+        write(packet);
+    }
+
+    void slice(const TimelineSlice& slice) override {
+        Message begin;
+        begin.varint(kTrackEventType, kTrackEventTypeSliceBegin);
+        begin.varint(kTrackEventTrackUuid, slice.track);
+        begin.bytes(kTrackEventName, slice.name);
+        for (auto id : slice.flows_out) {
+            begin.fixed64(kTrackEventFlowIds, id);
+        }
+        for (auto id : slice.flows_in) {
+            begin.fixed64(kTrackEventTerminatingFlowIds, id);
+        }
+        event(slice.start, begin);
+
+        Message end;
+        end.varint(kTrackEventType, kTrackEventTypeSliceEnd);
+        end.varint(kTrackEventTrackUuid, slice.track);
+        event(slice.end, end);
+    }
+
+    void end() override { m_os.flush(); }
+
+private:
+    // Field numbers from perfetto/protos/perfetto/trace/
+    static constexpr uint32_t kTracePacket = 1;
+    static constexpr uint32_t kTracePacketTimestamp = 8;
+    static constexpr uint32_t kTracePacketSequenceId = 10;
+    static constexpr uint32_t kTracePacketTrackEvent = 11;
+    static constexpr uint32_t kTracePacketSequenceFlags = 13;
+    static constexpr uint32_t kTracePacketTimestampClockId = 58;
+    static constexpr uint32_t kTracePacketTrackDescriptor = 60;
+    static constexpr uint32_t kTrackDescriptorUuid = 1;
+    static constexpr uint32_t kTrackDescriptorName = 2;
+    static constexpr uint32_t kTrackDescriptorParentUuid = 5;
+    static constexpr uint32_t kTrackEventType = 9;
+    static constexpr uint32_t kTrackEventTrackUuid = 11;
+    static constexpr uint32_t kTrackEventName = 23;
+    static constexpr uint32_t kTrackEventFlowIds = 47;
+    static constexpr uint32_t kTrackEventTerminatingFlowIds = 48;
+    static constexpr uint64_t kTrackEventTypeSliceBegin = 1;
+    static constexpr uint64_t kTrackEventTypeSliceEnd = 2;
+    static constexpr uint64_t kSequenceIncrementalStateCleared = 1;
+    static constexpr uint64_t kBuiltinClockMonotonic = 3;
+    static constexpr uint64_t kSequenceId = 1;
+
+    struct Message {
+        void tag(uint32_t field, uint32_t wire_type) {
+            raw_varint((static_cast<uint64_t>(field) << 3) | wire_type);
+        }
+        void raw_varint(uint64_t val) {
+            while (val >= 0x80) {
+                m_data.push_back(static_cast<char>((val & 0x7F) | 0x80));
+                val >>= 7;
+            }
+            m_data.push_back(static_cast<char>(val));
+        }
+        void varint(uint32_t field, uint64_t val) {
+            tag(field, 0);
+            raw_varint(val);
+        }
+        void fixed64(uint32_t field, uint64_t val) {
+            tag(field, 1);
+            for (int i = 0; i < 8; i++) {
+                m_data.push_back(static_cast<char>(val >> (8 * i)));
+            }
+        }
+        void bytes(uint32_t field, const char* data, size_t size) {
+            tag(field, 2);
+            raw_varint(size);
+            m_data.append(data, size);
+        }
+        void bytes(uint32_t field, const std::string& str) {
+            bytes(field, str.data(), str.size());
+        }
+        void bytes(uint32_t field, const char* str) {
+            bytes(field, str, strlen(str));
+        }
+        void message(uint32_t field, const Message& msg) {
+            bytes(field, msg.m_data);
+        }
+        const std::string& data() const { return m_data; }
+
+    private:
+        std::string m_data;
+    };
+
+    void group(TimelineTrackGroup uuid, const char* name) {
+        Message desc;
+        desc.varint(kTrackDescriptorUuid, uuid);
+        desc.bytes(kTrackDescriptorName, name);
+        Message packet;
+        packet.message(kTracePacketTrackDescriptor, desc);
+        write(packet);
+    }
+
+    void event(uint64_t ts, const Message& event) {
+        Message packet;
+        packet.varint(kTracePacketTimestamp, ts);
+        packet.varint(kTracePacketTimestampClockId, kBuiltinClockMonotonic);
+        packet.message(kTracePacketTrackEvent, event);
+        write(packet);
+    }
+
+    void write(Message& packet) {
+        packet.varint(kTracePacketSequenceId, kSequenceId);
+        if (m_first) {
+            packet.varint(kTracePacketSequenceFlags,
+                          kSequenceIncrementalStateCleared);
+            m_first = false;
+        }
+        Message wrapper;
+        wrapper.message(kTracePacket, packet);
+        m_os.write(wrapper.data().data(), wrapper.data().size());
+    }
+
+    std::ostream& m_os;
+    bool m_first;
+};
+
+//
+// Export visitor
+//
+
+// Builds a timeline from a trace: one track per host thread with a slice per
+// API call and one track per command queue with a slice per enqueued command.
+// Commands are placed at their submission time unless the application queried
+// profiling information for their event, in which case the device execution
+// time is used. Flows connect the producer of an event to each command or
+// call that waits on it.
+//
+// Slices that produce an event are held back until the event is released, or
+// for kCompletedWindow calls after the event is known to be complete, so that
+// the flows and profiling information that usually follow them are known when
+// they are written. Events are complete once waited for, once their queue is
+// finished, or when the application observes it. Everything else is written
+// as soon as it is visited.
+//
+// Slices aren't visited in the order of their start time and may overlap on a
+// queue, where commands run concurrently or device times are mixed with
+// submission times. Each track is split into as many lanes, each its own
+// track, as needed for the slices of each lane to be written in order
+// without overlapping.
+struct TraceExportVisitor : public TraceVisitor {
+
+    TraceExportVisitor(TimelineWriter& writer)
+        : m_writer(writer), m_next_flow_id(1), m_call_num(0) {}
+
+    void preVisit(const Trace&) override { m_writer.begin(); }
+
+    void visitCall(const Call& call) override {
+        auto id = call.id();
+        auto& params = call.params();
+        auto& retval = call.retval();
+
+        auto host_track = hostTrack(call.thread());
+        TimelineSlice host_slice{host_track,        oclapi::command_name(id),
+                                 call.start_time(), call.end_time(),
+                                 {},                {}};
+
+        // Enqueued commands also get a slice on their queue's track
+        bool enqueue = isEnqueue(call);
+        uint64_t queue = 0;
+        TimelineSlice queue_slice;
+        if (enqueue) {
+            queue = call_param_object_use_ids(params[0].get())[0];
+            queue_slice =
+                TimelineSlice{queueTrack(queue), host_slice.name,
+                              call.start_time(), call.end_time(), {}, {}};
+        }
+        auto& slice = enqueue ? queue_slice : host_slice;
+
+        // Wait lists
+        for (auto& param : params) {
+            if ((param->type() != CALL_PARAM_OBJECT_USE) ||
+                (param->ttype() != CALL_PARAM_TEMPLATE_TYPE_CL_EVENT)) {
+                continue;
+            }
+            auto use = static_cast<CallParamObjectUse<cl_event>*>(param.get());
+            if (!use->multiple()) {
+                continue;
+            }
+            for (auto event : use->object_ids()) {
+                auto producer = m_producers.find(event);
+                if (producer == m_producers.end()) {
+                    continue;
+                }
+                auto flow = m_next_flow_id++;
+                producer->second.slice.flows_out.push_back(flow);
+                slice.flows_in.push_back(flow);
+                if (id == oclapi::command::WAIT_FOR_EVENTS) {
+                    completed(event);
+                }
+            }
+        }
+
+        // Event lifetime, completion and profiling information
+        switch (id) {
+        case oclapi::command::RETAIN_EVENT: {
+            auto producer = m_producers.find(eventUsed(call));
+            if (producer != m_producers.end()) {
+                producer->second.refcount++;
+            }
+            break;
+        }
+        case oclapi::command::RELEASE_EVENT: {
+            auto producer = m_producers.find(eventUsed(call));
+            if (producer != m_producers.end()) {
+                if (--producer->second.refcount == 0) {
+                    flush(producer->second);
+                    m_producers.erase(producer);
+                }
+            }
+            break;
+        }
+        case oclapi::command::FINISH: {
+            auto finished = eventUsed(call);
+            for (auto& producer : m_producers) {
+                if (producer.second.queue == finished) {
+                    completed(producer.first);
+                }
+            }
+            break;
+        }
+        case oclapi::command::GET_EVENT_INFO:
+            recordEventStatus(call);
+            break;
+        case oclapi::command::GET_EVENT_PROFILING_INFO:
+            recordProfilingInfo(call);
+            break;
+        default:
+            break;
+        }
+
+        // Event creation, either as an output parameter or a return value
+        std::vector<uint64_t> produced;
+        for (auto& param : params) {
+            if ((param->type() == CALL_PARAM_OPTIONAL_OBJECT_CREATION) &&
+                (param->ttype() == CALL_PARAM_TEMPLATE_TYPE_CL_EVENT)) {
+                auto& ids = call_param_object_creation_ids(param.get());
+                produced.insert(produced.end(), ids.begin(), ids.end());
+            }
+        }
+        if ((retval->type() == CALL_PARAM_OPTIONAL_OBJECT_CREATION) &&
+            (retval->ttype() == CALL_PARAM_TEMPLATE_TYPE_CL_EVENT)) {
+            auto& ids = call_param_object_creation_ids(retval.get());
+            produced.insert(produced.end(), ids.begin(), ids.end());
+        }
+
+        if (enqueue) {
+            write(host_slice);
+        }
+        if (produced.empty()) {
+            write(slice);
+        } else {
+            m_producers[produced[0]] = Producer{slice, queue};
+        }
+
+        m_call_num++;
+        flushCompleted();
+    }
+
+    void postVisit() override {
+        for (auto& producer : m_producers) {
+            flush(producer.second);
+        }
+        m_producers.clear();
+        m_completed.clear();
+        m_writer.end();
+    }
+
+private:
+    // Calls after which the slice of a complete event is written
+    static constexpr size_t kCompletedWindow = 1024;
+
+    struct Producer {
+        TimelineSlice slice;
+        uint64_t queue = 0; // Zero for events not produced by a command
+        uint32_t refcount = 1;
+        bool complete = false;
+        // Device timestamps, valid when non-zero
+        cl_ulong queued = 0;
+        cl_ulong start = 0;
+        cl_ulong end = 0;
+    };
+
+    // Lane of a track, the tracks of the lanes beyond the first one are
+    // created as needed
+    struct Lane {
+        uint64_t uuid;
+        uint64_t end; // End of the last slice written to the lane
+    };
+
+    static bool isEnqueue(const Call& call) {
+        auto& params = call.params();
+        return (strncmp(oclapi::command_name(call.id()), "clEnqueue", 9) ==
+                0) &&
+               !params.empty() &&
+               (params[0]->type() == CALL_PARAM_OBJECT_USE) &&
+               (params[0]->ttype() == CALL_PARAM_TEMPLATE_TYPE_CL_COMMANDQUEUE);
+    }
+
+    static uint64_t eventUsed(const Call& call) {
+        return call_param_object_use_ids(call.params()[0].get())[0];
+    }
+
+    uint64_t track(uint64_t uuid, TimelineTrackGroup group,
+                   const std::string& name) {
+        if (m_lanes.count(uuid) == 0) {
+            m_lanes[uuid].push_back(Lane{uuid, 0});
+            m_tracks[uuid] = {group, name};
+            m_writer.track(uuid, group, name);
+        }
+        return uuid;
+    }
+
+    uint64_t hostTrack(uint32_t thread) {
+        // Track UUIDs 1 and 2 are used for the groups
+        return track(0x100 + thread, TIMELINE_TRACK_GROUP_HOST_THREADS,
+                     "Thread " + std::to_string(thread));
+    }
+
+    uint64_t queueTrack(uint64_t queue) {
+        return track((1ULL << 32) + queue, TIMELINE_TRACK_GROUP_COMMAND_QUEUES,
+                     "Queue #" + std::to_string(queue));
+    }
+
+    // Write a slice to the first lane of its track where it starts after all
+    // the slices already written
+    void write(TimelineSlice& slice) {
+        auto& lanes = m_lanes.at(slice.track);
+        size_t lane = 0;
+        while ((lane < lanes.size()) && (lanes[lane].end > slice.start)) {
+            lane++;
+        }
+        if (lane == lanes.size()) {
+            // Lanes are in the upper bits, above host threads and queues
+            uint64_t uuid = slice.track + (static_cast<uint64_t>(lane) << 48);
+            auto& track = m_tracks.at(slice.track);
+            m_writer.track(uuid, track.first,
+                           track.second + " (" + std::to_string(lane) + ")");
+            lanes.push_back(Lane{uuid, 0});
+        }
+        lanes[lane].end = std::max(slice.end, slice.start);
+        slice.track = lanes[lane].uuid;
+        m_writer.slice(slice);
+    }
+
+    void completed(uint64_t event) {
+        auto producer = m_producers.find(event);
+        if ((producer == m_producers.end()) || producer->second.complete) {
+            return;
+        }
+        producer->second.complete = true;
+        m_completed.push_back({m_call_num + kCompletedWindow, event});
+    }
+
+    void flushCompleted() {
+        while (!m_completed.empty() &&
+               (m_completed.front().first <= m_call_num)) {
+            auto producer = m_producers.find(m_completed.front().second);
+            m_completed.pop_front();
+            // Skip producers released, or whose ID was reused since
+            if ((producer != m_producers.end()) && producer->second.complete) {
+                flush(producer->second);
+                m_producers.erase(producer);
+            }
+        }
+    }
+
+    void recordEventStatus(const Call& call) {
+        auto& params = call.params();
+        auto ret = static_cast<CallParamValue<cl_int>*>(call.retval().get());
+        auto param_name =
+            static_cast<CallParamValue<cl_event_info>*>(params[1].get())
+                ->value();
+        if ((ret->value() != CL_SUCCESS) ||
+            (param_name != CL_EVENT_COMMAND_EXECUTION_STATUS)) {
+            return;
+        }
+        auto& data =
+            static_cast<CallParamValueOutByRef<void>*>(params[3].get())->data();
+        cl_int status;
+        if (data.size() != sizeof(status)) {
+            return;
+        }
+        memcpy(&status, data.data(), sizeof(status));
+        if (status == CL_COMPLETE) {
+            completed(eventUsed(call));
+        }
+    }
+
+    void recordProfilingInfo(const Call& call) {
+        auto& params = call.params();
+        auto ret = static_cast<CallParamValue<cl_int>*>(call.retval().get());
+        if (ret->value() != CL_SUCCESS) {
+            return;
+        }
+        auto producer = m_producers.find(eventUsed(call));
+        if (producer == m_producers.end()) {
+            return;
+        }
+        auto param_name =
+            static_cast<CallParamValue<cl_profiling_info>*>(params[1].get())
+                ->value();
+        auto& data =
+            static_cast<CallParamValueOutByRef<void>*>(params[3].get())->data();
+        if (data.size() != sizeof(cl_ulong)) {
+            return;
+        }
+        cl_ulong value;
+        memcpy(&value, data.data(), sizeof(value));
+        switch (param_name) {
+        case CL_PROFILING_COMMAND_QUEUED:
+            producer->second.queued = value;
+            break;
+        case CL_PROFILING_COMMAND_START:
+            producer->second.start = value;
+            break;
+        case CL_PROFILING_COMMAND_END:
+            producer->second.end = value;
+            // Profiling information is only available for complete commands
+            completed(producer->first);
+            break;
+        }
+    }
+
+    void flush(Producer& producer) {
+        auto& slice = producer.slice;
+        // Use device execution times when available. The device clock is
+        // aligned on the host by assuming the command was queued when the
+        // enqueue call started.
+        if ((producer.start != 0) && (producer.end >= producer.start)) {
+            if ((producer.queued != 0) && (producer.start >= producer.queued)) {
+                slice.start += producer.start - producer.queued;
+            }
+            slice.end = slice.start + (producer.end - producer.start);
+        }
+        write(slice);
+    }
+
+    TimelineWriter& m_writer;
+    uint64_t m_next_flow_id;
+    size_t m_call_num;
+    std::unordered_map<uint64_t, std::vector<Lane>> m_lanes;
+    // Group and name of the tracks
+    std::unordered_map<uint64_t, std::pair<TimelineTrackGroup, std::string>>
+        m_tracks;
+    std::map<uint64_t, Producer> m_producers;
+    // Complete events, with the call after which their slice is written
+    std::deque<std::pair<size_t, uint64_t>> m_completed;
+};
@@ -12,140 +12,1126 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#pragma once
+
 #include "ocltools-loader-gen.hpp"
+#include "program-cache.hpp"
+#include "program-overrides.hpp"
+#include "replay-devices.hpp"
+#include "replay-pacing.hpp"
+#include "replay-validation.hpp"
 #include "visitor.hpp"
 
-struct TraceReplayVisitor : TraceVisitor {
+#include <algorithm>
+#include <memory>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+//
+// Replay helpers
+//
+
+// Captured data of an input array, the implementation only reads it
+static const void* call_param_array_data(CallParam* param) {
+    auto ttype = param->ttype();
+    assert(param->type() == CALL_PARAM_ARRAY);
+    switch (ttype) {
+    case CALL_PARAM_TEMPLATE_TYPE_CL_ULONG:
+        return static_cast<CallParamArray<size_t>*>(param)->values().data();
+    case CALL_PARAM_TEMPLATE_TYPE_CHAR:
+        return static_cast<CallParamArray<char>*>(param)->values().data();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_IMAGE_FORMAT:
+        return static_cast<CallParamArray<cl_image_format>*>(param)
+            ->values()
+            .data();
+    case CALL_PARAM_TEMPLATE_TYPE_CL_IMAGE_DESC:
+        return static_cast<CallParamArray<cl_image_desc>*>(param)
+            ->values()
+            .data();
+    }
 
-    template <typename T> struct ValueReplayHandler {
-        ValueReplayHandler(const std::unique_ptr<CallParam>& param,
-                           char*& memory) {
-            m_param = static_cast<CallParamValue<T>*>(param.get());
-            memory += m_param->output_memory_requirements();
+    fatal("Unsupported array in replay, ttype = %u", ttype);
+    abort();
+}
+
+static void* replay_object_get(CallParamTemplateType ttype, uint64_t id) {
+    switch (ttype) {
+    case CALL_PARAM_TEMPLATE_TYPE_CL_PLATFORM_ID:
+        return object_replay_tracker<cl_platform_id>().get(id);
+    case CALL_PARAM_TEMPLATE_TYPE_CL_DEVICE_ID:
+        return object_replay_tracker<cl_device_id>().get(id);
+    case CALL_PARAM_TEMPLATE_TYPE_CL_CONTEXT:
+        return object_replay_tracker<cl_context>().get(id);
+    case CALL_PARAM_TEMPLATE_TYPE_CL_COMMANDQUEUE:
+        return object_replay_tracker<cl_command_queue>().get(id);
+    case CALL_PARAM_TEMPLATE_TYPE_CL_PROGRAM:
+        return object_replay_tracker<cl_program>().get(id);
+    case CALL_PARAM_TEMPLATE_TYPE_CL_KERNEL:
+        return object_replay_tracker<cl_kernel>().get(id);
+    case CALL_PARAM_TEMPLATE_TYPE_CL_MEM:
+        return object_replay_tracker<cl_mem>().get(id);
+    case CALL_PARAM_TEMPLATE_TYPE_CL_EVENT:
+        return object_replay_tracker<cl_event>().get(id);
+    case CALL_PARAM_TEMPLATE_TYPE_CL_SAMPLER:
+        return object_replay_tracker<cl_sampler>().get(id);
+    }
+
+    fatal("Unsupported object in replay, ttype = %u", ttype);
+    abort();
+}
+
+static void replay_object_reserve(CallParamTemplateType ttype,
+                                  uint64_t size) {
+    switch (ttype) {
+    case CALL_PARAM_TEMPLATE_TYPE_CL_PLATFORM_ID:
+        return object_replay_tracker<cl_platform_id>().reserve(size);
+    case CALL_PARAM_TEMPLATE_TYPE_CL_DEVICE_ID:
+        return object_replay_tracker<cl_device_id>().reserve(size);
+    case CALL_PARAM_TEMPLATE_TYPE_CL_CONTEXT:
+        return object_replay_tracker<cl_context>().reserve(size);
+    case CALL_PARAM_TEMPLATE_TYPE_CL_COMMANDQUEUE:
+        return object_replay_tracker<cl_command_queue>().reserve(size);
+    case CALL_PARAM_TEMPLATE_TYPE_CL_PROGRAM:
+        return object_replay_tracker<cl_program>().reserve(size);
+    case CALL_PARAM_TEMPLATE_TYPE_CL_KERNEL:
+        return object_replay_tracker<cl_kernel>().reserve(size);
+    case CALL_PARAM_TEMPLATE_TYPE_CL_MEM:
+        return object_replay_tracker<cl_mem>().reserve(size);
+    case CALL_PARAM_TEMPLATE_TYPE_CL_EVENT:
+        return object_replay_tracker<cl_event>().reserve(size);
+    case CALL_PARAM_TEMPLATE_TYPE_CL_SAMPLER:
+        return object_replay_tracker<cl_sampler>().reserve(size);
+    default:
+        return;
+    }
+}
+
+// Size the replay trackers of the calling thread for all the objects and map
+// pointers a trace creates
+static void replay_objects_reserve(const Trace& trace) {
+    std::unordered_map<uint32_t, uint64_t> sizes;
+    uint64_t map_pointers = 0;
+    auto reserve = [&](CallParam* param) {
+        if (param->type() == CALL_PARAM_MAP_POINTER_CREATION) {
+            auto id = static_cast<CallParamMapPointerCreation*>(param)->id();
+            map_pointers = std::max(map_pointers, id + 1);
+        }
+        if (param->type() != CALL_PARAM_OPTIONAL_OBJECT_CREATION) {
+            return;
         }
-        T value() const { return m_param->value(); }
+        auto& size = sizes[param->ttype()];
+        for (auto id : call_param_object_creation_ids(param)) {
+            size = std::max(size, id + 1);
+        }
+    };
+    for (auto& call : trace.calls()) {
+        for (auto& param : call.params()) {
+            reserve(param.get());
+        }
+        if (call.retval() != nullptr) {
+            reserve(call.retval().get());
+        }
+    }
+    for (auto& size : sizes) {
+        replay_object_reserve(static_cast<CallParamTemplateType>(size.first),
+                              size.second);
+    }
+    map_pointer_replay_tracker().reserve(map_pointers);
+}
+
+static void replay_object_add(CallParamTemplateType ttype, uint64_t id,
+                              void* obj) {
+    switch (ttype) {
+    case CALL_PARAM_TEMPLATE_TYPE_CL_PLATFORM_ID:
+        object_replay_tracker<cl_platform_id>().add(
+            id, static_cast<cl_platform_id>(obj));
+        return;
+    case CALL_PARAM_TEMPLATE_TYPE_CL_DEVICE_ID:
+        object_replay_tracker<cl_device_id>().add(
+            id, static_cast<cl_device_id>(obj));
+        return;
+    case CALL_PARAM_TEMPLATE_TYPE_CL_CONTEXT:
+        object_replay_tracker<cl_context>().add(id,
+                                                static_cast<cl_context>(obj));
+        return;
+    case CALL_PARAM_TEMPLATE_TYPE_CL_COMMANDQUEUE:
+        object_replay_tracker<cl_command_queue>().add(
+            id, static_cast<cl_command_queue>(obj));
+        return;
+    case CALL_PARAM_TEMPLATE_TYPE_CL_PROGRAM:
+        object_replay_tracker<cl_program>().add(id,
+                                                static_cast<cl_program>(obj));
+        return;
+    case CALL_PARAM_TEMPLATE_TYPE_CL_KERNEL:
+        object_replay_tracker<cl_kernel>().add(id, static_cast<cl_kernel>(obj));
+        return;
+    case CALL_PARAM_TEMPLATE_TYPE_CL_MEM:
+        object_replay_tracker<cl_mem>().add(id, static_cast<cl_mem>(obj));
+        return;
+    case CALL_PARAM_TEMPLATE_TYPE_CL_EVENT:
+        object_replay_tracker<cl_event>().add(id, static_cast<cl_event>(obj));
+        return;
+    case CALL_PARAM_TEMPLATE_TYPE_CL_SAMPLER:
+        object_replay_tracker<cl_sampler>().add(id,
+                                                static_cast<cl_sampler>(obj));
+        return;
+    }
+
+    fatal("Unsupported object in replay, ttype = %u", ttype);
+}
+
+// Track the references the application holds on the object a successful
+// clRetain* or clRelease* call was made on
+static void replay_object_references(const Call& call) {
+    int delta;
+    switch (call.id()) {
+    case oclapi::command::RETAIN_CONTEXT:
+    case oclapi::command::RETAIN_COMMAND_QUEUE:
+    case oclapi::command::RETAIN_PROGRAM:
+    case oclapi::command::RETAIN_KERNEL:
+    case oclapi::command::RETAIN_MEM_OBJECT:
+    case oclapi::command::RETAIN_EVENT:
+    case oclapi::command::RETAIN_SAMPLER:
+        delta = 1;
+        break;
+    case oclapi::command::RELEASE_CONTEXT:
+    case oclapi::command::RELEASE_COMMAND_QUEUE:
+    case oclapi::command::RELEASE_PROGRAM:
+    case oclapi::command::RELEASE_KERNEL:
+    case oclapi::command::RELEASE_MEM_OBJECT:
+    case oclapi::command::RELEASE_EVENT:
+    case oclapi::command::RELEASE_SAMPLER:
+        delta = -1;
+        break;
+    default:
+        return;
+    }
 
-    private:
-        CallParamValue<T>* m_param;
+    auto param = call.params()[0].get();
+    auto id = call_param_object_use_ids(param)[0];
+    auto update = [id, delta](auto& tracker) {
+        if (delta > 0) {
+            tracker.retain(id);
+        } else {
+            tracker.release(id);
+        }
     };
+    switch (param->ttype()) {
+    case CALL_PARAM_TEMPLATE_TYPE_CL_CONTEXT:
+        return update(object_replay_tracker<cl_context>());
+    case CALL_PARAM_TEMPLATE_TYPE_CL_COMMANDQUEUE:
+        return update(object_replay_tracker<cl_command_queue>());
+    case CALL_PARAM_TEMPLATE_TYPE_CL_PROGRAM:
+        return update(object_replay_tracker<cl_program>());
+    case CALL_PARAM_TEMPLATE_TYPE_CL_KERNEL:
+        return update(object_replay_tracker<cl_kernel>());
+    case CALL_PARAM_TEMPLATE_TYPE_CL_MEM:
+        return update(object_replay_tracker<cl_mem>());
+    case CALL_PARAM_TEMPLATE_TYPE_CL_EVENT:
+        return update(object_replay_tracker<cl_event>());
+    case CALL_PARAM_TEMPLATE_TYPE_CL_SAMPLER:
+        return update(object_replay_tracker<cl_sampler>());
+    default:
+        return;
+    }
+}
 
-    template <typename T> struct OptionalObjectCreationReplayHandler {
-        OptionalObjectCreationReplayHandler(
-            const std::unique_ptr<CallParam>& param, char*& memory) {
-            m_param =
-                static_cast<CallParamOptionalObjectCreation<T>*>(param.get());
-            m_object_pointer = reinterpret_cast<T*>(memory);
-            if (!m_param->create()) {
-                m_object_pointer = nullptr;
-            }
-            memory += m_param->output_memory_requirements();
+template <typename T> static T replay_pointer_cast(void* ptr) {
+    if constexpr (std::is_function_v<std::remove_pointer_t<T>>) {
+        return reinterpret_cast<T>(ptr);
+    } else {
+        return static_cast<T>(ptr);
+    }
+}
+
+// Replacement host memory for the data of array parameters, such as the
+// contents of transfers staged in pinned memory
+using replay_staged_arrays = std::unordered_map<const CallParam*, void*>;
+
+// What an enqueue does
+enum class ReplayCommandKind {
+    other,
+    upload,   // Host to device
+    readback, // Device to host
+    kernel,
+};
+
+static ReplayCommandKind replay_command_kind(oclapi::command id) {
+    switch (id) {
+    case oclapi::command::ENQUEUE_WRITE_BUFFER:
+    case oclapi::command::ENQUEUE_WRITE_BUFFER_RECT:
+    case oclapi::command::ENQUEUE_WRITE_IMAGE:
+        return ReplayCommandKind::upload;
+    case oclapi::command::ENQUEUE_READ_BUFFER:
+    case oclapi::command::ENQUEUE_READ_BUFFER_RECT:
+    case oclapi::command::ENQUEUE_READ_IMAGE:
+        return ReplayCommandKind::readback;
+    case oclapi::command::ENQUEUE_NDRANGE_KERNEL:
+    case oclapi::command::ENQUEUE_TASK:
+    case oclapi::command::ENQUEUE_NATIVE_KERNEL:
+        return ReplayCommandKind::kernel;
+    default:
+        return ReplayCommandKind::other;
+    }
+}
+
+// Enqueues replaced with markers waiting for the same events
+using replay_elided_calls = std::unordered_set<const Call*>;
+
+struct ReplayOptions {
+    // Create command queues with profiling enabled and request an event for
+    // every kernel enqueue
+    bool profiling = false;
+    const replay_staged_arrays* staged = nullptr;
+    // Build programs through an on-disk binary cache
+    ProgramBinaryCache* program_cache = nullptr;
+    // Read back into separate memory, blocking, and compare with the data
+    // read at capture time
+    ReplayValidator* validator = nullptr;
+    // Replace the captured platforms and devices
+    const ReplayDeviceMap* devices = nullptr;
+    // Space calls in time as captured
+    ReplayPacer* pacer = nullptr;
+    // Replace the source, IL or build options of some programs
+    const ProgramOverrides* overrides = nullptr;
+    // Enqueues to skip
+    const replay_elided_calls* elided = nullptr;
+};
+
+// Index of the array parameter the implementation writes to, 0 when there
+// is none: the data read by enqueues and the host memory used by memory
+// objects.
+static size_t replay_output_array_index(const Call& call) {
+    auto& params = call.params();
+    switch (call.id()) {
+    case oclapi::command::ENQUEUE_READ_BUFFER:
+        return 5;
+    case oclapi::command::ENQUEUE_READ_IMAGE:
+        return 7;
+    case oclapi::command::CREATE_BUFFER:
+    case oclapi::command::CREATE_IMAGE: {
+        auto flags = call_param_value_as<cl_mem_flags>(params[1].get());
+        if ((flags & CL_MEM_USE_HOST_PTR) == 0) {
+            return 0;
         }
+        return (call.id() == oclapi::command::CREATE_BUFFER) ? 3 : 4;
+    }
+    default:
+        return 0;
+    }
+}
+
+static size_t replay_output_array_size(const Call& call) {
+    auto index = replay_output_array_index(call);
+    if (index == 0) {
+        return 0;
+    }
+    auto param =
+        static_cast<CallParamArray<char>*>(call.params()[index].get());
+    return param->values().size();
+}
 
-        ~OptionalObjectCreationReplayHandler() {
-            auto objects_ids = m_param->object_ids();
-            for (auto i = 0u; i < objects_ids.size(); i++) {
-                object_replay_tracker<T>().add(objects_ids[i],
-                                               m_object_pointer[i]);
+// Memory the outputs of replayed calls are written to, the trace itself is
+// never written. Object handles, map pointers and status codes are moved out
+// as soon as a call returns, as is the data of blocking reads, so a single
+// scratch area sized for the largest call is reused by all. Arrays written
+// after a call returns get their own storage: the data of non-blocking
+// reads until the trace synchronizes with them and the host memory of
+// memory objects until the objects are destroyed.
+struct ReplayMemory {
+    // Scratch area large enough for a call
+    char* scratch_for(const Call& call) {
+        auto size = call.output_memory_requirements() +
+                    replay_output_array_size(call);
+        if (scratch.size() < size) {
+            scratch.resize(size);
+        }
+        return scratch.data();
+    }
+
+    // Storage for the data of a non-blocking read
+    char* pending_read(const Call& call, size_t size) {
+        auto& params = call.params();
+        PendingRead read;
+        read.queue = call_param_object_use_ids(params[0].get())[0];
+        auto event = params.back().get();
+        read.has_event = call_param_object_creation_create(event);
+        if (read.has_event) {
+            read.event = call_param_object_creation_ids(event).at(0);
+        }
+        read.data.reset(new char[size]);
+        reads.push_back(std::move(read));
+        return reads.back().data.get();
+    }
+
+    // Free the data of the reads a replayed call waited for: those on a
+    // finished queue, those whose events were waited for and those before a
+    // blocking command on an in-order queue
+    void synchronized(const Call& call) {
+        if (reads.empty()) {
+            return;
+        }
+        auto& params = call.params();
+        const std::vector<uint64_t>* events = nullptr;
+        uint64_t queue = 0;
+        auto kind = replay_command_kind(call.id());
+        if (call.id() == oclapi::command::FINISH) {
+            queue = call_param_object_use_ids(params[0].get())[0];
+        } else if (call.id() == oclapi::command::WAIT_FOR_EVENTS) {
+            events = &call_param_object_use_ids(params[1].get());
+        } else if (((kind == ReplayCommandKind::upload) ||
+                    (kind == ReplayCommandKind::readback)) &&
+                   call_param_value_as<cl_bool>(params[2].get())) {
+            queue = call_param_object_use_ids(params[0].get())[0];
+            if (!in_order(queue)) {
+                return;
+            }
+        } else {
+            return;
+        }
+        auto done = [events, queue](const PendingRead& read) {
+            if (events == nullptr) {
+                return read.queue == queue;
             }
+            return read.has_event && (std::find(events->begin(), events->end(),
+                                                read.event) != events->end());
+        };
+        reads.erase(std::remove_if(reads.begin(), reads.end(), done),
+                    reads.end());
+    }
+
+    // Host memory for a memory object, see destroyed_with
+    char* host(size_t size) {
+        hosts.emplace_back(new char[size]);
+        return hosts.back().get();
+    }
+
+    // Hand the host memory last allocated over to the memory object using
+    // it, which frees it when destroyed. It is otherwise kept until the end
+    // of the replay.
+    void destroyed_with(cl_mem mem, char* host) {
+        if ((PFN_clSetMemObjectDestructorCallback == nullptr) ||
+            hosts.empty() || (hosts.back().get() != host)) {
+            return;
         }
+        auto err = PFN_clSetMemObjectDestructorCallback(mem, free_host, host);
+        if (err == CL_SUCCESS) {
+            hosts.back().release();
+            hosts.pop_back();
+        }
+    }
 
-        T* object_pointer() const { return m_object_pointer; }
+    void clear() {
+        scratch.clear();
+        scratch.shrink_to_fit();
+        reads.clear();
+        hosts.clear();
+    }
 
-    private:
-        T* m_object_pointer;
-        CallParamOptionalObjectCreation<T>* m_param;
+    struct PendingRead {
+        uint64_t queue;
+        bool has_event;
+        uint64_t event;
+        std::unique_ptr<char[]> data;
     };
 
-    template <typename T> struct ValueOutByRefReplayHandler {
-        ValueOutByRefReplayHandler(const std::unique_ptr<CallParam>& param,
-                                   char*& memory) {
-            m_param = static_cast<CallParamValueOutByRef<T>*>(param.get());
-            m_pointer = reinterpret_cast<T*>(memory);
-            if (m_param->null_pointer()) {
-                m_pointer = nullptr;
-            }
-            memory += m_param->output_memory_requirements();
-        }
+    std::vector<char> scratch;
+    std::vector<PendingRead> reads;
+    std::vector<std::unique_ptr<char[]>> hosts;
 
-        T* pointer() const { return m_pointer; }
+private:
+    static void CL_CALLBACK free_host(cl_mem, void* host) {
+        delete[] static_cast<char*>(host);
+    }
 
-    private:
-        T* m_pointer;
-        CallParamValueOutByRef<T>* m_param;
+    // Whether the replayed queue runs commands in order, so that a command
+    // completing means the ones before it did
+    static bool in_order(uint64_t queue) {
+        auto handle = object_replay_tracker<cl_command_queue>().get(queue);
+        cl_command_queue_properties props;
+        auto err = PFN_clGetCommandQueueInfo(handle, CL_QUEUE_PROPERTIES,
+                                             sizeof(props), &props, nullptr);
+        return (err == CL_SUCCESS) &&
+               ((props & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) == 0);
+    }
+};
+
+// Reconstructs the arguments of a single call from its recorded parameters.
+// Parameters map one-to-one onto the arguments of the API function and are
+// converted to the argument types expected by the replay handlers generated
+// from the API spec, based on the kind of parameter that was recorded.
+class ReplayCall {
+public:
+    struct Argument {
+        template <typename T> operator T() const {
+            return m_call.argument<T>(m_index);
+        }
+        ReplayCall& m_call;
+        size_t m_index;
     };
 
-    template <typename T> struct ObjectUseReplayHandler {
-        ObjectUseReplayHandler(const std::unique_ptr<CallParam>& param,
-                               char*& memory) {
-            m_param = static_cast<CallParamObjectUse<T>*>(param.get());
-            for (auto id : m_param->object_ids()) {
-                m_objects.push_back(object_replay_tracker<T>().get(id));
+    ReplayCall(const Call& call, ReplayMemory& memory,
+               const ReplayOptions& options = {})
+        : m_call(call), m_scratch(call.params().size()), m_options(options),
+          m_arena(memory), m_output_array(replay_output_array_index(call)) {
+        auto scratch = memory.scratch_for(call);
+        for (auto& param : call.params()) {
+            m_memory.push_back(scratch);
+            scratch += param->output_memory_requirements();
+        }
+        m_output_scratch = scratch;
+    }
+
+    Argument arg(size_t index) {
+        if (index >= m_call.params().size()) {
+            fatal("%s: no recorded parameter %zu\n", name(), index);
+        }
+        return Argument{*this, index};
+    }
+
+    // Record the objects created by the call and check its return value
+    template <typename R> void complete(R ret) {
+        complete();
+        auto retval = m_call.retval().get();
+        auto ttype = retval->ttype();
+        switch (retval->type()) {
+        case CALL_PARAM_VALUE:
+            if constexpr (std::is_arithmetic_v<R>) {
+                auto captured = call_param_value_as<R>(retval);
+                if (ret == CL_SUCCESS) {
+                    replay_object_references(m_call);
+                }
+                if (captured != ret) {
+                    m_failed = true;
+                    warn("%s: returned value (%lld) different from captured "
+                         "value (%lld)\n",
+                         name(), static_cast<long long>(ret),
+                         static_cast<long long>(captured));
+                }
+            }
+            break;
+        case CALL_PARAM_OPTIONAL_OBJECT_CREATION:
+            if constexpr (std::is_pointer_v<R>) {
+                auto& ids = call_param_object_creation_ids(retval);
+                replay_object_add(ttype, ids.at(0),
+                                  reinterpret_cast<void*>(ret));
             }
+            if constexpr (std::is_same_v<R, cl_mem>) {
+                if ((ret != nullptr) && (m_host != nullptr)) {
+                    m_arena.destroyed_with(ret, m_host);
+                }
+            }
+            break;
+        case CALL_PARAM_MAP_POINTER_CREATION:
+            if constexpr (std::is_pointer_v<R>) {
+                auto p = static_cast<CallParamMapPointerCreation*>(retval);
+                map_pointer_replay_tracker().add(p->id(),
+                                                 reinterpret_cast<void*>(ret));
+            }
+            break;
         }
+    }
 
-        T const* objects() const { return m_objects.data(); }
+    void complete() {
+        auto& params = m_call.params();
+        for (size_t i = 0; i < params.size(); i++) {
+            auto param = params[i].get();
+            if (param->type() != CALL_PARAM_OPTIONAL_OBJECT_CREATION) {
+                continue;
+            }
+            if (!call_param_object_creation_create(param)) {
+                continue;
+            }
+            auto objects = reinterpret_cast<void**>(m_memory[i]);
+            auto& ids = call_param_object_creation_ids(param);
+            for (size_t j = 0; j < ids.size(); j++) {
+                replay_object_add(param->ttype(), ids[j], objects[j]);
+            }
+        }
+    }
 
-    private:
-        CallParamObjectUse<T>* m_param;
-        std::vector<T> m_objects;
-    };
+    // Replace an enqueue with a marker, which waits for the same events and
+    // returns the event the application asked for. Blocks if the enqueue
+    // was blocking.
+    void elide() {
+        auto& params = m_call.params();
+        auto n = params.size();
+        cl_command_queue queue = arg(0);
+        cl_uint num_events = arg(n - 3);
+        const cl_event* wait_list = arg(n - 2);
+        cl_event* event = nullptr;
+        if (call_param_object_creation_create(params[n - 1].get())) {
+            event = reinterpret_cast<cl_event*>(m_memory[n - 1]);
+        }
+        bool blocking = false;
+        switch (replay_command_kind(m_call.id())) {
+        case ReplayCommandKind::upload:
+        case ReplayCommandKind::readback:
+            blocking = call_param_value_as<cl_bool>(params[2].get());
+            break;
+        default:
+            break;
+        }
+        cl_event marker = nullptr;
+        if (blocking && (event == nullptr)) {
+            event = &marker;
+        }
+        auto err = PFN_clEnqueueMarkerWithWaitList(queue, num_events,
+                                                   wait_list, event);
+        if ((err == CL_SUCCESS) && blocking) {
+            PFN_clWaitForEvents(1, event);
+        }
+        if (marker != nullptr) {
+            PFN_clReleaseEvent(marker);
+        }
+        complete(err);
+    }
 
-    void preVisit(const Trace& trace) override {
-        // Get memory requirements
-        auto size = trace.output_memory_requirements();
+    void unavailable() {
+        fatal("%s is not available in the OpenCL library\n", name());
+    }
 
-        // Allocate memory
-        m_memory = static_cast<char*>(malloc(size));
+    // When validating, compare the data read by the call with the data read
+    // at capture time
+    void validate() {
+        if ((m_readback == nullptr) || m_failed) {
+            return;
+        }
+        auto param = static_cast<CallParamArray<char>*>(
+            m_call.params()[readback_index()].get());
+        auto& captured = param->values();
+        m_options.validator->check(name(), captured.data(), m_readback,
+                                   captured.size());
     }
 
-    void visitCall(const Call& call) override {
+    // When profiling, the event for the kernel executed by the call or
+    // nullptr. The caller owns a reference to the event.
+    cl_event profiling_event() const {
+        if (m_app_event_index == 0) {
+            return m_profiling_event;
+        }
+        auto event = *reinterpret_cast<cl_event*>(m_memory[m_app_event_index]);
+        if (event != nullptr) {
+            PFN_clRetainEvent(event);
+        }
+        return event;
+    }
 
-        auto id = call.id();
-        auto& params = call.params();
-        auto& retval = call.retval();
+private:
+    const char* name() const { return oclapi::command_name(m_call.id()); }
 
-        info("Replaying %s...", oclapi::command_name(id));
+    bool profiled_kernel_enqueue() const {
+        switch (m_call.id()) {
+        case oclapi::command::ENQUEUE_NDRANGE_KERNEL:
+        case oclapi::command::ENQUEUE_TASK:
+            return m_options.profiling;
+        default:
+            return false;
+        }
+    }
 
-        switch (call.id()) {
-        case oclapi::command::GET_PLATFORM_IDS: {
+    // Index of the parameter data is read into, 0 when the call doesn't read
+    // data back
+    size_t readback_index() const {
+        switch (m_call.id()) {
+        case oclapi::command::ENQUEUE_READ_BUFFER:
+            return 5;
+        case oclapi::command::ENQUEUE_READ_IMAGE:
+            return 7;
+        default:
+            return 0;
+        }
+    }
 
-            ValueReplayHandler<cl_uint> p0(params[0], m_memory);
-            OptionalObjectCreationReplayHandler<cl_platform_id> p1(params[1],
-                                                                   m_memory);
-            ValueOutByRefReplayHandler<cl_uint> p2(params[2], m_memory);
+    template <typename T> T argument(size_t index) {
+        auto param = m_call.params()[index].get();
+        auto ptype = param->type();
+        if constexpr (std::is_pointer_v<T>) {
+            return replay_pointer_cast<T>(pointer(index, param));
+        } else if constexpr (std::is_arithmetic_v<T>) {
+            if (ptype == CALL_PARAM_VALUE) {
+                auto val = call_param_value_as<T>(param);
+                if constexpr (std::is_integral_v<T>) {
+                    if (m_options.profiling &&
+                        (m_call.id() ==
+                         oclapi::command::CREATE_COMMAND_QUEUE) &&
+                        (index == 2)) {
+                        val |= CL_QUEUE_PROFILING_ENABLE;
+                    }
+                    if ((m_options.validator != nullptr) &&
+                        (readback_index() != 0) && (index == 2)) {
+                        val = CL_TRUE;
+                    }
+                    if (m_options.devices != nullptr) {
+                        auto count = device_list_size(index + 1);
+                        if (count != 0) {
+                            val = static_cast<T>(count);
+                        }
+                    }
+                }
+                return val;
+            }
+        }
+        fatal("%s: can't replay parameter %zu, type = %u\n", name(), index,
+              ptype);
+        abort();
+    }
 
-            auto ret = PFN_clGetPlatformIDs(p0.value(), p1.object_pointer(),
-                                            p2.pointer());
+    void* pointer(size_t index, CallParam* param) {
+        auto& scratch = m_scratch[index];
+        auto ttype = param->ttype();
+        switch (param->type()) {
+        case CALL_PARAM_OPTIONAL_OBJECT_CREATION:
+            if (profiled_kernel_enqueue() &&
+                (ttype == CALL_PARAM_TEMPLATE_TYPE_CL_EVENT)) {
+                if (!call_param_object_creation_create(param)) {
+                    // Ask for an event the application didn't want
+                    return &m_profiling_event;
+                }
+                m_app_event_index = index;
+                *reinterpret_cast<cl_event*>(m_memory[index]) = nullptr;
+            }
+            if (!call_param_object_creation_create(param)) {
+                return nullptr;
+            }
+            return m_memory[index];
+        case CALL_PARAM_VALUE_OUT_BY_REF:
+            if (call_param_value_out_by_ref_null_pointer(param)) {
+                return nullptr;
+            }
+            return m_memory[index];
+        case CALL_PARAM_OBJECT_USE: {
+            auto& ids = call_param_object_use_ids(param);
+            if (m_options.devices != nullptr) {
+                if (ttype == CALL_PARAM_TEMPLATE_TYPE_CL_DEVICE_ID) {
+                    return remapped_devices(param, scratch);
+                }
+                if (ttype == CALL_PARAM_TEMPLATE_TYPE_CL_PLATFORM_ID) {
+                    return m_options.devices->platform(ids[0]);
+                }
+            }
+            if (!call_param_object_use_multiple(param)) {
+                return replay_object_get(ttype, ids[0]);
+            }
+            if (ids.empty()) {
+                return nullptr;
+            }
+            for (auto id : ids) {
+                scratch.push_back(
+                    reinterpret_cast<uintptr_t>(replay_object_get(ttype, id)));
+            }
+            return scratch.data();
+        }
+        case CALL_PARAM_PROPERTIES: {
+            auto props = static_cast<CallParamProperties*>(param);
+            bool profiled_queue =
+                m_options.profiling &&
+                (m_call.id() ==
+                 oclapi::command::CREATE_COMMAND_QUEUE_WITH_PROPERTIES);
+            if (!props->has_list() && !profiled_queue) {
+                return nullptr;
+            }
+            for (auto prop : props->properties()) {
+                scratch.push_back(prop);
+            }
+            replay_context_platform(scratch);
+            if (profiled_queue) {
+                enable_queue_profiling(scratch);
+            }
+            scratch.push_back(0);
+            return scratch.data();
+        }
+        case CALL_PARAM_CALLBACK:
+        case CALL_PARAM_CALLBACK_DATA:
+            // Callbacks are not replayed
+            return nullptr;
+        case CALL_PARAM_ARRAY: {
+            if (call_param_array_null_pointer(param)) {
+                return nullptr;
+            }
+            if (index == m_output_array) {
+                return output_array(param);
+            }
+            if (m_options.staged != nullptr) {
+                auto staged = m_options.staged->find(param);
+                if (staged != m_options.staged->end()) {
+                    return staged->second;
+                }
+            }
+            if (ttype == CALL_PARAM_TEMPLATE_TYPE_CL_IMAGE_DESC) {
+                // Drop the captured buffer handle
+                auto p = static_cast<CallParamArray<cl_image_desc>*>(param);
+                auto& descs = p->values();
+                scratch.resize(descs.size() * sizeof(cl_image_desc) /
+                                   sizeof(uintptr_t) +
+                               1);
+                auto copy = reinterpret_cast<cl_image_desc*>(scratch.data());
+                for (size_t i = 0; i < descs.size(); i++) {
+                    copy[i] = descs[i];
+                    copy[i].mem_object = nullptr;
+                }
+                return copy;
+            }
+            // Input parameters are const in the API
+            return const_cast<void*>(call_param_array_data(param));
+        }
+        case CALL_PARAM_PROGRAM_SOURCE: {
+            auto sources = static_cast<CallParamProgramSource*>(param);
+            for (size_t i = 0; i < sources->num_sources(); i++) {
+                scratch.push_back(
+                    reinterpret_cast<uintptr_t>(sources->source(i).c_str()));
+            }
+            return scratch.data();
+        }
+        case CALL_PARAM_STRING: {
+            auto str = static_cast<CallParamString*>(param);
+            if (!str->present()) {
+                return nullptr;
+            }
+            return const_cast<char*>(str->str().c_str());
+        }
+        case CALL_PARAM_MAP_POINTER_USE: {
+            auto use = static_cast<CallParamMapPointerUse*>(param);
+            return map_pointer_replay_tracker().get(use->id());
+        }
+        }
 
-            ValueReplayHandler<decltype(ret)> retp(retval, m_memory);
-            if (retp.value() != ret) {
-                warn("Returned value (%d) different from captured value (%d)\n",
-                     retp.value(), ret);
+        fatal("%s: can't replay parameter %zu, type = %u\n", name(), index,
+              param->type());
+        abort();
+    }
+
+    // Number of devices in the device list at index once remapped, 0 when
+    // there is no such list
+    size_t device_list_size(size_t index) const {
+        auto& params = m_call.params();
+        if (index >= params.size()) {
+            return 0;
+        }
+        auto param = params[index].get();
+        if ((param->type() != CALL_PARAM_OBJECT_USE) ||
+            (param->ttype() != CALL_PARAM_TEMPLATE_TYPE_CL_DEVICE_ID) ||
+            !call_param_object_use_multiple(param)) {
+            return 0;
+        }
+        auto& ids = call_param_object_use_ids(param);
+        if (ids.empty()) {
+            return 0;
+        }
+        return m_options.devices->devices(m_call, ids).size();
+    }
+
+    // Where the implementation writes an array, never the trace. Blocking
+    // reads, which validation forces, use the scratch area.
+    void* output_array(CallParam* param) {
+        auto& captured = static_cast<CallParamArray<char>*>(param)->values();
+        if (readback_index() == 0) {
+            m_host = m_arena.host(captured.size());
+            std::copy(captured.begin(), captured.end(), m_host);
+            return m_host;
+        }
+        auto blocking =
+            call_param_value_as<cl_bool>(m_call.params()[2].get());
+        auto data = m_output_scratch;
+        if ((m_options.validator == nullptr) && !blocking) {
+            data = m_arena.pending_read(m_call, captured.size());
+        }
+        if (m_options.validator != nullptr) {
+            m_readback = data;
+        }
+        return data;
+    }
+
+    void* remapped_devices(CallParam* param, std::vector<uintptr_t>& scratch) {
+        auto& ids = call_param_object_use_ids(param);
+        if (!call_param_object_use_multiple(param)) {
+            return m_options.devices->device(m_call, ids[0]);
+        }
+        if (ids.empty()) {
+            return nullptr;
+        }
+        for (auto device : m_options.devices->devices(m_call, ids)) {
+            scratch.push_back(reinterpret_cast<uintptr_t>(device));
+        }
+        return scratch.data();
+    }
+
+    // The platform of context properties was captured as its ID
+    void replay_context_platform(std::vector<uintptr_t>& props) const {
+        if ((m_call.id() != oclapi::command::CREATE_CONTEXT) &&
+            (m_call.id() != oclapi::command::CREATE_CONTEXT_FROM_TYPE)) {
+            return;
+        }
+        for (size_t i = 0; i + 1 < props.size(); i += 2) {
+            if (props[i] != CL_CONTEXT_PLATFORM) {
+                continue;
             }
+            cl_platform_id platform;
+            if (m_options.devices != nullptr) {
+                platform = m_options.devices->context_platform(m_call);
+            } else {
+                platform = object_replay_tracker<cl_platform_id>().get(
+                    static_cast<uint64_t>(props[i + 1]));
+            }
+            props[i + 1] = reinterpret_cast<uintptr_t>(platform);
+            return;
+        }
+    }
 
-            info("returned %d", ret);
-            break;
+    // Set CL_QUEUE_PROFILING_ENABLE in a queue property list, without its
+    // terminator
+    static void enable_queue_profiling(std::vector<uintptr_t>& props) {
+        for (size_t i = 0; i + 1 < props.size(); i += 2) {
+            if (props[i] == CL_QUEUE_PROPERTIES) {
+                props[i + 1] |= CL_QUEUE_PROFILING_ENABLE;
+                return;
+            }
+        }
+        props.push_back(CL_QUEUE_PROPERTIES);
+        props.push_back(CL_QUEUE_PROFILING_ENABLE);
+    }
+
+    const Call& m_call;
+    // Where each parameter is written
+    std::vector<char*> m_memory;
+    // Per-parameter storage for the arrays built at replay time
+    std::vector<std::vector<uintptr_t>> m_scratch;
+    ReplayOptions m_options;
+    cl_event m_profiling_event = nullptr;
+    // Index of the event parameter when the application asked for one
+    size_t m_app_event_index = 0;
+    ReplayMemory& m_arena;
+    // Index of the array parameter the implementation writes to and its
+    // place in the scratch area
+    size_t m_output_array;
+    char* m_output_scratch;
+    // Data read back when validating
+    char* m_readback = nullptr;
+    // Host memory of the memory object created
+    char* m_host = nullptr;
+    bool m_failed = false;
+};
+
+#include "ocltools-replay-gen.hpp"
+
+// Create a program from its replacement source or IL
+static void replay_create_program(ReplayCall& replay, const Call& call,
+                                  const ProgramOverrides::Override& ov) {
+    cl_context context = replay.arg(0);
+    cl_int err;
+    cl_program program;
+    if (!ov.il.empty()) {
+        if (PFN_clCreateProgramWithIL == nullptr) {
+            return replay.unavailable();
+        }
+        program = PFN_clCreateProgramWithIL(context, ov.il.data(),
+                                            ov.il.size(), &err);
+    } else {
+        auto src = ov.source.c_str();
+        program =
+            PFN_clCreateProgramWithSource(context, 1, &src, nullptr, &err);
+    }
+    if (err != CL_SUCCESS) {
+        warn("%s: failed to create overridden program (%d)\n",
+             oclapi::command_name(call.id()), err);
+    }
+    replay.complete(program);
+}
+
+// Build a program with the extra options it is overridden with, through the
+// binary cache when there is one
+static void replay_build_program(ReplayCall& replay, const Call& call,
+                                 const ReplayOptions& options) {
+    if (PFN_clBuildProgram == nullptr) {
+        return replay.unavailable();
+    }
+    cl_program program = replay.arg(0);
+    cl_uint num_devices = replay.arg(1);
+    const cl_device_id* device_list = replay.arg(2);
+    const char* build_options = replay.arg(3);
+    auto id = call_param_object_use_ids(call.params()[0].get())[0];
+    std::string extended;
+    if (options.overrides != nullptr) {
+        auto ov = options.overrides->find(id);
+        if ((ov != nullptr) && !ov->options.empty()) {
+            extended = (build_options != nullptr) ? build_options : "";
+            extended += ov->options;
+            build_options = extended.c_str();
         }
+    }
+    cl_int ret;
+    if (options.program_cache != nullptr) {
+        ret = options.program_cache->build(program, num_devices, device_list,
+                                           build_options);
+        // The program may have been replaced by one created from binaries
+        object_replay_tracker<cl_program>().replace(id, program);
+    } else {
+        ret = PFN_clBuildProgram(program, num_devices, device_list,
+                                 build_options, nullptr, nullptr);
+    }
+    replay.complete(ret);
+}
+
+// Replay a single call, using memory for its outputs. When profiling, returns
+// the event for kernel enqueues, which the caller must release.
+static cl_event replay_call(const Call& call, ReplayMemory& memory,
+                            const ReplayOptions& options) {
+    auto id = call.id();
+
+    if (options.pacer != nullptr) {
+        options.pacer->wait(call);
+    }
+
+    ReplayCall replay(call, memory, options);
+    if ((options.elided != nullptr) && (options.elided->count(&call) != 0)) {
+        debug("Replacing %s with a marker\n", oclapi::command_name(id));
+        replay.elide();
+        return nullptr;
+    }
 
-        case oclapi::command::GET_PLATFORM_INFO: {
+    debug("Replaying %s...\n", oclapi::command_name(id));
+    const ProgramOverrides::Override* ov = nullptr;
+    if ((options.overrides != nullptr) &&
+        ((id == oclapi::command::CREATE_PROGRAM_WITH_SOURCE) ||
+         (id == oclapi::command::CREATE_PROGRAM_WITH_IL))) {
+        auto program = call_param_object_creation_ids(call.retval().get());
+        ov = options.overrides->find(program.at(0));
+    }
+    if ((ov != nullptr) && (!ov->source.empty() || !ov->il.empty())) {
+        replay_create_program(replay, call, *ov);
+    } else if ((id == oclapi::command::BUILD_PROGRAM) &&
+               ((options.program_cache != nullptr) ||
+                (options.overrides != nullptr))) {
+        replay_build_program(replay, call, options);
+    } else {
+        gReplayFunctions[static_cast<uint32_t>(id)](replay);
+    }
+    replay.validate();
+    memory.synchronized(call);
+    return replay.profiling_event();
+}
+
+struct TraceReplayVisitor : TraceVisitor {
+
+    // When profiling, command queues are created with profiling enabled and
+    // an event is requested for every kernel enqueue.
+    TraceReplayVisitor(bool profiling = false) {
+        m_options.profiling = profiling;
+    }
+
+    // Size the scratch area for the largest call up front, calls streamed
+    // from a trace file grow it as they come
+    void preVisit(const Trace& trace) override {
+        for (auto& call : trace.calls()) {
+            m_memory.scratch_for(call);
+        }
+        replay_objects_reserve(trace);
+    }
 
-            ObjectUseReplayHandler<cl_platform_id> p0(params[0], m_memory);
-            ValueReplayHandler<cl_platform_info> p1(params[1], m_memory);
-            ValueReplayHandler<size_t> p2(params[2], m_memory);
-            ValueOutByRefReplayHandler<void> p3(params[3], m_memory);
-            ValueOutByRefReplayHandler<size_t> p4(params[4], m_memory);
+    void visitCall(const Call& call) override {
+        auto event = replay(call);
+        if (event != nullptr) {
+            PFN_clReleaseEvent(event);
+        }
+    }
 
-            auto ret =
-                PFN_clGetPlatformInfo(p0.objects()[0], p1.value(), p2.value(),
-                                      p3.pointer(), p4.pointer());
+    void postVisit() override {
+        // Non-blocking reads and memory objects may still write to the
+        // replay memory
+        finish();
+        m_memory.clear();
+    }
+
+    // Replay a single call. When profiling, returns the event for kernel
+    // enqueues, which the caller must release.
+    cl_event replay(const Call& call) {
+        auto event = replay_call(call, m_memory, m_options);
+        track_queues(call);
+        return event;
+    }
+
+    // Use replacement data for some array parameters, staged must outlive
+    // the replay
+    void use_staged_arrays(const replay_staged_arrays* staged) {
+        m_options.staged = staged;
+    }
+
+    // Build programs through a binary cache, which must outlive the replay
+    void use_program_cache(ProgramBinaryCache* cache) {
+        m_options.program_cache = cache;
+    }
+
+    // Validate the data read back, validator must outlive the replay
+    void use_validator(ReplayValidator* validator) {
+        m_options.validator = validator;
+    }
+
+    // Replay on other devices than the captured ones, devices must outlive
+    // the replay
+    void use_device_map(const ReplayDeviceMap* devices) {
+        m_options.devices = devices;
+    }
+
+    // Pace calls, pacer must outlive the replay
+    void use_pacer(ReplayPacer* pacer) { m_options.pacer = pacer; }
+
+    // Replace programs, overrides must outlive the replay
+    void use_program_overrides(const ProgramOverrides* overrides) {
+        m_options.overrides = overrides;
+    }
+
+    // Skip some enqueues, elided must outlive the replay
+    void use_elided_calls(const replay_elided_calls* elided) {
+        m_options.elided = elided;
+    }
+
+    const ReplayOptions& options() const { return m_options; }
+
+    // Wait for all the commands enqueued so far to complete. Enqueues are
+    // replayed as captured, blocking or not, and only wait where the
+    // application did otherwise.
+    void finish() {
+        for (auto& queue : m_queue_refs) {
+            auto handle =
+                object_replay_tracker<cl_command_queue>().get(queue.first);
+            if (handle != nullptr) {
+                PFN_clFinish(handle);
+            }
+        }
+        m_memory.reads.clear();
+    }
+
+private:
+    // Reference count of the queues alive, by capture ID
+    void track_queues(const Call& call) {
+        switch (call.id()) {
+        case oclapi::command::CREATE_COMMAND_QUEUE:
+        case oclapi::command::CREATE_COMMAND_QUEUE_WITH_PROPERTIES:
+            m_queue_refs[call_param_object_creation_ids(call.retval().get())
+                             .at(0)] = 1;
+            break;
+        case oclapi::command::RETAIN_COMMAND_QUEUE:
+        case oclapi::command::RELEASE_COMMAND_QUEUE: {
+            auto id = call_param_object_use_ids(call.params()[0].get())[0];
+            auto it = m_queue_refs.find(id);
+            if (it == m_queue_refs.end()) {
+                break;
+            }
+            if (call.id() == oclapi::command::RETAIN_COMMAND_QUEUE) {
+                it->second++;
+            } else if (--it->second == 0) {
+                m_queue_refs.erase(it);
+            }
             break;
         }
         default:
-            fatal("NOT SUPPORTED IN REPLAY");
             break;
         }
     }
 
-private:
-    char* m_memory;
+    ReplayOptions m_options;
+    std::unordered_map<uint64_t, int> m_queue_refs;
+    ReplayMemory m_memory;
 };
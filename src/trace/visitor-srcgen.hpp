@@ -14,9 +14,14 @@
 
 #include "visitor.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <cstdarg>
+#include <fstream>
+#include <ostream>
+#include <set>
 #include <sstream>
+#include <unordered_set>
 
 static void __attribute__((noreturn)) unimplemented(const char* fmt, ...) {
     fprintf(stdout, "UNIMPLEMENTED in SRCGEN: ");
@@ -29,6 +34,368 @@ static void __attribute__((noreturn)) unimplemented(const char* fmt, ...) {
     exit(EXIT_FAILURE);
 }
 
+// Builds programs like ProgramBinaryCache when OCLTOOLS_PROGRAM_CACHE names
+// a directory, sharing its cache files
+static const char* kProgramCacheSource = R"(
+static uint64_t ocltools_cache_hash(uint64_t hash, const std::string& part) {
+    // Include the terminator to separate parts
+    for (size_t i = 0; i <= part.size(); i++) {
+        hash ^= static_cast<unsigned char>(part.c_str()[i]);
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static std::string ocltools_program_info(cl_program program,
+                                         cl_program_info info) {
+    size_t size = 0;
+    if ((clGetProgramInfo(program, info, 0, nullptr, &size) != CL_SUCCESS) ||
+        (size == 0)) {
+        return {};
+    }
+    std::string val(size, '\0');
+    if (clGetProgramInfo(program, info, size, &val[0], nullptr) !=
+        CL_SUCCESS) {
+        return {};
+    }
+    return val;
+}
+
+static std::vector<cl_device_id>
+ocltools_program_devices(cl_program program) {
+    auto val = ocltools_program_info(program, CL_PROGRAM_DEVICES);
+    std::vector<cl_device_id> devices(val.size() / sizeof(cl_device_id));
+    val.copy(reinterpret_cast<char*>(devices.data()), val.size());
+    return devices;
+}
+
+static std::string ocltools_device_info(cl_device_id device,
+                                        cl_device_info info) {
+    size_t size = 0;
+    if (clGetDeviceInfo(device, info, 0, nullptr, &size) != CL_SUCCESS) {
+        return {};
+    }
+    std::string val(size, '\0');
+    clGetDeviceInfo(device, info, size, &val[0], nullptr);
+    return val;
+}
+
+static cl_int ocltools_build_program(
+    cl_program* program, cl_uint num_devices, const cl_device_id* device_list,
+    const char* options, void(CL_CALLBACK* pfn_notify)(cl_program, void*),
+    void* user_data) {
+    const char* dir = getenv("OCLTOOLS_PROGRAM_CACHE");
+    cl_uint refs = 0;
+    if (dir != nullptr) {
+        clGetProgramInfo(*program, CL_PROGRAM_REFERENCE_COUNT, sizeof(refs),
+                         &refs, nullptr);
+    }
+    std::vector<cl_device_id> devices;
+    std::string input;
+    if (refs == 1) {
+        if (device_list != nullptr) {
+            devices.assign(device_list, device_list + num_devices);
+        } else {
+            devices = ocltools_program_devices(*program);
+        }
+        input = ocltools_program_info(*program, CL_PROGRAM_SOURCE);
+        if (input.size() <= 1) {
+            input = ocltools_program_info(*program, CL_PROGRAM_IL);
+        }
+    }
+    if (devices.empty() || input.empty()) {
+        return clBuildProgram(*program, num_devices, device_list, options,
+                              pfn_notify, user_data);
+    }
+
+    std::vector<std::string> files;
+    std::vector<std::vector<unsigned char>> binaries;
+    for (auto device : devices) {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        hash = ocltools_cache_hash(hash, input);
+        hash = ocltools_cache_hash(hash, options != nullptr ? options : "");
+        hash = ocltools_cache_hash(
+            hash, ocltools_device_info(device, CL_DEVICE_NAME));
+        hash = ocltools_cache_hash(
+            hash, ocltools_device_info(device, CL_DRIVER_VERSION));
+        char name[32];
+        snprintf(name, sizeof(name), "%016" PRIx64 ".bin", hash);
+        files.push_back(std::string(dir) + "/" + name);
+        std::ifstream is(files.back(), std::ios::binary);
+        if (is.good()) {
+            binaries.emplace_back(std::istreambuf_iterator<char>(is),
+                                  std::istreambuf_iterator<char>());
+        }
+    }
+
+    if (binaries.size() == devices.size()) {
+        cl_context context;
+        clGetProgramInfo(*program, CL_PROGRAM_CONTEXT, sizeof(context),
+                         &context, nullptr);
+        std::vector<size_t> sizes;
+        std::vector<const unsigned char*> data;
+        for (auto& binary : binaries) {
+            sizes.push_back(binary.size());
+            data.push_back(binary.data());
+        }
+        cl_int err;
+        auto cached = clCreateProgramWithBinary(
+            context, devices.size(), devices.data(), sizes.data(), data.data(),
+            nullptr, &err);
+        if (err == CL_SUCCESS) {
+            err = clBuildProgram(cached, devices.size(), devices.data(),
+                                 options, pfn_notify, user_data);
+            if (err == CL_SUCCESS) {
+                clReleaseProgram(*program);
+                *program = cached;
+                return CL_SUCCESS;
+            }
+            clReleaseProgram(cached);
+        }
+    }
+
+    auto err = clBuildProgram(*program, num_devices, device_list, options,
+                              pfn_notify, user_data);
+    if (err != CL_SUCCESS) {
+        return err;
+    }
+    // Binaries are returned in the order of CL_PROGRAM_DEVICES
+    auto program_devices = ocltools_program_devices(*program);
+    std::vector<size_t> sizes(program_devices.size());
+    if (clGetProgramInfo(*program, CL_PROGRAM_BINARY_SIZES,
+                         sizes.size() * sizeof(size_t), sizes.data(),
+                         nullptr) != CL_SUCCESS) {
+        return err;
+    }
+    binaries.clear();
+    std::vector<unsigned char*> data;
+    for (auto size : sizes) {
+        binaries.emplace_back(size);
+        data.push_back(binaries.back().data());
+    }
+    if (clGetProgramInfo(*program, CL_PROGRAM_BINARIES,
+                         data.size() * sizeof(unsigned char*), data.data(),
+                         nullptr) != CL_SUCCESS) {
+        return err;
+    }
+    for (size_t i = 0; i < devices.size(); i++) {
+        for (size_t j = 0; j < program_devices.size(); j++) {
+            if ((program_devices[j] == devices[i]) && !binaries[j].empty()) {
+                auto tmp = files[i] + ".tmp";
+                std::ofstream os(tmp, std::ios::binary);
+                os.write(reinterpret_cast<const char*>(binaries[j].data()),
+                         binaries[j].size());
+                os.close();
+                if (!os.good() || (rename(tmp.c_str(), files[i].c_str()))) {
+                    remove(tmp.c_str());
+                }
+            }
+        }
+    }
+    return err;
+}
+)";
+
+static const char* kIncludesSource = R"(
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <CL/cl.h>
+)";
+
+// Maps the payload file holding the data of the calls. The mapping is
+// private and writable, as calls also read data back into it.
+static const char* kPayloadSource = R"(
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+char* ocltools_payload = nullptr;
+
+static void ocltools_map_payload(const char* path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if ((fd < 0) || (fstat(fd, &st) != 0)) {
+        fprintf(stderr, "Can't open payload '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (st.st_size != 0) {
+        void* data = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "Can't map payload '%s'\n", path);
+            exit(EXIT_FAILURE);
+        }
+        ocltools_payload = static_cast<char*>(data);
+    }
+    close(fd);
+}
+)";
+
+// Timing of the ranges of calls selected with generate-source --bench. The
+// calls of a range are run for a number of iterations, that the
+// OCLTOOLS_BENCH_ITERATIONS environment variable overrides, and the host
+// time of each iteration is measured until its kernels have completed.
+// Kernels are timed on the device from their profiling information and on
+// the host for their enqueue.
+static const char* kBenchSource = R"src(
+#include <algorithm>
+#include <chrono>
+#include <map>
+
+struct ocltools_bench_times {
+    std::vector<double> device; // Microseconds
+    std::vector<double> host;
+};
+
+static std::map<std::string, ocltools_bench_times> ocltools_bench_kernels;
+static std::vector<std::pair<std::string, cl_event>> ocltools_bench_events;
+static std::vector<double> ocltools_bench_iteration_times;
+static std::chrono::steady_clock::time_point ocltools_bench_start;
+static std::chrono::steady_clock::time_point ocltools_bench_enqueue_start;
+
+static double ocltools_bench_us(std::chrono::steady_clock::time_point since) {
+    std::chrono::duration<double, std::micro> time =
+        std::chrono::steady_clock::now() - since;
+    return time.count();
+}
+
+static int ocltools_bench_iterations(int iterations) {
+    const char* env = getenv("OCLTOOLS_BENCH_ITERATIONS");
+    if (env != nullptr) {
+        iterations = atoi(env);
+    }
+    // The calls that follow a range use the objects it creates
+    return std::max(iterations, 1);
+}
+
+static void ocltools_bench_begin() {
+    ocltools_bench_start = std::chrono::steady_clock::now();
+}
+
+static void ocltools_bench_enqueue_begin() {
+    ocltools_bench_enqueue_start = std::chrono::steady_clock::now();
+}
+
+// Events the application didn't ask for belong to the benchmark, which
+// releases them once it has read their profiling information
+static void ocltools_bench_enqueue_end(cl_kernel kernel, cl_event event,
+                                       bool owned) {
+    double host = ocltools_bench_us(ocltools_bench_enqueue_start);
+    size_t size = 0;
+    clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, 0, nullptr, &size);
+    std::vector<char> chars(size + 1);
+    clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, size, chars.data(),
+                    nullptr);
+    std::string name(chars.data());
+    ocltools_bench_kernels[name].host.push_back(host);
+    if (event != nullptr) {
+        if (!owned) {
+            clRetainEvent(event);
+        }
+        ocltools_bench_events.push_back({name, event});
+    }
+}
+
+static void ocltools_bench_end() {
+    for (auto& kev : ocltools_bench_events) {
+        cl_ulong start, end;
+        clWaitForEvents(1, &kev.second);
+        if ((clGetEventProfilingInfo(kev.second, CL_PROFILING_COMMAND_START,
+                                     sizeof(start), &start,
+                                     nullptr) == CL_SUCCESS) &&
+            (clGetEventProfilingInfo(kev.second, CL_PROFILING_COMMAND_END,
+                                     sizeof(end), &end,
+                                     nullptr) == CL_SUCCESS)) {
+            ocltools_bench_kernels[kev.first].device.push_back((end - start) /
+                                                               1000.0);
+        }
+        clReleaseEvent(kev.second);
+    }
+    ocltools_bench_events.clear();
+    ocltools_bench_iteration_times.push_back(
+        ocltools_bench_us(ocltools_bench_start));
+}
+
+static void ocltools_bench_print(const std::string& name,
+                                 std::vector<double>& times) {
+    if (times.empty()) {
+        return;
+    }
+    std::sort(times.begin(), times.end());
+    double sum = 0.0;
+    for (auto time : times) {
+        sum += time;
+    }
+    printf("%-40s %8zu %12.2f %12.2f %12.2f %12.2f\n", name.c_str(),
+           times.size(), times.front(), times[times.size() / 2],
+           sum / times.size(), times.back());
+}
+
+static void ocltools_bench_report(const char* range) {
+    printf("%s, %zu iterations\n", range,
+           ocltools_bench_iteration_times.size());
+    printf("%-40s %8s %12s %12s %12s %12s\n", "time (us)", "count", "min",
+           "median", "mean", "max");
+    ocltools_bench_print("iteration (host)", ocltools_bench_iteration_times);
+    for (auto& kernel : ocltools_bench_kernels) {
+        ocltools_bench_print(kernel.first + " (device)", kernel.second.device);
+        ocltools_bench_print(kernel.first + " (host)", kernel.second.host);
+    }
+    ocltools_bench_iteration_times.clear();
+    ocltools_bench_kernels.clear();
+}
+)src";
+
+// Range of calls to benchmark in the generated source, by call number or by
+// frame, a frame ending with a call to clFinish
+struct SourceBenchRange {
+    bool frames = false;
+    size_t from = 0;
+    size_t to = 0; // Excluded
+
+    // [frame:]<from>[:<to>], a single call or frame when <to> is omitted
+    static bool parse(const std::string& spec, SourceBenchRange& range) {
+        range = {};
+        static const std::string prefix = "frame:";
+        auto value = spec.c_str();
+        if (spec.compare(0, prefix.size(), prefix) == 0) {
+            range.frames = true;
+            value += prefix.size();
+        }
+        char* end;
+        range.from = strtoull(value, &end, 10);
+        if (end == value) {
+            return false;
+        }
+        if (*end == '\0') {
+            range.to = range.from + 1;
+            return true;
+        }
+        if (*end != ':') {
+            return false;
+        }
+        value = end + 1;
+        range.to = strtoull(value, &end, 10);
+        return (end != value) && (*end == '\0') && (range.to > range.from);
+    }
+
+    std::string name() const {
+        std::string kind = frames ? "frame" : "call";
+        if (to == from + 1) {
+            return kind + " " + std::to_string(from);
+        }
+        return kind + "s " + std::to_string(from) + " to " +
+               std::to_string(to - 1);
+    }
+};
+
 std::string call_param_value_print(CallParam* param) {
     auto ptype = param->type();
     auto ttype = param->ttype();
@@ -55,123 +422,6 @@ std::string call_param_value_print(CallParam* param) {
     unimplemented("call_param_value_print");
 }
 
-const std::vector<uint64_t>& call_param_object_use_ids(CallParam* param) {
-    auto ptype = param->type();
-    auto ttype = param->ttype();
-    assert(ptype = CALL_PARAM_OBJECT_USE);
-    switch (ttype) {
-    case CALL_PARAM_TEMPLATE_TYPE_CL_PLATFORM_ID:
-        return static_cast<CallParamObjectUse<cl_platform_id>*>(param)
-            ->object_ids();
-    case CALL_PARAM_TEMPLATE_TYPE_CL_DEVICE_ID:
-        return static_cast<CallParamObjectUse<cl_device_id>*>(param)
-            ->object_ids();
-    case CALL_PARAM_TEMPLATE_TYPE_CL_CONTEXT:
-        return static_cast<CallParamObjectUse<cl_context>*>(param)
-            ->object_ids();
-    case CALL_PARAM_TEMPLATE_TYPE_CL_PROGRAM:
-        return static_cast<CallParamObjectUse<cl_program>*>(param)
-            ->object_ids();
-    case CALL_PARAM_TEMPLATE_TYPE_CL_KERNEL:
-        return static_cast<CallParamObjectUse<cl_kernel>*>(param)->object_ids();
-    case CALL_PARAM_TEMPLATE_TYPE_CL_MEM:
-        return static_cast<CallParamObjectUse<cl_mem>*>(param)->object_ids();
-    case CALL_PARAM_TEMPLATE_TYPE_CL_EVENT:
-        return static_cast<CallParamObjectUse<cl_event>*>(param)->object_ids();
-    case CALL_PARAM_TEMPLATE_TYPE_CL_COMMANDQUEUE:
-        return static_cast<CallParamObjectUse<cl_command_queue>*>(param)
-            ->object_ids();
-    }
-
-    unimplemented("call_param_object_use_ids");
-}
-
-bool call_param_object_use_multiple(CallParam* param) {
-    auto ptype = param->type();
-    auto ttype = param->ttype();
-    assert(ptype = CALL_PARAM_OBJECT_USE);
-    switch (ttype) {
-    case CALL_PARAM_TEMPLATE_TYPE_CL_PLATFORM_ID:
-        return static_cast<CallParamObjectUse<cl_platform_id>*>(param)
-            ->multiple();
-    case CALL_PARAM_TEMPLATE_TYPE_CL_DEVICE_ID:
-        return static_cast<CallParamObjectUse<cl_device_id>*>(param)
-            ->multiple();
-    case CALL_PARAM_TEMPLATE_TYPE_CL_CONTEXT:
-        return static_cast<CallParamObjectUse<cl_context>*>(param)->multiple();
-    case CALL_PARAM_TEMPLATE_TYPE_CL_PROGRAM:
-        return static_cast<CallParamObjectUse<cl_program>*>(param)->multiple();
-    case CALL_PARAM_TEMPLATE_TYPE_CL_KERNEL:
-        return static_cast<CallParamObjectUse<cl_kernel>*>(param)->multiple();
-    case CALL_PARAM_TEMPLATE_TYPE_CL_MEM:
-        return static_cast<CallParamObjectUse<cl_mem>*>(param)->multiple();
-    case CALL_PARAM_TEMPLATE_TYPE_CL_EVENT:
-        return static_cast<CallParamObjectUse<cl_event>*>(param)->multiple();
-    case CALL_PARAM_TEMPLATE_TYPE_CL_COMMANDQUEUE:
-        return static_cast<CallParamObjectUse<cl_command_queue>*>(param)
-            ->multiple();
-    }
-
-    unimplemented("call_param_object_use_multiple");
-}
-
-const std::vector<uint64_t> call_param_object_creation_ids(CallParam* param) {
-    auto ptype = param->type();
-    auto ttype = param->ttype();
-    assert(ptype = CALL_PARAM_OPTIONAL_OBJECT_CREATION);
-    switch (ttype) {
-    case CALL_PARAM_TEMPLATE_TYPE_CL_PLATFORM_ID:
-        return static_cast<CallParamOptionalObjectCreation<cl_platform_id>*>(
-                   param)
-            ->object_ids();
-    case CALL_PARAM_TEMPLATE_TYPE_CL_DEVICE_ID:
-        return static_cast<CallParamOptionalObjectCreation<cl_device_id>*>(
-                   param)
-            ->object_ids();
-    case CALL_PARAM_TEMPLATE_TYPE_CL_CONTEXT:
-        return static_cast<CallParamOptionalObjectCreation<cl_context>*>(param)
-            ->object_ids();
-    case CALL_PARAM_TEMPLATE_TYPE_CL_COMMANDQUEUE:
-        return static_cast<CallParamOptionalObjectCreation<cl_command_queue>*>(
-                   param)
-            ->object_ids();
-    case CALL_PARAM_TEMPLATE_TYPE_CL_PROGRAM:
-        return static_cast<CallParamOptionalObjectCreation<cl_program>*>(param)
-            ->object_ids();
-    case CALL_PARAM_TEMPLATE_TYPE_CL_KERNEL:
-        return static_cast<CallParamOptionalObjectCreation<cl_kernel>*>(param)
-            ->object_ids();
-    case CALL_PARAM_TEMPLATE_TYPE_CL_MEM:
-        return static_cast<CallParamOptionalObjectCreation<cl_mem>*>(param)
-            ->object_ids();
-    case CALL_PARAM_TEMPLATE_TYPE_CL_EVENT:
-        return static_cast<CallParamOptionalObjectCreation<cl_event>*>(param)
-            ->object_ids();
-    }
-
-    unimplemented("call_param_object_creation_ids");
-}
-
-bool call_param_array_null_pointer(CallParam* param) {
-    auto ptype = param->type();
-    auto ttype = param->ttype();
-    assert(ptype = CALL_PARAM_ARRAY);
-    switch (ttype) {
-    case CALL_PARAM_TEMPLATE_TYPE_CL_ULONG:
-        return static_cast<CallParamArray<cl_ulong>*>(param)->null_pointer();
-    case CALL_PARAM_TEMPLATE_TYPE_CHAR:
-        return static_cast<CallParamArray<char>*>(param)->null_pointer();
-    case CALL_PARAM_TEMPLATE_TYPE_CL_IMAGE_FORMAT:
-        return static_cast<CallParamArray<cl_image_format>*>(param)
-            ->null_pointer();
-    case CALL_PARAM_TEMPLATE_TYPE_CL_IMAGE_DESC:
-        return static_cast<CallParamArray<cl_image_desc>*>(param)
-            ->null_pointer();
-    }
-
-    unimplemented("call_param_array_null, ttype = %u", ttype);
-}
-
 std::string call_param_array_initialiser(CallParam* param) {
     auto ptype = param->type();
     auto ttype = param->ttype();
@@ -267,6 +517,19 @@ private:
         return ret;
     }
 
+    // Element type of the property lists taken by a function
+    static const char* propertyListType(oclapi::command cmd) {
+        switch (cmd) {
+        case oclapi::command::CREATE_COMMAND_QUEUE_WITH_PROPERTIES:
+            return "cl_queue_properties";
+        case oclapi::command::CREATE_SAMPLER_WITH_PROPERTIES:
+            return "cl_sampler_properties";
+        default:
+            return call_param_template_type_name(
+                CALL_PARAM_TEMPLATE_TYPE_INTPTR_T);
+        }
+    }
+
     using object_variables_tracker =
         std::unordered_map<uint64_t, std::pair<uint32_t, uint32_t>>;
 
@@ -289,6 +552,8 @@ private:
             return m_mem_object_variables;
         case CALL_PARAM_TEMPLATE_TYPE_CL_EVENT:
             return m_event_object_variables;
+        case CALL_PARAM_TEMPLATE_TYPE_CL_SAMPLER:
+            return m_sampler_object_variables;
         }
         unimplemented("object variable tracker selection");
     }
@@ -301,28 +566,424 @@ private:
         for (auto id : object_ids) {
             vtracker[id] = std::make_pair(m_object_creation_num, object_cnt++);
         }
+        if (object_ids.size() > 1) {
+            m_object_vectors.insert(m_object_creation_num);
+        }
         m_object_creation_num++;
         return varname;
     }
 
+    // Expression for the variable holding an object
+    std::string objectVariable(CallParamTemplateType ttype, uint64_t id) {
+        auto creation = selectObjectVariableTracker(ttype).at(id);
+        auto var = makeObjectCreationVarName(ttype, creation.first);
+        if (m_object_vectors.count(creation.first) != 0) {
+            var += "[" + std::to_string(creation.second) + "]";
+        }
+        return var;
+    }
+
+    // Value of a property, context properties refer to their platform by
+    // capture ID
+    std::string propertyValue(const Call& call,
+                              const std::vector<intptr_t>& props,
+                              size_t index) {
+        bool context_platform =
+            ((call.id() == oclapi::command::CREATE_CONTEXT) ||
+             (call.id() == oclapi::command::CREATE_CONTEXT_FROM_TYPE)) &&
+            (index % 2 == 1) && (props[index - 1] == CL_CONTEXT_PLATFORM);
+        if (!context_platform) {
+            return std::to_string(props[index]);
+        }
+        auto id = static_cast<uint64_t>(props[index]);
+        if (id == static_cast<uint64_t>(-1)) {
+            return "0";
+        }
+        return "reinterpret_cast<cl_context_properties>(" +
+               objectVariable(CALL_PARAM_TEMPLATE_TYPE_CL_PLATFORM_ID, id) +
+               ")";
+    }
+
+    bool inPayload(CallParam* param) const {
+        if ((m_payload == nullptr) ||
+            (param->ttype() != CALL_PARAM_TEMPLATE_TYPE_CHAR)) {
+            return false;
+        }
+        auto p = static_cast<CallParamArray<char>*>(param);
+        return p->values().size() > kPayloadMinSize;
+    }
+
+    // Append the data of an array to the payload, aligned, and return the
+    // expression pointing to it in the generated program
+    std::string writePayload(CallParam* param) {
+        static const char padding[kPayloadAlignment] = {};
+        auto& values = static_cast<CallParamArray<char>*>(param)->values();
+        auto offset = (m_payload_size + kPayloadAlignment - 1) &
+                      ~static_cast<uint64_t>(kPayloadAlignment - 1);
+        m_payload->write(padding, offset - m_payload_size);
+        m_payload->write(values.data(), values.size());
+        m_payload_size = offset + values.size();
+        return "(ocltools_payload + " + std::to_string(offset) + ")";
+    }
+
+    static constexpr size_t kPayloadMinSize = 64;
+    static constexpr size_t kPayloadAlignment = 64;
+
+    // Whether the implementation may use the host memory an array points to
+    // after the call returns: the memory of CL_MEM_USE_HOST_PTR objects and
+    // the data of non-blocking transfers
+    static bool hostArrayOutlivesCall(const Call& call) {
+        auto& params = call.params();
+        switch (call.id()) {
+        case oclapi::command::CREATE_BUFFER:
+        case oclapi::command::CREATE_IMAGE:
+            return (call_param_value_as<cl_mem_flags>(params[1].get()) &
+                    CL_MEM_USE_HOST_PTR) != 0;
+        case oclapi::command::ENQUEUE_READ_BUFFER:
+        case oclapi::command::ENQUEUE_READ_BUFFER_RECT:
+        case oclapi::command::ENQUEUE_READ_IMAGE:
+        case oclapi::command::ENQUEUE_WRITE_BUFFER:
+        case oclapi::command::ENQUEUE_WRITE_BUFFER_RECT:
+        case oclapi::command::ENQUEUE_WRITE_IMAGE:
+            return !call_param_value_as<cl_bool>(params[2].get());
+        default:
+            return false;
+        }
+    }
+
+    // Declare the host memory of an array that outlives its call, global
+    // when the program is split as functions return before it is used, and
+    // outside the loop of a benchmark as iterations end before it is used
+    void declareHostArray(const std::string& type, const std::string& name,
+                          const std::string& init) {
+        if (m_split) {
+            m_globals.push_back({type + " " + name, init});
+        } else if (m_bench_open) {
+            m_bench_decls << type << " " << name << init << ";" << '\n';
+        } else {
+            m_src << type << " " << name << init << ";" << '\n';
+        }
+    }
+
+    // Declare a variable for objects created by a call, local to main() or
+    // global when the program is split
+    void declareObject(const std::string& type, const std::string& name,
+                       const std::string& init = "") {
+        if (m_split) {
+            m_globals.push_back({type + " " + name, init});
+        } else if (m_bench_open) {
+            m_bench_decls << type << " " << name << init << ";" << '\n';
+        } else {
+            m_src << type << " " << name << init << ";" << '\n';
+        }
+    }
+
+    // Start the assignment of the value returned by a call to a new object
+    // variable
+    void assignObject(const std::string& type, const std::string& name) {
+        if (m_split) {
+            m_globals.push_back({type + " " + name, ""});
+        } else if (m_bench_open) {
+            m_bench_decls << type << " " << name << ";" << '\n';
+        } else {
+            m_src << type << " ";
+        }
+        m_src << name << " = ";
+    }
+
+    // Set CL_QUEUE_PROFILING_ENABLE in a queue property list, without its
+    // terminator
+    static void enableQueueProfiling(std::vector<intptr_t>& props) {
+        for (size_t i = 0; i + 1 < props.size(); i += 2) {
+            if (props[i] == CL_QUEUE_PROPERTIES) {
+                props[i + 1] |= CL_QUEUE_PROFILING_ENABLE;
+                return;
+            }
+        }
+        props.push_back(CL_QUEUE_PROPERTIES);
+        props.push_back(CL_QUEUE_PROFILING_ENABLE);
+    }
+
+    size_t benchPosition(const SourceBenchRange& range) const {
+        return range.frames ? m_frame_num : m_call_num;
+    }
+
+    // Start buffering the calls of the next range when it starts with the
+    // call about to be visited, to declare the objects they create before
+    // the loop that runs them
+    void benchStart() {
+        while (!m_bench_open && (m_bench_next < m_bench_ranges.size())) {
+            auto& range = m_bench_ranges[m_bench_next];
+            auto pos = benchPosition(range);
+            if (pos < range.from) {
+                return;
+            }
+            if (pos >= range.to) {
+                warn("Can't benchmark %s\n", range.name().c_str());
+                m_bench_next++;
+                continue;
+            }
+            m_bench_open = true;
+            m_bench_live = m_live;
+            m_bench_queues.clear();
+            m_bench_decls.str("");
+            m_bench_body.str("");
+            m_bench_stream = m_src.rdbuf(&m_bench_body);
+        }
+    }
+
+    // Write the loop running the calls of the current range when it ends
+    // with the call just visited, or at the end of the trace
+    void benchEnd(bool last) {
+        if (!m_bench_open) {
+            return;
+        }
+        auto range = m_bench_ranges[m_bench_next];
+        if (!last && (benchPosition(range) < range.to)) {
+            return;
+        }
+        // The trace may end before the range, in a frame without clFinish
+        range.to = std::min(range.to,
+                            benchPosition(range) + (range.frames ? 1 : 0));
+        m_src.rdbuf(m_bench_stream);
+        m_bench_open = false;
+        m_bench_next++;
+        auto name = range.name();
+        // The range must leave the objects that exist before it as it found
+        // them to run more than once, it is otherwise timed once
+        bool repeat = true;
+        size_t leaked = m_live.size();
+        for (auto& obj : m_bench_live) {
+            auto it = m_live.find(obj.first);
+            if ((it == m_live.end()) || (it->second < obj.second)) {
+                repeat = false;
+            } else if (it->second == obj.second) {
+                leaked--;
+            }
+        }
+        if (!repeat) {
+            warn("Can't benchmark %s repeatedly, it releases objects created "
+                 "before it\n",
+                 name.c_str());
+        } else if (leaked != 0) {
+            warn("Benchmark of %s leaks %zu objects every iteration\n",
+                 name.c_str(), leaked);
+        }
+        m_src << '\n'
+              << "// Benchmark of " << name << '\n'
+              << m_bench_decls.str();
+        if (repeat) {
+            m_src << "for (int ocltools_iter = 0, ocltools_iters = "
+                     "ocltools_bench_iterations("
+                  << m_bench_iterations
+                  << "); ocltools_iter < ocltools_iters; ocltools_iter++) {"
+                  << '\n';
+        } else {
+            m_src << "{" << '\n';
+        }
+        m_src << "ocltools_bench_begin();" << '\n' << m_bench_body.str();
+        // Transfers may still use host memory, iterations end with all the
+        // commands of the range complete
+        auto qtype = CALL_PARAM_TEMPLATE_TYPE_CL_COMMANDQUEUE;
+        for (auto queue : m_bench_queues) {
+            if (m_live.count({qtype, queue}) != 0) {
+                m_src << "clFinish(" << objectVariable(qtype, queue) << ");"
+                      << '\n';
+            }
+        }
+        m_src << "ocltools_bench_end();" << '\n'
+              << "}" << '\n'
+              << "ocltools_bench_report(\"" << name << "\");" << '\n';
+    }
+
+    std::string filePath(const std::string& name) const {
+        return m_dir + "/" + name;
+    }
+
+    bool openFile(const std::string& name) {
+        m_file_buf.close();
+        m_file.clear();
+        if (m_file_buf.open(filePath(name), std::ios::out) == nullptr) {
+            error("Can't open '%s'\n", filePath(name).c_str());
+            m_failed = true;
+            m_file.setstate(std::ios::badbit);
+            return false;
+        }
+        m_file.rdbuf(&m_file_buf);
+        return true;
+    }
+
+    void closeFile(const std::string& name) {
+        m_file.flush();
+        if (!m_file.good() || (m_file_buf.close() == nullptr)) {
+            error("Can't write '%s'\n", filePath(name).c_str());
+            m_failed = true;
+        }
+    }
+
+    std::string functionName(size_t num) const {
+        return "ocltools_calls_" + std::to_string(num);
+    }
+
+    std::string fileName(size_t num) const {
+        return "calls-" + std::to_string(num) + ".cpp";
+    }
+
+    void startFile() {
+        if (m_num_files != 0) {
+            finishFile();
+        }
+        openFile(fileName(m_num_files));
+        m_file << "#include \"" << kProjectHeader << "\"" << '\n'
+               << '\n'
+               << "void " << functionName(m_num_files) << "() {" << '\n';
+        m_num_files++;
+    }
+
+    void finishFile() {
+        if (m_num_files == 0) {
+            return;
+        }
+        m_file << '\n' << "}" << '\n';
+        closeFile(fileName(m_num_files - 1));
+    }
+
+    // Write the header shared by the sources, main() and the CMake project
+    void writeProject() {
+        if (openFile(kProjectHeader)) {
+            m_file << "#pragma once" << '\n' << kIncludesSource;
+            m_file << kProgramCacheSource << '\n';
+            if (m_payload != nullptr) {
+                m_file << "extern char* ocltools_payload;" << '\n';
+            }
+            for (auto& global : m_globals) {
+                m_file << "extern " << global.first << ";" << '\n';
+            }
+            m_file << '\n';
+            for (size_t i = 0; i < m_num_files; i++) {
+                m_file << "void " << functionName(i) << "();" << '\n';
+            }
+            closeFile(kProjectHeader);
+        }
+
+        if (openFile("main.cpp")) {
+            m_file << "#include \"" << kProjectHeader << "\"" << '\n';
+            if (m_payload != nullptr) {
+                m_file << kPayloadSource;
+            }
+            m_file << '\n';
+            for (auto& global : m_globals) {
+                m_file << global.first << global.second << ";" << '\n';
+            }
+            m_file << '\n' << "int main(int argc, char* argv[]) {" << '\n';
+            if (m_payload != nullptr) {
+                m_file << "ocltools_map_payload(argc > 1 ? argv[1] : \""
+                       << m_payload_path << "\");" << '\n';
+            }
+            for (size_t i = 0; i < m_num_files; i++) {
+                m_file << functionName(i) << "();" << '\n';
+            }
+            m_file << "}" << '\n';
+            closeFile("main.cpp");
+        }
+
+        if (openFile("CMakeLists.txt")) {
+            m_file << "cmake_minimum_required(VERSION 3.10)" << '\n'
+                   << "project(ocltools-repro CXX)" << '\n'
+                   << "set(CMAKE_CXX_STANDARD 17)" << '\n'
+                   << "find_package(OpenCL REQUIRED)" << '\n'
+                   << "add_executable(repro main.cpp";
+            for (size_t i = 0; i < m_num_files; i++) {
+                m_file << '\n' << "    " << fileName(i);
+            }
+            m_file << ")" << '\n'
+                   << "target_compile_definitions(repro PRIVATE "
+                      "CL_TARGET_OPENCL_VERSION=300)"
+                   << '\n'
+                   << "target_link_libraries(repro OpenCL::OpenCL)" << '\n';
+            closeFile("CMakeLists.txt");
+        }
+    }
+
+    static constexpr const char* kProjectHeader = "ocltools-repro.hpp";
+
 public:
-    TraceSourceGenerationVisitor() : m_call_num(0), m_object_creation_num(0) {}
+    // The source is written to os as calls are visited
+    TraceSourceGenerationVisitor(std::ostream& os)
+        : m_call_num(0), m_object_creation_num(0), m_src(os) {}
 
-    const std::string source() const { return m_src.str(); }
+    // Write a CMake project to dir instead, with the calls split into
+    // functions of calls_per_file calls, each in its own source file, so
+    // that the program can be built in parallel. Objects are global.
+    TraceSourceGenerationVisitor(const std::string& dir, size_t calls_per_file)
+        : m_call_num(0), m_object_creation_num(0), m_src(m_file),
+          m_split(true), m_dir(dir), m_calls_per_file(calls_per_file) {}
 
-    void preVisit(const Trace& trace) override {
-        m_src << R"(
-#include <vector>
+    // Write the data arrays of more than kPayloadMinSize bytes to os rather
+    // than initialize them in the source. The generated program maps the
+    // payload from the path given as its first argument, path by default.
+    void use_payload(std::ostream& os, const std::string& path) {
+        m_payload = &os;
+        m_payload_path = path;
+    }
 
-#include <CL/cl.h>
+    // Run the calls of the ranges for iterations each and time them.
+    // Command queues are all created with profiling enabled. The ranges are
+    // all of calls or all of frames and don't overlap.
+    bool use_bench(const std::vector<SourceBenchRange>& ranges,
+                   unsigned iterations) {
+        m_bench_ranges = ranges;
+        std::sort(m_bench_ranges.begin(), m_bench_ranges.end(),
+                  [](const SourceBenchRange& a, const SourceBenchRange& b) {
+                      return a.from < b.from;
+                  });
+        for (size_t i = 0; i < m_bench_ranges.size(); i++) {
+            auto& range = m_bench_ranges[i];
+            if (range.frames != m_bench_ranges[0].frames) {
+                error("Benchmark ranges must all be of calls or of frames\n");
+                return false;
+            }
+            if ((i > 0) && (m_bench_ranges[i - 1].to > range.from)) {
+                error("Benchmark ranges %s and %s overlap\n",
+                      m_bench_ranges[i - 1].name().c_str(),
+                      range.name().c_str());
+                return false;
+            }
+        }
+        m_bench_iterations = iterations;
+        return true;
+    }
 
+    void preVisit(const Trace& trace) override {
+        if (m_split) {
+            return;
+        }
+        m_src << kIncludesSource;
+        m_src << kProgramCacheSource;
+        if (m_payload != nullptr) {
+            m_src << kPayloadSource;
+        }
+        if (!m_bench_ranges.empty()) {
+            m_src << kBenchSource;
+        }
+        m_src << R"(
 int main(int argc, char* argv[]) {
 )";
+        if (m_payload != nullptr) {
+            m_src << "ocltools_map_payload(argc > 1 ? argv[1] : \""
+                  << m_payload_path << "\");" << '\n';
+        }
     }
 
     void visitCall(const Call& call) override {
-        m_src << std::endl << "// Call " << m_call_num << std::endl;
+        if (m_split && (m_call_num % m_calls_per_file == 0)) {
+            startFile();
+        }
+        benchStart();
+        m_src << '\n' << "// Call " << m_call_num << '\n';
         std::vector<std::string> call_var_values;
+        std::string event_var;
+        bool event_owned = false;
         // Declare variables for output parameters and object creation
         int param_num = 0;
         for (auto& par : call.params()) {
@@ -334,19 +995,29 @@ int main(int argc, char* argv[]) {
                 auto object_ids = call_param_object_creation_ids(param);
                 auto varname = handleObjectCreation(ttype, object_ids);
                 if (object_ids.size() > 1) {
-                    m_src << makeVectorType(ttype) << " " << varname << "("
-                          << object_ids.size() << ");" << std::endl;
+                    declareObject(makeVectorType(ttype), varname,
+                                  "(" + std::to_string(object_ids.size()) +
+                                      ")");
                     pstr = varname + ".data()";
                 } else {
-                    m_src << call_param_template_type_name(ttype) << " "
-                          << varname << ";" << std::endl;
+                    declareObject(call_param_template_type_name(ttype),
+                                  varname);
                     pstr = "&" + varname;
+                    if (ttype == CALL_PARAM_TEMPLATE_TYPE_CL_EVENT) {
+                        event_var = varname;
+                        event_owned = !call_param_object_creation_create(param);
+                    }
                 }
             } else if (ptype == CALL_PARAM_VALUE) {
                 pstr = makeCallParamVarName(param_num);
                 m_src << call_param_template_type_name(ttype) << " " << pstr
-                      << " = " << call_param_value_print(param) << ";"
-                      << std::endl;
+                      << " = " << call_param_value_print(param);
+                if (!m_bench_ranges.empty() &&
+                    (call.id() == oclapi::command::CREATE_COMMAND_QUEUE) &&
+                    (param_num == 2)) {
+                    m_src << " | CL_QUEUE_PROFILING_ENABLE";
+                }
+                m_src << ";" << '\n';
             } else if (ptype == CALL_PARAM_OBJECT_USE) {
 
                 auto obj_type_name = call_param_template_type_name(ttype);
@@ -358,7 +1029,7 @@ int main(int argc, char* argv[]) {
                         // Declare vector to serve as input parameter
                         auto pvar = makeCallParamVarName(param_num);
                         m_src << makeVectorType(ttype) << " " << pvar << ";"
-                              << std::endl;
+                              << '\n';
 
                         // Assign objects to vector
                         uint32_t objcnt = 0;
@@ -371,7 +1042,7 @@ int main(int argc, char* argv[]) {
                                         std::to_string(creation_index.second) +
                                         "]";
                             m_src << pvar << "[" << objcnt << "] = " << cval
-                                  << ";" << std::endl;
+                                  << ";" << '\n';
                         }
                         // Prepare parameter
                         pstr = pvar + ".data()";
@@ -383,7 +1054,7 @@ int main(int argc, char* argv[]) {
                         auto cvar = makeObjectCreationVarName(
                             ttype, creation_index.first);
                         m_src << obj_type_name << " " << pvar << " = " << cvar
-                              << ";" << std::endl;
+                              << ";" << '\n';
                         pstr = "&" + pvar;
                     } else {
                         pstr = "nullptr";
@@ -401,7 +1072,7 @@ int main(int argc, char* argv[]) {
                         auto cvar = makeObjectCreationVarName(
                             ttype, creation_index.first);
                         m_src << obj_type_name << " " << pvar << " = " << cvar
-                              << ";" << std::endl;
+                              << ";" << '\n';
                         pstr = pvar;
                     }
                 }
@@ -412,29 +1083,34 @@ int main(int argc, char* argv[]) {
                 if (ttype == CALL_PARAM_TEMPLATE_TYPE_VOID) {
                     auto p = static_cast<CallParamValueOutByRef<void>*>(param);
                     m_src << "std::vector<char> " << varname << "("
-                          << p->output_memory_requirements() << ");"
-                          << std::endl;
+                          << p->output_memory_requirements() << ");" << '\n';
                     pstr = varname + ".data()";
                 } else {
                     m_src << call_param_template_type_name(ttype) << " "
-                          << varname << ";" << std::endl;
+                          << varname << ";" << '\n';
                     pstr = "&" + varname;
                 }
             } else if (ptype == CALL_PARAM_PROPERTIES) {
                 auto varname = makeCallParamVarName(param_num);
                 auto pcasted = static_cast<CallParamProperties*>(param);
                 auto props = pcasted->properties();
-                if (pcasted->has_list()) {
-                    auto vectype =
-                        makeVectorType(CALL_PARAM_TEMPLATE_TYPE_INTPTR_T);
-                    m_src << vectype << " " << varname << " = {";
+                auto has_list = pcasted->has_list();
+                if (!m_bench_ranges.empty() &&
+                    (call.id() ==
+                     oclapi::command::CREATE_COMMAND_QUEUE_WITH_PROPERTIES)) {
+                    enableQueueProfiling(props);
+                    has_list = true;
+                }
+                if (has_list) {
+                    m_src << "std::vector<" << propertyListType(call.id())
+                          << "> " << varname << " = {";
                     std::string sep;
-                    for (auto prop : props) {
-                        m_src << sep << prop;
+                    for (size_t i = 0; i < props.size(); i++) {
+                        m_src << sep << propertyValue(call, props, i);
                         sep = ", ";
                     }
                     m_src << sep << "0";
-                    m_src << "};" << std::endl;
+                    m_src << "};" << '\n';
 
                     pstr = varname + ".data()";
                 } else {
@@ -449,8 +1125,7 @@ int main(int argc, char* argv[]) {
                     m_src << obj_type_name << " " << pvar << " = "
                           << "nullptr"
                           << ";";
-                    m_src << " // UNIMPLEMENTED: CALL_PARAM_CALLBACK"
-                          << std::endl;
+                    m_src << " // UNIMPLEMENTED: CALL_PARAM_CALLBACK" << '\n';
                     pstr = pvar;
                 } else {
                     pstr = "nullptr";
@@ -465,7 +1140,7 @@ int main(int argc, char* argv[]) {
                           << "nullptr"
                           << ";";
                     m_src << " // UNIMPLEMENTED: CALL_PARAM_CALLBACK_DATA"
-                          << std::endl;
+                          << '\n';
                     pstr = pvar;
                 } else {
                     pstr = "nullptr";
@@ -474,21 +1149,29 @@ int main(int argc, char* argv[]) {
                 auto null = call_param_array_null_pointer(param);
                 if (null) {
                     pstr = "nullptr";
+                } else if (inPayload(param)) {
+                    pstr = writePayload(param);
                 } else {
-                    auto init = call_param_array_initialiser(param);
+                    auto init = " = {" + call_param_array_initialiser(param) +
+                                "}";
                     auto varname = makeCallParamVarName(param_num);
-                    m_src << makeVectorType(ttype) << " " << varname << " = {"
-                          << init << "};" << std::endl;
+                    if ((ttype == CALL_PARAM_TEMPLATE_TYPE_CHAR) &&
+                        hostArrayOutlivesCall(call)) {
+                        declareHostArray(makeVectorType(ttype), varname, init);
+                    } else {
+                        m_src << makeVectorType(ttype) << " " << varname
+                              << init << ";" << '\n';
+                    }
                     pstr = varname + ".data()";
                 }
             } else if (ptype == CALL_PARAM_PROGRAM_SOURCE) {
                 auto varname = makeCallParamVarName(param_num);
                 m_src << "std::vector<const char*> " << varname << " = {";
-                for (auto& src :
-                     static_cast<CallParamProgramSource*>(param)->sources()) {
-                    m_src << "R\"(" << src << ")\",";
+                auto cps = static_cast<CallParamProgramSource*>(param);
+                for (size_t i = 0; i < cps->num_sources(); i++) {
+                    m_src << "R\"(" << cps->source(i) << ")\",";
                 }
-                m_src << "};" << std::endl;
+                m_src << "};" << '\n';
                 pstr = varname + ".data()";
             } else if (ptype == CALL_PARAM_STRING) {
                 auto varname = makeCallParamVarName(param_num);
@@ -509,6 +1192,25 @@ int main(int argc, char* argv[]) {
             call_var_values.push_back(pstr);
         }
 
+        if (m_bench_open) {
+            for (auto& param : call.params()) {
+                if ((param->type() == CALL_PARAM_OBJECT_USE) &&
+                    (param->ttype() ==
+                     CALL_PARAM_TEMPLATE_TYPE_CL_COMMANDQUEUE)) {
+                    auto& ids = call_param_object_use_ids(param.get());
+                    m_bench_queues.insert(ids.begin(), ids.end());
+                }
+            }
+        }
+
+        bool bench_kernel =
+            m_bench_open && !event_var.empty() &&
+            ((call.id() == oclapi::command::ENQUEUE_NDRANGE_KERNEL) ||
+             (call.id() == oclapi::command::ENQUEUE_TASK));
+        if (bench_kernel) {
+            m_src << "ocltools_bench_enqueue_begin();" << '\n';
+        }
+
         // Return value
         auto& retval = call.retval();
         auto ttype = retval->ttype();
@@ -521,14 +1223,12 @@ int main(int argc, char* argv[]) {
         case CALL_PARAM_OPTIONAL_OBJECT_CREATION: {
             auto& object_ids = call_param_object_creation_ids(retval.get());
             auto varname = handleObjectCreation(ttype, object_ids);
-            m_src << call_param_template_type_name(ttype) << " " << varname
-                  << " = ";
+            assignObject(call_param_template_type_name(ttype), varname);
             break;
         }
         case CALL_PARAM_MAP_POINTER_CREATION: {
             auto p = static_cast<CallParamMapPointerCreation*>(retval.get());
-            uint64_t id = p->id();
-            m_src << "void* MAP_PTR_" << id << " = ";
+            assignObject("void*", "MAP_PTR_" + std::to_string(p->id()));
             break;
         }
         default:
@@ -539,21 +1239,54 @@ int main(int argc, char* argv[]) {
 
         // Call
         std::string callfn{oclapi::command_name(call.id())};
+        if (call.id() == oclapi::command::BUILD_PROGRAM) {
+            // The program may be replaced with one built from cached binaries
+            auto program = call.params()[0].get();
+            auto creation_index =
+                selectObjectVariableTracker(program->ttype())
+                    .at(call_param_object_use_ids(program)[0]);
+            call_var_values[0] = "&" + makeObjectCreationVarName(
+                                           program->ttype(),
+                                           creation_index.first);
+            callfn = "ocltools_build_program";
+        }
         m_src << callfn << "(";
         std::string sep = "";
         for (auto& v : call_var_values) {
             m_src << sep << v;
             sep = ", ";
         }
-        m_src << ");" << std::endl;
+        m_src << ");" << '\n';
+        if (bench_kernel) {
+            m_src << "ocltools_bench_enqueue_end(" << call_var_values[1] << ", "
+                  << event_var << ", " << (event_owned ? "true" : "false")
+                  << ");" << '\n';
+        }
+        replay_live_objects_update(call, m_live);
         m_call_num++;
+        if (call.id() == oclapi::command::FINISH) {
+            m_frame_num++;
+        }
+        benchEnd(false);
     }
 
     void postVisit() override {
-        m_src << std::endl << "}" << std::endl;
+        if (m_split) {
+            finishFile();
+            writeProject();
+            return;
+        }
+        benchEnd(true);
+        for (size_t i = m_bench_next; i < m_bench_ranges.size(); i++) {
+            warn("Can't benchmark %s\n", m_bench_ranges[i].name().c_str());
+        }
+        m_src << '\n' << "}" << '\n';
         m_src.flush();
     }
 
+    // Whether all the files of a split program could be written
+    bool good() const { return !m_failed; }
+
 private:
     object_variables_tracker m_platform_object_variables;
     object_variables_tracker m_device_object_variables;
@@ -563,7 +1296,40 @@ private:
     object_variables_tracker m_kernel_object_variables;
     object_variables_tracker m_mem_object_variables;
     object_variables_tracker m_event_object_variables;
+    object_variables_tracker m_sampler_object_variables;
     uint32_t m_object_creation_num;
+    // Object creations whose variable is a vector
+    std::unordered_set<uint32_t> m_object_vectors;
     uint32_t m_call_num;
-    std::stringstream m_src;
+    // Current file of a split program
+    std::filebuf m_file_buf;
+    std::ostream m_file{nullptr};
+    std::ostream& m_src;
+    bool m_split = false;
+    std::string m_dir;
+    size_t m_calls_per_file = 0;
+    size_t m_num_files = 0;
+    // Definitions of the object variables of a split program, as the
+    // declaration and the initializer
+    std::vector<std::pair<std::string, std::string>> m_globals;
+    bool m_failed = false;
+    // Ranges of calls to benchmark, the calls of the current one being
+    // buffered until it ends
+    std::vector<SourceBenchRange> m_bench_ranges;
+    unsigned m_bench_iterations = 0;
+    size_t m_bench_next = 0;
+    bool m_bench_open = false;
+    std::stringbuf m_bench_body;
+    std::ostringstream m_bench_decls;
+    std::streambuf* m_bench_stream = nullptr;
+    // Objects alive after the calls visited so far, and before the range
+    // being benchmarked
+    replay_live_objects m_live;
+    replay_live_objects m_bench_live;
+    // Queues used by the range being benchmarked, by capture ID
+    std::set<uint64_t> m_bench_queues;
+    size_t m_frame_num = 0;
+    std::ostream* m_payload = nullptr;
+    std::string m_payload_path;
+    uint64_t m_payload_size = 0;
 };
@@ -16,7 +16,7 @@
 
 #include <memory>
 
-#include "call.hpp"
+#include "trace.hpp"
 
 struct TraceVisitor {
 
@@ -32,6 +32,27 @@ struct TraceVisitor {
         postVisit();
     }
 
+    // Streaming variant, calls are visited as they are read from the trace
+    // file and are never all held in memory. Visitors used this way must not
+    // rely on trace.calls().
+    bool visit(Trace& trace, const std::string& filename) {
+        auto on_header = [&]() {
+            preVisit(trace);
+            visitHeader();
+        };
+        auto on_call = [&](const Call& call) {
+            visitCall(call);
+            for (auto& param : call.params()) {
+                visitCallParam(param);
+            }
+        };
+        if (!trace.stream(filename, on_header, on_call)) {
+            return false;
+        }
+        postVisit();
+        return true;
+    }
+
     virtual void preVisit(const Trace& trace){};
     virtual void postVisit(){};
     virtual void visitHeader(){}; // TODO define header
@@ -17,6 +17,7 @@
 import collections
 import filecmp
 import glob
+import json
 import os
 import shutil
 import subprocess
@@ -34,8 +35,10 @@ CLTESTS = os.path.join(BUILD_DIR, 'tests', 'trace', 'cltests')
 CXX_COMPILER = 'g++'
 TMP_FOLDER_PREFIX = 'OpenCL-Tools-trace-'
 
-def run_cltrace(args, cwd=None):
+def run_cltrace(args, cwd=None, log_level=None):
     env = dict(os.environ)
+    if log_level is not None:
+        env['OCLTOOLS_LOG'] = str(log_level)
     lib_paths = [BUILD_DIR]
     if OPENCL_LIB_DIR:
         lib_paths.append(OPENCL_LIB_DIR)
@@ -47,6 +50,7 @@ def run_cltrace(args, cwd=None):
     return res
 
 def compile_source(source, binary, cwd):
+    sources = source if isinstance(source, list) else [source]
     cmd = [
         CXX_COMPILER,
         '-o', binary,
@@ -56,8 +60,7 @@ def compile_source(source, binary, cwd):
     ]
     if OPENCL_LIB_DIR:
         cmd.append('-L{}'.format(OPENCL_LIB_DIR))
-    cmd += [
-        source,
+    cmd += sources + [
         '-lOpenCL'
     ]
     res = subprocess.run(cmd, capture_output=True, cwd=cwd)
@@ -114,6 +117,335 @@ class TestCommandLineInterface(unittest.TestCase):
             self.assertEqual(len(res.stderr), 0)
             self.assertGreater(len(res.stdout), 0)
 
+    def test_export(self):
+        with tempfile.TemporaryDirectory(prefix=TMP_FOLDER_PREFIX) as tmpdir:
+            tracefile = create_capture(tmpdir)
+            for fmt, output in (('chrome-json', 'trace.json'),
+                                ('perfetto', 'trace.pftrace')):
+                res = run_cltrace([tracefile, 'export', '--format', fmt,
+                                   '--output', output], cwd=tmpdir)
+                self.assertEqual(res.returncode, 0)
+                self.assertEqual(len(res.stderr), 0)
+                outfile = os.path.join(tmpdir, output)
+                self.assertGreater(os.path.getsize(outfile), 0)
+            with open(os.path.join(tmpdir, 'trace.json')) as f:
+                events = json.load(f)['traceEvents']
+            self.assertTrue(any(ev['ph'] == 'X' for ev in events))
+
+            # Slices are written in order and don't overlap on a track
+            ends = {}
+            for ev in events:
+                if ev['ph'] != 'X':
+                    continue
+                track = (ev['pid'], ev['tid'])
+                start = round(ev['ts'] * 1000)
+                self.assertGreaterEqual(start, ends.get(track, 0))
+                ends[track] = start + round(ev['dur'] * 1000)
+
+    def test_trim(self):
+        with tempfile.TemporaryDirectory(prefix=TMP_FOLDER_PREFIX) as tmpdir:
+            tracefile = create_capture(tmpdir)
+            res = run_cltrace([tracefile, 'trim', '--from', '10', '--to', '20',
+                               '--output', 'trim.trace'], cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            self.assertEqual(len(res.stderr), 0)
+            res = run_cltrace(['trim.trace', 'generate-source'], cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            self.assertEqual(len(res.stderr), 0)
+            self.assertGreater(len(res.stdout), 0)
+            res = run_cltrace(['trim.trace', 'replay'], cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+
+    def test_replay(self):
+        with tempfile.TemporaryDirectory(prefix=TMP_FOLDER_PREFIX) as tmpdir:
+            tracefile = create_capture(tmpdir)
+            res = run_cltrace([tracefile, 'replay'], cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            self.assertEqual(len(res.stderr), 0)
+
+    def test_replay_queue_threads(self):
+        with tempfile.TemporaryDirectory(prefix=TMP_FOLDER_PREFIX) as tmpdir:
+            tracefile = create_capture(tmpdir)
+            res = run_cltrace([tracefile, 'replay', '--queue-threads'],
+                              cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            self.assertEqual(len(res.stderr), 0)
+
+    def test_replay_bench(self):
+        with tempfile.TemporaryDirectory(prefix=TMP_FOLDER_PREFIX) as tmpdir:
+            tracefile = create_capture(tmpdir)
+            res = run_cltrace([tracefile, 'replay', '--warmup', '1',
+                               '--iterations', '3', '--json', 'bench.json'],
+                              cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            self.assertEqual(len(res.stderr), 0)
+            self.assertGreater(len(res.stdout), 0)
+            with open(os.path.join(tmpdir, 'bench.json')) as f:
+                results = json.load(f)
+            self.assertEqual(len(results['wall']['samples']), 3)
+            for key in ('min', 'median', 'p95', 'p99', 'cv'):
+                self.assertIn(key, results['wall'])
+            res = run_cltrace([tracefile, 'replay', '--iterations', '2',
+                               '--pin-uploads'], cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            self.assertEqual(len(res.stderr), 0)
+
+    def test_replay_program_cache(self):
+        with tempfile.TemporaryDirectory(prefix=TMP_FOLDER_PREFIX) as tmpdir:
+            tracefile = create_capture(tmpdir)
+            cache = os.path.join(tmpdir, 'cache')
+            for _ in range(2):
+                res = run_cltrace([tracefile, 'replay', '--program-cache',
+                                   cache], cwd=tmpdir)
+                self.assertEqual(res.returncode, 0)
+                self.assertEqual(len(res.stderr), 0)
+            self.assertGreater(len(glob.glob(os.path.join(cache, '*.bin'))), 0)
+
+    def test_replay_validate(self):
+        with tempfile.TemporaryDirectory(prefix=TMP_FOLDER_PREFIX) as tmpdir:
+            tracefile = create_capture(tmpdir)
+            res = run_cltrace([tracefile, 'replay', '--validate'], cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            self.assertEqual(len(res.stderr), 0)
+            res = run_cltrace([tracefile, 'replay', '--validate',
+                               '--tolerance', 'ulp:4'], cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            res = run_cltrace([tracefile, 'replay', '--validate',
+                               '--tolerance', 'ulp'], cwd=tmpdir)
+            self.assertNotEqual(res.returncode, 0)
+            # A replacement kernel writing other results must be reported
+            with open(os.path.join(tmpdir, 'wrong.cl'), 'w') as f:
+                f.write('kernel void test_simple(global uint* out) {\n'
+                        '    out[get_global_id(0)] = 0xdead;\n'
+                        '}\n')
+            with open(os.path.join(tmpdir, 'overrides.txt'), 'w') as f:
+                f.write('kernel:test_simple source wrong.cl\n')
+            res = run_cltrace([tracefile, 'replay', '--validate',
+                               '--override', 'overrides.txt'], cwd=tmpdir)
+            self.assertNotEqual(res.returncode, 0)
+            self.assertIn('elements differ', res.stdout.decode())
+            self.assertNotIn(' 0 mismatching', res.stdout.decode())
+
+    def test_replay_devices(self):
+        with tempfile.TemporaryDirectory(prefix=TMP_FOLDER_PREFIX) as tmpdir:
+            tracefile = create_capture(tmpdir)
+            res = run_cltrace([tracefile, 'replay', '--platform', '0',
+                               '--device', '0'], cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            self.assertEqual(len(res.stderr), 0)
+            res = run_cltrace([tracefile, 'replay', '--distribute', 'queues'],
+                              cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            res = run_cltrace([tracefile, 'replay', '--device', '1000'],
+                              cwd=tmpdir)
+            self.assertNotEqual(res.returncode, 0)
+
+    def test_replay_pacing(self):
+        with tempfile.TemporaryDirectory(prefix=TMP_FOLDER_PREFIX) as tmpdir:
+            tracefile = create_capture(tmpdir)
+            for pacing in ['captured', 'asap', 'scaled:0.5']:
+                res = run_cltrace([tracefile, 'replay', '--pacing', pacing],
+                                  cwd=tmpdir)
+                self.assertEqual(res.returncode, 0)
+                self.assertEqual(len(res.stderr), 0)
+                self.assertIn('captured in', res.stdout.decode())
+            res = run_cltrace([tracefile, 'replay', '--pacing', 'scaled'],
+                              cwd=tmpdir)
+            self.assertNotEqual(res.returncode, 0)
+
+    def test_replay_keyframes(self):
+        with tempfile.TemporaryDirectory(prefix=TMP_FOLDER_PREFIX) as tmpdir:
+            tracefile = create_capture(tmpdir)
+            res = run_cltrace([tracefile, 'replay', '--keyframes', 'kf.bin',
+                               '--keyframe-interval', '10'], cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            self.assertEqual(len(res.stderr), 0)
+            for start in ('15', '35'):
+                res = run_cltrace([tracefile, 'replay', '--keyframes',
+                                   'kf.bin', '--start-at', start,
+                                   '--validate'], cwd=tmpdir)
+                self.assertEqual(res.returncode, 0)
+                self.assertEqual(len(res.stderr), 0)
+            # Kernels before the keyframe aren't run
+            res = run_cltrace([tracefile, 'replay', '--keyframes', 'kf.bin',
+                               '--start-at', '35'], cwd=tmpdir, log_level=4)
+            self.assertEqual(res.returncode, 0)
+            out = res.stdout.decode('utf-8')
+            setup = out.split('Restored the keyframe')[0]
+            self.assertNotIn('Replaying clEnqueueNDRangeKernel', setup)
+
+    def test_replay_override(self):
+        with tempfile.TemporaryDirectory(prefix=TMP_FOLDER_PREFIX) as tmpdir:
+            tracefile = create_capture(tmpdir)
+            with open(os.path.join(tmpdir, 'overrides.txt'), 'w') as f:
+                f.write('kernel:kernel_1 options -cl-fast-relaxed-math\n')
+            res = run_cltrace([tracefile, 'replay', '--override',
+                               'overrides.txt'], cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            self.assertIn('override', res.stdout.decode())
+            with open(os.path.join(tmpdir, 'bad.txt'), 'w') as f:
+                f.write('kernel:kernel_1 recompile\n')
+            res = run_cltrace([tracefile, 'replay', '--override', 'bad.txt'],
+                              cwd=tmpdir)
+            self.assertNotEqual(res.returncode, 0)
+
+    def test_replay_modes(self):
+        with tempfile.TemporaryDirectory(prefix=TMP_FOLDER_PREFIX) as tmpdir:
+            tracefile = create_capture(tmpdir)
+            for mode in ['compute', 'transfers']:
+                res = run_cltrace([tracefile, 'replay', '--mode', mode],
+                                  cwd=tmpdir)
+                self.assertEqual(res.returncode, 0)
+                self.assertEqual(len(res.stderr), 0)
+                self.assertIn('only, skipping', res.stdout.decode())
+                res = run_cltrace([tracefile, 'replay', '--mode', mode,
+                                   '--iterations', '2'], cwd=tmpdir)
+                self.assertEqual(res.returncode, 0)
+
+    def test_replay_instances(self):
+        with tempfile.TemporaryDirectory(prefix=TMP_FOLDER_PREFIX) as tmpdir:
+            tracefile = create_capture(tmpdir)
+            res = run_cltrace([tracefile, 'replay', '--instances', '3'],
+                              cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            self.assertEqual(len(res.stderr), 0)
+            self.assertIn('Aggregate throughput', res.stdout.decode())
+            self.assertIn('of setup', res.stdout.decode())
+
+    def test_tune(self):
+        with tempfile.TemporaryDirectory(prefix=TMP_FOLDER_PREFIX) as tmpdir:
+            tracefile = create_capture(tmpdir)
+            res = run_cltrace([tracefile, 'tune', '-r', '2'], cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            self.assertEqual(len(res.stderr), 0)
+            self.assertIn('speedup', res.stdout.decode())
+
+    def test_verify(self):
+        with tempfile.TemporaryDirectory(prefix=TMP_FOLDER_PREFIX) as tmpdir:
+            tracefile = create_capture(tmpdir)
+            res = run_cltrace([tracefile, 'verify'], cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            self.assertEqual(len(res.stderr), 0)
+
+            # Flip a bit in the middle of the trace
+            path = os.path.join(tmpdir, tracefile)
+            with open(path, 'r+b') as f:
+                f.seek(os.path.getsize(path) // 2)
+                byte = f.read(1)
+                f.seek(-1, os.SEEK_CUR)
+                f.write(bytes([byte[0] ^ 1]))
+            res = run_cltrace([tracefile, 'verify'], cwd=tmpdir)
+            self.assertNotEqual(res.returncode, 0)
+            res = run_cltrace([tracefile, 'info'], cwd=tmpdir)
+            self.assertNotEqual(res.returncode, 0)
+
+    def test_drop_queries(self):
+        with tempfile.TemporaryDirectory(prefix=TMP_FOLDER_PREFIX) as tmpdir:
+            tracefile = create_capture(tmpdir)
+            res = run_cltrace([tracefile, 'generate-source'], cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            full = res.stdout.decode('utf-8')
+            res = run_cltrace([tracefile, 'generate-source', '--drop-queries'],
+                              cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            self.assertEqual(len(res.stderr), 0)
+            dropped = res.stdout.decode('utf-8')
+            self.assertLess(dropped.count('clGetDeviceInfo'),
+                            full.count('clGetDeviceInfo'))
+
+    def test_generate_source_output(self):
+        with tempfile.TemporaryDirectory(prefix=TMP_FOLDER_PREFIX) as tmpdir:
+            tracefile = create_capture(tmpdir)
+            res = run_cltrace([tracefile, 'generate-source'], cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            res_file = run_cltrace([tracefile, 'generate-source', '-o',
+                                    'gen.cpp'], cwd=tmpdir)
+            self.assertEqual(res_file.returncode, 0)
+            self.assertEqual(len(res_file.stdout), 0)
+            with open(os.path.join(tmpdir, 'gen.cpp')) as f:
+                self.assertEqual(f.read(), res.stdout.decode('utf-8'))
+
+    def test_generate_source_payload(self):
+        with tempfile.TemporaryDirectory(prefix=TMP_FOLDER_PREFIX) as tmpdir:
+            tracefile = create_capture(tmpdir)
+            res = run_cltrace([tracefile, 'generate-source', '--payload',
+                               'payload.bin'], cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            self.assertEqual(len(res.stderr), 0)
+            self.assertIn('ocltools_map_payload', res.stdout.decode('utf-8'))
+            srcfile = os.path.join(tmpdir, 'gen.cpp')
+            with open(srcfile, 'w') as f:
+                f.write(res.stdout.decode('utf-8'))
+            binary = os.path.join(tmpdir, 'gen')
+            res = compile_source(srcfile, binary, tmpdir)
+            self.assertEqual(res.returncode, 0)
+
+            # The program regenerated from its own trace has the same payload
+            res = run_cltrace(['gen.trace', 'capture', binary], cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            gentrace = glob.glob(os.path.join(tmpdir, 'gen.trace.*'))[0]
+            regendir = os.path.join(tmpdir, 'regen')
+            os.mkdir(regendir)
+            res = run_cltrace([gentrace, 'generate-source', '--payload',
+                               'payload.bin'], cwd=regendir)
+            self.assertEqual(res.returncode, 0)
+            self.assertEqual(res.stdout.decode('utf-8'),
+                             open(srcfile).read())
+            self.assertTrue(filecmp.cmp(
+                os.path.join(tmpdir, 'payload.bin'),
+                os.path.join(regendir, 'payload.bin'), shallow=False))
+
+    def test_generate_source_split(self):
+        with tempfile.TemporaryDirectory(prefix=TMP_FOLDER_PREFIX) as tmpdir:
+            tracefile = create_capture(tmpdir)
+            res = run_cltrace([tracefile, 'generate-source'], cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            source = res.stdout.decode('utf-8')
+            res = run_cltrace([tracefile, 'generate-source', '--split', '4',
+                               '--output-dir', 'proj'], cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            projdir = os.path.join(tmpdir, 'proj')
+            for name in ['CMakeLists.txt', 'ocltools-repro.hpp', 'main.cpp',
+                         'calls-0.cpp']:
+                self.assertTrue(os.path.exists(os.path.join(projdir, name)))
+            # Host memory used after its call returns outlives the function
+            # making the call
+            with open(os.path.join(projdir, 'ocltools-repro.hpp')) as f:
+                self.assertRegex(f.read(),
+                                 r'extern std::vector<char> call_\d+_p\d+;')
+            sources = sorted(glob.glob(os.path.join(projdir, '*.cpp')))
+            binary = os.path.join(tmpdir, 'repro')
+            res = compile_source(sources, binary, tmpdir)
+            self.assertEqual(res.returncode, 0)
+
+            # The split program makes the same calls
+            res = run_cltrace(['repro.trace', 'capture', binary], cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            reprotrace = glob.glob(os.path.join(tmpdir, 'repro.trace.*'))[0]
+            res = run_cltrace([reprotrace, 'generate-source'], cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            self.assertEqual(res.stdout.decode('utf-8'), source)
+
+    def test_generate_source_bench(self):
+        with tempfile.TemporaryDirectory(prefix=TMP_FOLDER_PREFIX) as tmpdir:
+            tracefile = create_capture(tmpdir)
+            res = run_cltrace([tracefile, 'generate-source', '--bench', '4:2'],
+                              cwd=tmpdir)
+            self.assertNotEqual(res.returncode, 0)
+            res = run_cltrace([tracefile, 'generate-source', '--bench',
+                               '0:1000000', '--bench-iterations', '2', '-o',
+                               'bench.cpp'], cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            srcfile = os.path.join(tmpdir, 'bench.cpp')
+            with open(srcfile) as f:
+                self.assertIn('CL_QUEUE_PROFILING_ENABLE', f.read())
+            binary = os.path.join(tmpdir, 'bench')
+            res = compile_source(srcfile, binary, tmpdir)
+            self.assertEqual(res.returncode, 0)
+            res = run_cltrace(['bench.trace', 'capture', binary], cwd=tmpdir)
+            self.assertEqual(res.returncode, 0)
+            self.assertIn('2 iterations', res.stdout.decode('utf-8'))
+
 class TestRoundTrip(unittest.TestCase):
 
     def test_round_trip(self):
@@ -178,7 +510,6 @@ class TestRoundTrip(unittest.TestCase):
             self.assertTrue(filecmp.cmp(srcfile, gensrcfile))
 
 
-# TODO test replay
 # TODO test trace contents
 
 if __name__ == '__main__':
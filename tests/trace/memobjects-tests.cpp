@@ -127,6 +127,23 @@ TEST_F(WithCommandQueue, clEnqueueReadWriteBufferTest) {
     ASSERT_EQ(host_buffer_1, host_buffer_2);
 }
 
+TEST_F(WithCommandQueue, clEnqueueReadWriteBufferNonBlockingTest) {
+    std::vector<char> host_buffer_1(TEST_BUFFER_SIZE, 'a');
+    std::vector<char> host_buffer_2(TEST_BUFFER_SIZE);
+    std::vector<char> host_buffer_3(TEST_BUFFER_SIZE);
+
+    auto device_buffer = CreateBuffer(CL_MEM_USE_HOST_PTR, TEST_BUFFER_SIZE,
+                                      host_buffer_3.data());
+
+    EnqueueWriteBuffer(device_buffer, false, 0, TEST_BUFFER_SIZE,
+                       host_buffer_1.data());
+    EnqueueReadBuffer(device_buffer, false, 0, TEST_BUFFER_SIZE,
+                      host_buffer_2.data());
+    Finish();
+
+    ASSERT_EQ(host_buffer_1, host_buffer_2);
+}
+
 #if ENABLE_UNIMPLEMENTED
 TEST_F(WithCommandQueue, clEnqueueReadWriteBufferRectTest) {
     auto device_buffer =
@@ -72,4 +72,11 @@ TEST_F(WithCommandQueue, Simple) {
     // Unmap the buffer
     EnqueueUnmapMemObject(buffer, data);
     Finish();
+
+    // Read the result back
+    std::vector<cl_uint> results(BUFFER_SIZE / sizeof(cl_uint));
+    EnqueueReadBuffer(buffer, CL_TRUE, 0, BUFFER_SIZE, results.data());
+    for (cl_uint i = 0; i < results.size(); ++i) {
+        EXPECT_EQ(results[i], i);
+    }
 }